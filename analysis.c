@@ -5,140 +5,340 @@
 #include "analysis.h"
 #include "rule_parser.h"
 #include "hash_tables.h"
+#include "input_stream.h"
+#include "evaluator.h"
+#include "random.h"
+#include "ngram_export.h"
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 
-// Global counters
-long unigram_count = 0;
-long bigram_count = 0;
-long trigram_count = 0;
-long transition_count = 0;
-long starter_count = 0;
+// Splits a weighted "count<TAB>rule" (or "uniq -c" style "count rule") line
+// Returns the multiplicity and points rule at the text after the separator, or 0 if malformed
+long parseWeightedLine(char *line, char **rule) {
+    char *p = line;
 
-extern int max_operation_count[4];
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p < '0' || *p > '9') return 0;
 
-void analyseRuleStream(FILE *file, int verbose) {
-    char line[MAX_RULE_LEN];
-    long rule_count = 0;
+    // A count too large for a long is malformed rather than wrapped
+    errno = 0;
+    long weight = strtol(p, &p, 10);
+    if (errno == ERANGE) return 0;
+    if (*p != '\t' && *p != ' ') return 0;
 
-    if (verbose) {
-        fprintf(stderr, "Starting analysis...\n");
+    *rule = p + 1;
+    return weight;
+}
+
+// Validates one rule and adds its starter, unigrams and bigrams to the model
+int analyseRule(RuleChef *chef, char *line, long weight, int verbose) {
+    // Validate, normalize and parse the rule
+    ParsedRule parsed;
+    if (!tokenizeRule(line, &parsed)) {
+        if (verbose) {
+            fprintf(stderr, "Invalid rule skipped: %s\n", line);
+        }
+        return 0;
     }
 
-    //Get filesize
-    fseeko(file, 0, SEEK_END);
-    size_t f_size = ftello(file);
-    fseeko(file, 0, SEEK_SET);
-    size_t f_readbytes = 0;
+    chef->rule_count++;
 
-    while (fgets(line, sizeof(line), file)) {
+    // First (unigrams)
+    if (parsed.op_count > 0) {
+        addStarterOperationHashed(chef, &parsed.operations[0], weight);
+    }
 
-        f_readbytes += strlen(line);
-        char *p = line + strlen(line) - 1;
-        if (*p == '\n') *p = '\0';
-        if ((p != line) && (*--p == '\r')) *p = '\0';
+    // Remaining (unigrams)
+    for (int j = 0; j < parsed.op_count; j++) {
+        addUnigramHashed(chef, &parsed.operations[j], weight);
+    }
 
-        if (strlen(line) == 0) continue;
+    for (int j = 0; j < parsed.op_count - 1; j++) {
+        // Consecutive ops are already laid out as a bigram
+        addBigramHashed(chef, &parsed.operations[j], weight);
+    }
+
+    /*
+    for (int j = 0; j < parsed.op_count - 2; j++) {
+
+        CompleteOperation trigram_ops[3] = {
+            parsed.operations[j],
+            parsed.operations[j+1],
+            parsed.operations[j+2]
+        };
+        addTrigramHashed(chef, trigram_ops, weight);
+    }
+    */
+
+    return 1;
+}
 
-        // Validate and normalize rule
-        //if (packrules(line)) {
-        if (!validateRule(line)) {
+typedef struct {
+    long rules;
+    long weighted;
+    long lost;          // Held-out lines that could not be kept
+} StreamTotals;
+
+// Splits off the weight of one input line and analyses it, raw is left untouched
+static void analyseStreamLine(RuleChef *chef, RuleInput *input, const char *raw, size_t length,
+                              int verbose, int weighted, StreamTotals *totals) {
+    char buffer[MAX_RULE_LEN + 32]; // Room for a count prefix when weighted
+    char *line = buffer;
+
+    if (length == 0) return;
+
+    if (length >= (weighted ? sizeof(buffer) : MAX_RULE_LEN)) {
+        if (verbose) {
+            fprintf(stderr, "Invalid rule skipped (too long): %.*s...\n", MAX_RULE_LEN, raw);
+        }
+        return;
+    }
+    memcpy(buffer, raw, length + 1);
+
+    long weight = 1;
+    if (weighted) {
+        weight = parseWeightedLine(buffer, &line);
+        if (weight <= 0) {
             if (verbose) {
-                fprintf(stderr, "Invalid rule skipped: %s\n", line);
+                fprintf(stderr, "Invalid weighted line skipped: %s\n", buffer);
             }
-            continue;
+            return;
         }
-
-        // Parse rule into operations
-        ParsedRule parsed;
-        if (!parseRuleIntoOperations(line, &parsed)) {
+        if (strlen(line) >= MAX_RULE_LEN) {
             if (verbose) {
-                fprintf(stderr, "Failed to parse rule: %s\n", line);
+                fprintf(stderr, "Invalid rule skipped: %s\n", line);
             }
-            continue;
+            return;
         }
+    }
 
-        rule_count++;
-
-        if (verbose && rule_count % 10000 == 0) {
-            fprintf(stderr, "Processed %ld rules...\n", rule_count);
+    // Held-out lines are kept for evaluation and never reach the model
+    if (chef->holdout != NULL &&
+        (splitMix64(&chef->holdout_state) >> 11) * (1.0 / 9007199254740992.0) < chef->holdout_ratio) {
+        // After a failed allocation the rest are dropped too rather than reporting each one
+        if (totals->lost > 0 || addEvalRule(chef->holdout, line, weight) < 0) {
+            totals->lost++;
         }
+        return;
+    }
 
-        // First (unigrams)
-        if (parsed.op_count > 0) {
-            addStarterOperationHashed(&parsed.operations[0]);
-        }
+    if (!analyseRule(chef, line, weight, verbose)) {
+        return;
+    }
 
-        // Remaining (unigrams)
-        for (int j = 0; j < parsed.op_count; j++) {
-            addUnigramHashed(&parsed.operations[j]);
-        }
+    totals->rules++;
+    totals->weighted += weight;
 
-        for (int j = 0; j < parsed.op_count - 1; j++) {
+    if (verbose && totals->rules % 10000 == 0) {
+        fprintf(stderr, "Processed %ld rules...\n", totals->rules);
+    }
 
-            CompleteOperation bigram_ops[2] = {parsed.operations[j], parsed.operations[j+1]};
-            addBigramHashed(bigram_ops);
+    if (totals->rules % 50000 == 0) {
+        if (verbose) {
+            // Size is unknown (0) for pipes and stdin
+            size_t f_size = getRuleInputSize(input);
+            size_t f_readbytes = getRuleInputPosition(input);
+            if (f_size > 0) {
+                double progress = ((double)f_readbytes/f_size)*100;
+                fprintf(stderr, "Current stats: %ld starters, %ld unigrams, %ld bigrams, %ld trigrams, %.2f%%\n",
+                        chef->starter_count, chef->unigram_count, chef->bigram_count, chef->trigram_count, progress);
+            } else {
+                fprintf(stderr, "Current stats: %ld starters, %ld unigrams, %ld bigrams, %ld trigrams, %.2f MB read\n",
+                        chef->starter_count, chef->unigram_count, chef->bigram_count, chef->trigram_count,
+                        (double)f_readbytes / (1024 * 1024));
+            }
         }
+    }
+}
+
+// Lines until the next one taken when each line is kept with probability keep, geometrically distributed
+static size_t drawLineGap(SampleRandom *rng, double keep) {
+    if (keep >= 1.0) return 0;
+    double gap = floor(log(1.0 - nextUniform(rng)) / log1p(-keep));
+    return gap < 1e18 ? (size_t)gap : (size_t)1e18;
+}
+
+// Skips gap lines, returns 0 when the input ends first
+static int skipStreamLines(InputSampling *sampling, RuleInput *input, size_t gap) {
+    size_t skipped = skipRuleLines(input, gap);
+    sampling->lines_read += skipped;
+    return skipped == gap;
+}
+
+// Each line is kept with probability rate. Only the kept lines are copied and parsed
+static void analyseStrideSample(RuleChef *chef, RuleInput *input, int verbose, int weighted, StreamTotals *totals) {
+    InputSampling *sampling = &chef->input_sampling;
+    SampleRandom rng;
+    size_t length;
+    char *raw;
+
+    seedRandom(&rng, sampling->seed, 0);
+    while (skipStreamLines(sampling, input, drawLineGap(&rng, sampling->rate)) &&
+           (raw = readRuleLine(input, &length)) != NULL) {
+        sampling->lines_read++;
+        sampling->lines_sampled++;
+        analyseStreamLine(chef, input, raw, length, verbose, weighted, totals);
+    }
+}
+
+typedef struct {
+    char *text;
+    size_t length;
+} ReservoirLine;
+
+static int storeReservoirLine(ReservoirLine *slot, const char *raw, size_t length) {
+    char *text = realloc(slot->text, length + 1);
+    if (text == NULL) {
+        fprintf(stderr, "Failed to allocate sampled line\n");
+        return 0;
+    }
+    memcpy(text, raw, length + 1);
+    slot->text = text;
+    slot->length = length;
+    return 1;
+}
 
-        /*
-        for (int j = 0; j < parsed.op_count - 2; j++) {
+static void freeReservoir(ReservoirLine *reservoir, long filled) {
+    for (long i = 0; i < filled; i++) {
+        free(reservoir[i].text);
+    }
+    free(reservoir);
+}
 
-            CompleteOperation trigram_ops[3] = {
-                parsed.operations[j],
-                parsed.operations[j+1],
-                parsed.operations[j+2]
-            };
-            addTrigramHashed(trigram_ops);
+// Uniform sample of exactly sampling->lines lines (or all of them), Li's algorithm L: the number of
+// lines before the next replacement is drawn directly, so lines that are never kept are never copied
+// Returns 0 when the reservoir cannot be allocated, nothing has been analysed then
+static int analyseReservoirSample(RuleChef *chef, RuleInput *input, int verbose, int weighted, StreamTotals *totals) {
+    InputSampling *sampling = &chef->input_sampling;
+    long capacity = sampling->lines;
+    long allocated = 0;
+    long filled = 0;
+    ReservoirLine *reservoir = NULL;
+    SampleRandom rng;
+    size_t length;
+    char *raw;
+
+    // Grown while filling, a reservoir larger than the input costs no more than the input
+    while (filled < capacity && (raw = readRuleLine(input, &length)) != NULL) {
+        if (filled == allocated) {
+            allocated = allocated ? allocated * 2 : 65536;
+            if (allocated > capacity) allocated = capacity;
+            ReservoirLine *grown = realloc(reservoir, allocated * sizeof(ReservoirLine));
+            if (grown == NULL) {
+                fprintf(stderr, "Failed to allocate a reservoir of %ld lines\n", allocated);
+                freeReservoir(reservoir, filled);
+                return 0;
+            }
+            reservoir = grown;
+        }
+        sampling->lines_read++;
+        reservoir[filled].text = NULL;
+        if (!storeReservoirLine(&reservoir[filled++], raw, length)) {
+            freeReservoir(reservoir, filled);
+            return 0;
         }
-        */
+    }
 
-        if (rule_count % 50000 == 0) {
-            if (verbose) {
-                double progress = ((double)f_readbytes/f_size)*100;
-                fprintf(stderr, "Current stats: %ld starters, %ld unigrams, %ld bigrams, %ld trigrams, %.2f%%\n",
-                        starter_count,unigram_count, bigram_count, trigram_count,  progress);
+    if (filled == capacity) {
+        seedRandom(&rng, sampling->seed, 0);
+        double w = exp(log(1.0 - nextUniform(&rng)) / capacity);
+        while (skipStreamLines(sampling, input, drawLineGap(&rng, w)) &&
+               (raw = readRuleLine(input, &length)) != NULL) {
+            sampling->lines_read++;
+            if (!storeReservoirLine(&reservoir[nextRandom(&rng) % (uint64_t)capacity], raw, length)) {
+                freeReservoir(reservoir, filled);
+                return 0;
             }
+            w *= exp(log(1.0 - nextUniform(&rng)) / capacity);
         }
     }
 
-    calculateBigramProbabilities();
-    if (verbose) {
-        fprintf(stderr, "Analysis complete. Processed %ld rules\n", rule_count);
-        fprintf(stderr, "Final stats: %ld starters, %ld unigrams, %ld bigrams, %ld trigrams\n",
-                starter_count, unigram_count, bigram_count, trigram_count);
+    for (long i = 0; i < filled; i++) {
+        sampling->lines_sampled++;
+        analyseStreamLine(chef, input, reservoir[i].text, reservoir[i].length, verbose, weighted, totals);
+        free(reservoir[i].text);
     }
+    free(reservoir);
+    return 1;
 }
 
-void printStarterOperationStats() {
-    fprintf(stderr, "\nTop Rule-Starting Operations:\n");
+int analyseRuleStream(RuleChef *chef, RuleInput *input, int verbose, int weighted) {
+    InputSampling *sampling = &chef->input_sampling;
+    StreamTotals totals = {0, 0, 0};
+    long lines_read = sampling->lines_read;
+    long lines_sampled = sampling->lines_sampled;
+
+    if (verbose) {
+        fprintf(stderr, "Starting analysis...\n");
+    }
 
-    // Extract starters from hash table
-    int starter_total = 0;
-    OperationNGram *extracted_starters = extractNGramsFromHashTable(
-        starter_hash_table, STARTER_HASH_SIZE, 1, &starter_total);
+    if (sampling->lines > 0) {
+        if (!analyseReservoirSample(chef, input, verbose, weighted, &totals)) {
+            return 0;
+        }
+    } else if (sampling->rate > 0.0) {
+        analyseStrideSample(chef, input, verbose, weighted, &totals);
+    } else {
+        size_t length;
+        char *raw;
+        while ((raw = readRuleLine(input, &length)) != NULL) {
+            sampling->lines_read++;
+            sampling->lines_sampled++;
+            analyseStreamLine(chef, input, raw, length, verbose, weighted, &totals);
+        }
+    }
 
-    if (extracted_starters != NULL && starter_total > 0) {
-        qsort(extracted_starters, starter_total, sizeof(OperationNGram), compareNGramsByFrequency);
+    // With sort based counting the bigram totals above only cover earlier files
+    int counted = flushSortedBigrams(chef);
 
-        int show_count = starter_total < 20 ? starter_total : 20;
-        for (int i = 0; i < show_count; i++) {
-            fprintf(stderr, "'%s': %ld occurrences as rule starter\n",
-                   extracted_starters[i].ops[0].full_op, extracted_starters[i].frequency);
+    if (verbose) {
+        fprintf(stderr, "Analysis complete. Processed %ld rules\n", totals.rules);
+        if (sampling->lines > 0 || sampling->rate > 0.0) {
+            lines_read = sampling->lines_read - lines_read;
+            lines_sampled = sampling->lines_sampled - lines_sampled;
+            fprintf(stderr, "Sampled %ld of %ld lines (%.2f%%), effective sample size %ld rules\n",
+                    lines_sampled, lines_read, lines_read > 0 ? 100.0 * lines_sampled / lines_read : 0.0,
+                    totals.rules);
+        }
+        if (weighted) {
+            fprintf(stderr, "Weighted input: %ld total rule occurrences\n", totals.weighted);
         }
-        free(extracted_starters);
+        fprintf(stderr, "Final stats: %ld starters, %ld unigrams, %ld bigrams, %ld trigrams\n",
+                chef->starter_count, chef->unigram_count, chef->bigram_count, chef->trigram_count);
+    }
+    return counted && totals.lost == 0;
+}
+
+void printStarterOperationStats(RuleChef *chef) {
+    NGramRef top[20];
+
+    fprintf(stderr, "\nTop Rule-Starting Operations:\n");
+    int show_count = selectTopNGrams(&chef->starter_hash_table, 1, 20, top);
+    for (int i = 0; i < show_count; i++) {
+        fprintf(stderr, "'%s': %ld occurrences as rule starter\n",
+               top[i].ngram->ops[0].full_op, top[i].ngram->frequency);
     }
 }
 
 // Print hash table statistics for all n-gram types
-static void printHashTableStatsForType(NGramHashNode **hash_table, int hash_size, const char *type) {
-    int used_buckets = 0;
+static void printHashTableStatsForType(NGramHashTable *table, const char *type) {
+    long used_buckets = 0;
     int max_chain_length = 0;
-    int total_nodes = 0;
+    long total_nodes = 0;
+    long hash_size = table->size;
+
+    if (table->buckets == NULL) {
+        fprintf(stderr, "%s hash table stats:\n", type);
+        fprintf(stderr, "  Not allocated (no %ss)\n\n", type);
+        return;
+    }
 
-    for (int i = 0; i < hash_size; i++) {
-        if (hash_table[i] != NULL) {
+    for (long i = 0; i < hash_size; i++) {
+        if (table->buckets[i] != NULL) {
             used_buckets++;
             int chain_length = 0;
-            NGramHashNode *node = hash_table[i];
+            NGramHashNode *node = table->buckets[i];
             while (node != NULL) {
                 chain_length++;
                 total_nodes++;
@@ -151,8 +351,8 @@ static void printHashTableStatsForType(NGramHashNode **hash_table, int hash_size
     }
 
     fprintf(stderr, "%s hash table stats:\n", type);
-    fprintf(stderr, "  Total %ss: %d\n", type, total_nodes);
-    fprintf(stderr, "  Used buckets: %d/%d (%.2f%%)\n",
+    fprintf(stderr, "  Total %ss: %ld\n", type, total_nodes);
+    fprintf(stderr, "  Used buckets: %ld/%ld (%.2f%%)\n",
             used_buckets, hash_size,
             100.0 * used_buckets / hash_size);
     fprintf(stderr, "  Max chain length: %d\n", max_chain_length);
@@ -161,110 +361,47 @@ static void printHashTableStatsForType(NGramHashNode **hash_table, int hash_size
     fprintf(stderr, "\n");
 }
 
-void printAllNGramHashTableStats() {
-    printHashTableStatsForType(unigram_hash_table, UNIGRAM_HASH_SIZE, "Unigram");
-    printHashTableStatsForType(bigram_hash_table, max_operation_count[2], "Bigram");
-    printHashTableStatsForType(trigram_hash_table, max_operation_count[3], "Trigram");
+void printAllNGramHashTableStats(RuleChef *chef) {
+    printHashTableStatsForType(&chef->unigram_hash_table, "Unigram");
+    printHashTableStatsForType(&chef->bigram_hash_table, "Bigram");
+    printHashTableStatsForType(&chef->trigram_hash_table, "Trigram");
 }
 
 
-void printTopNGramsFromHashTable() {
-    fprintf(stderr, "\n=== Rule Analysis Statistics (from Hash Tables) ===\n");
-
-    // Print top unigrams
-    int unigram_total = 0;
-    OperationNGram *extracted_unigrams = extractNGramsFromHashTable(
-        unigram_hash_table, UNIGRAM_HASH_SIZE, 1, &unigram_total);
+// Only the few shown are selected, the tables are never copied or sorted
+void printTopNGramsFromHashTable(RuleChef *chef) {
+    NGramRef top[20];
+    int show_count;
 
-    if (extracted_unigrams != NULL && unigram_total > 0) {
-        qsort(extracted_unigrams, unigram_total, sizeof(OperationNGram), compareNGramsByFrequency);
+    fprintf(stderr, "\n=== Rule Analysis Statistics (from Hash Tables) ===\n");
 
+    show_count = selectTopNGrams(&chef->unigram_hash_table, 1, 20, top);
+    if (show_count > 0) {
         fprintf(stderr, "\nTop Complete Operations (Unigrams):\n");
-        int show_count = unigram_total < 20 ? unigram_total : 20;
         for (int i = 0; i < show_count; i++) {
             fprintf(stderr, "'%s': %ld occurrences\n",
-                   extracted_unigrams[i].ops[0].full_op, extracted_unigrams[i].frequency);
+                   top[i].ngram->ops[0].full_op, top[i].ngram->frequency);
         }
-        free(extracted_unigrams);
     }
 
-    // Print top bigrams
-    int bigram_total = 0;
-    OperationNGram *extracted_bigrams = extractNGramsFromHashTable(
-        bigram_hash_table, max_operation_count[2], 2, &bigram_total);
-
-    if (extracted_bigrams != NULL && bigram_total > 0) {
-        qsort(extracted_bigrams, bigram_total, sizeof(OperationNGram), compareNGramsByFrequency);
-
+    show_count = selectTopNGrams(&chef->bigram_hash_table, 2, 15, top);
+    if (show_count > 0) {
         fprintf(stderr, "\nTop Operation Pairs (Bigrams):\n");
-        int show_count = bigram_total < 15 ? bigram_total : 15;
         for (int i = 0; i < show_count; i++) {
             fprintf(stderr, "'%s' -> '%s': %ld occurrences\n",
-                   extracted_bigrams[i].ops[0].full_op, extracted_bigrams[i].ops[1].full_op,
-                   extracted_bigrams[i].frequency);
+                   top[i].ngram->ops[0].full_op, top[i].ngram->ops[1].full_op, top[i].ngram->frequency);
         }
-        free(extracted_bigrams);
     }
 
-    // Print top trigrams
-    int trigram_total = 0;
-    OperationNGram *extracted_trigrams = extractNGramsFromHashTable(
-        trigram_hash_table, max_operation_count[3], 3, &trigram_total);
-
-    if (extracted_trigrams != NULL && trigram_total > 0) {
-        qsort(extracted_trigrams, trigram_total, sizeof(OperationNGram), compareNGramsByFrequency);
-
+    show_count = selectTopNGrams(&chef->trigram_hash_table, 3, 10, top);
+    if (show_count > 0) {
         fprintf(stderr, "\nTop Operation Triplets (Trigrams):\n");
-        int show_count = trigram_total < 10 ? trigram_total : 10;
         for (int i = 0; i < show_count; i++) {
             fprintf(stderr, "'%s' -> '%s' -> '%s': %ld occurrences\n",
-                   extracted_trigrams[i].ops[0].full_op, extracted_trigrams[i].ops[1].full_op,
-                   extracted_trigrams[i].ops[2].full_op, extracted_trigrams[i].frequency);
-        }
-        free(extracted_trigrams);
-    }
-
-    printStarterOperationStats();
-}
-
-
-OperationNGram* extractNGramsFromHashTable(NGramHashNode **hash_table, int hash_size, int ngram_type, int *total_count) {
-    // First pass: count total n-grams
-    *total_count = 0;
-    for (int i = 0; i < hash_size; i++) {
-        NGramHashNode *node = hash_table[i];
-        while (node != NULL) {
-            if (node->ngram.op_count == ngram_type) {
-                (*total_count)++;
-            }
-            node = node->next;
-        }
-    }
-
-    if (*total_count == 0) return NULL;
-
-    // Allocate array for n-grams
-    OperationNGram *ngrams = malloc(*total_count * sizeof(OperationNGram));
-    if (ngrams == NULL) {
-        fprintf(stderr, "Failed to allocate memory for n-gram extraction\n");
-        *total_count = 0;
-        return NULL;
-    }
-
-    // Second pass: copy n-grams to array
-    int index = 0;
-    for (int i = 0; i < hash_size; i++) {
-        NGramHashNode *node = hash_table[i];
-        while (node != NULL && index < *total_count) {
-            if (node->ngram.op_count == ngram_type) {
-                ngrams[index] = node->ngram;
-                index++;
-            }
-            node = node->next;
+                   top[i].ngram->ops[0].full_op, top[i].ngram->ops[1].full_op,
+                   top[i].ngram->ops[2].full_op, top[i].ngram->frequency);
         }
     }
 
-    return ngrams;
+    printStarterOperationStats(chef);
 }
-
-
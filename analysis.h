@@ -2,14 +2,19 @@
 #define ANALYSIS_H
 
 #include "types.h"
+#include "input_stream.h"
 
 // Analysis functions
-void analyseRuleStream(FILE *file, int verbose);
+long parseWeightedLine(char *line, char **rule);
+int analyseRule(RuleChef *chef, char *line, long weight, int verbose);
+// Returns 0 when memory runs out and lines or counts were lost
+int analyseRuleStream(RuleChef *chef, RuleInput *input, int verbose, int weighted);
 
 // Comparison functions
 int compareOperationNGrams(const void *a, const void *b);
 int compareOperationTransitions(const void *a, const void *b);
 
 
-void printAllNGramHashTableStats();
+void printAllNGramHashTableStats(RuleChef *chef);
+void printTopNGramsFromHashTable(RuleChef *chef);
 #endif
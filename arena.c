@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void initArena(Arena *arena, int huge_pages) {
+    arena->head = NULL;
+    arena->spare = NULL;
+    arena->mapped = 0;
+    arena->huge_pages = huge_pages;
+}
+
+static void unmapBlocks(Arena *arena, ArenaBlock *block) {
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        arena->mapped -= block->size;
+        munmap(block, block->size);
+        block = next;
+    }
+}
+
+void freeArena(Arena *arena) {
+    unmapBlocks(arena, arena->head);
+    unmapBlocks(arena, arena->spare);
+    arena->head = NULL;
+    arena->spare = NULL;
+}
+
+static ArenaBlock *mapBlock(Arena *arena, size_t size) {
+    void *memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (arena->huge_pages) {
+        // Only succeeds when the administrator has reserved huge pages
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (arena->huge_pages) {
+            madvise(memory, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    ArenaBlock *block = (ArenaBlock *)memory;
+    block->size = size;
+    block->used = ARENA_HEADER;
+    arena->mapped += size;
+    return block;
+}
+
+// Takes a spare block that is large enough, or maps a new one
+static ArenaBlock *newBlock(Arena *arena, size_t needed) {
+    ArenaBlock **link = &arena->spare;
+    while (*link != NULL) {
+        if ((*link)->size >= needed) {
+            ArenaBlock *block = *link;
+            *link = block->next;
+            block->used = ARENA_HEADER;
+            return block;
+        }
+        link = &(*link)->next;
+    }
+
+    size_t size = (needed + ARENA_BLOCK_SIZE - 1) / ARENA_BLOCK_SIZE * ARENA_BLOCK_SIZE;
+    return mapBlock(arena, size);
+}
+
+void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->used + size > block->size) {
+        block = newBlock(arena, size + ARENA_HEADER);
+        if (block == NULL) {
+            fprintf(stderr, "Failed to map %zu bytes of arena memory\n", size);
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *memory = (char *)block + block->used;
+    block->used += size;
+    return memory;
+}
+
+ArenaMark arenaMark(Arena *arena) {
+    ArenaMark mark;
+    mark.block = arena->head;
+    mark.used = arena->head != NULL ? arena->head->used : 0;
+    return mark;
+}
+
+// Blocks filled after the mark move to the spare list, nothing is unmapped
+void arenaReset(Arena *arena, ArenaMark mark) {
+    while (arena->head != NULL && arena->head != mark.block) {
+        ArenaBlock *block = arena->head;
+        arena->head = block->next;
+        block->next = arena->spare;
+        arena->spare = block;
+    }
+    if (arena->head != NULL) {
+        arena->head->used = mark.used;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (2UL * 1024 * 1024)   // One huge page, larger requests get a block of their own
+#define ARENA_ALIGNMENT 16
+
+// Bump allocator over mmap'd blocks. Nothing is freed individually: a reset rewinds to a mark and keeps
+// the blocks for reuse, and freeArena unmaps every block at once
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;    // Older block
+    size_t size;                // Bytes in the mapping, header included
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;           // Block being allocated from
+    ArenaBlock *spare;          // Released by resets, reused before mapping more
+    size_t mapped;              // Bytes currently mapped
+    int huge_pages;             // Back blocks with MAP_HUGETLB, or transparent huge pages when none are reserved
+} Arena;
+
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+void initArena(Arena *arena, int huge_pages);
+void freeArena(Arena *arena);
+
+// Memory is not zeroed, it may come from a block released by a reset
+void *arenaAlloc(Arena *arena, size_t size);
+
+ArenaMark arenaMark(Arena *arena);
+void arenaReset(Arena *arena, ArenaMark mark);
+
+#endif
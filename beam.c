@@ -0,0 +1,246 @@
+#include "beam.h"
+#include "buffer.h"
+#include "processor.h"
+#include "rule_parser.h"
+#include "constraints.h"
+
+typedef struct {
+    long parent;                        // Index into the previous depth, -1 for starters
+    const CompleteOperation *op;
+    double score;                       // Joint probability, used for ranking
+    double probability;                 // Chain probability as -p sees it (depends on -j)
+    long order;                         // Expansion order, breaks ties deterministically
+    int bytes;                          // Rule bytes up to and including op
+} BeamNode;
+
+// Worse chains sit at the top of the min-heap
+static int beamWorse(const BeamNode *a, const BeamNode *b) {
+    if (a->score != b->score) {
+        return a->score < b->score;
+    }
+    return a->order > b->order;
+}
+
+static void beamSiftUp(BeamNode *heap, long i) {
+    while (i > 0) {
+        long parent = (i - 1) / 2;
+        if (!beamWorse(&heap[i], &heap[parent])) break;
+        BeamNode tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void beamSiftDown(BeamNode *heap, long count, long i) {
+    while (1) {
+        long worst = i;
+        long left = 2 * i + 1;
+        long right = left + 1;
+        if (left < count && beamWorse(&heap[left], &heap[worst])) worst = left;
+        if (right < count && beamWorse(&heap[right], &heap[worst])) worst = right;
+        if (worst == i) break;
+        BeamNode tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Returns 0 when the heap is full and the candidate is no better than its worst chain
+static int beamOffer(BeamNode *heap, long *count, long width, const BeamNode *candidate) {
+    if (*count < width) {
+        heap[*count] = *candidate;
+        beamSiftUp(heap, *count);
+        (*count)++;
+        return 1;
+    }
+    if (!beamWorse(&heap[0], candidate)) {
+        return 0;
+    }
+    heap[0] = *candidate;
+    beamSiftDown(heap, *count, 0);
+    return 1;
+}
+
+// Best first, the heap is consumed
+static void beamSortDescending(BeamNode *heap, long count) {
+    for (long end = count - 1; end > 0; end--) {
+        BeamNode tmp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = tmp;
+        beamSiftDown(heap, end, 0);
+    }
+}
+
+// The final length is not known while the beam grows, so the suffix is only checked here
+static void outputBeamRule(BeamNode **levels, int depth, long index, const RuleConstraints *constraints,
+                           void *commuted, WBuffer *output_buffer) {
+    CompleteOperation ops[MAX_RULE_LEN];
+    char rule_string[MAX_RULE_LEN];
+    int total_len = 0;
+
+    for (int d = depth; d >= 1; d--) {
+        ops[d - 1] = *levels[d][index].op;
+        index = levels[d][index].parent;
+    }
+    if ((constraints->active && !constraintAllowsChain(constraints, ops, depth)) ||
+        isCommutedRule(commuted, ops, depth)) {
+        return;
+    }
+    for (int i = 0; i < depth; i++) {
+        int op_len = strlen(ops[i].full_op);
+        if (total_len + op_len >= MAX_RULE_LEN - 1) {
+            break;
+        }
+        memcpy(rule_string + total_len, ops[i].full_op, op_len);
+        total_len += op_len;
+    }
+    rule_string[total_len] = '\0';
+
+    buffer_string2(output_buffer, rule_string, MAX_RULE_LEN);
+    if (output_buffer->writeCount % 1000 == 0) {
+        flush_buffer(output_buffer);
+    }
+}
+
+long generateBeamRules(RuleChef *chef, const RuleChefParams *params, long width, WBuffer *output_buffer) {
+    double min_probability = params->min_probability;
+    int max_length = params->max_length < MAX_RULE_LEN ? params->max_length : MAX_RULE_LEN - 1;
+    size_t written_before = output_buffer->writeCount;
+
+    RuleConstraints constraints;
+    if (!compileConstraints(params, &constraints)) {
+        return 0;
+    }
+
+    int starter_count = 0;
+    OperationNGram *starters = getGenerationStarters(chef, params, &starter_count);
+    if (starters == NULL) {
+        return 0;
+    }
+    starter_count = getStarterLimit(params->limit_unigrams, starter_count);
+
+    // levels[d] holds the surviving chains of d ops, O(width x max_length) in total
+    BeamNode **levels = calloc(max_length + 1, sizeof(BeamNode *));
+    long *level_counts = calloc(max_length + 1, sizeof(long));
+    int allocated = levels != NULL && level_counts != NULL;
+    for (int d = 1; allocated && d <= max_length; d++) {
+        levels[d] = malloc(width * sizeof(BeamNode));
+        allocated = levels[d] != NULL;
+    }
+    if (!allocated) {
+        fprintf(stderr, "Failed to allocate beam of width %ld\n", width);
+        for (int d = 1; levels != NULL && d <= max_length; d++) {
+            free(levels[d]);
+        }
+        free(levels);
+        free(level_counts);
+        free(starters);
+        return 0;
+    }
+
+    if (params->verbose) {
+        fprintf(stderr, "\n=== Beam Search (width: %ld, length: %d-%d) ===\n",
+                width, params->min_length, max_length);
+    }
+
+    long order = 0;
+    for (int i = 0; i < starter_count; i++) {
+        BeamNode candidate;
+        candidate.parent = -1;
+        candidate.op = &starters[i].ops[0];
+        candidate.score = starters[i].probability;
+        candidate.probability = params->joint ? starters[i].probability : 1.0;
+        candidate.order = order++;
+        candidate.bytes = candidate.op->length;
+        if (min_probability > 0.0 && candidate.probability < min_probability) {
+            break;
+        }
+        if (constraints.active && !constraintAllowsOp(&constraints, candidate.op, 0, 0, 0)) {
+            continue;
+        }
+        if (!beamOffer(levels[1], &level_counts[1], width, &candidate)) {
+            break; // Starters are sorted, later ones cannot do better
+        }
+    }
+
+    for (int depth = 1; depth <= max_length && level_counts[depth] > 0 && !generationStopped(params); depth++) {
+        BeamNode *frontier = levels[depth];
+        long frontier_count = level_counts[depth];
+        beamSortDescending(frontier, frontier_count);
+
+        if (depth >= params->min_length) {
+            // -s drops a two op rule when the beam kept and writes its canonical order as well
+            void *commuted = NULL;
+            for (long i = 0; depth == 2 && params->simplify && i < frontier_count; i++) {
+                CompleteOperation ops[2] = {*levels[1][frontier[i].parent].op, *frontier[i].op};
+                if (!constraints.active || constraintAllowsChain(&constraints, ops, 2)) {
+                    addCommutedRule(&commuted, &ops[0], &ops[1]);
+                }
+            }
+            for (long i = 0; i < frontier_count; i++) {
+                outputBeamRule(levels, depth, i, &constraints, commuted, output_buffer);
+            }
+            freeCommutedRules(commuted);
+        }
+
+        if (params->verbose) {
+            fprintf(stderr, "Depth %d: %ld chains, joint probability %.3g - %.3g\n", depth, frontier_count,
+                    frontier[frontier_count - 1].score, frontier[0].score);
+        }
+        if (depth == max_length) {
+            break;
+        }
+
+        // Expand best first, a row stops as soon as its next transition cannot enter the beam
+        order = 0;
+        for (long i = 0; i < frontier_count; i++) {
+            BeamNode *node = &frontier[i];
+            FastTransitionLookup *lookup = findTransitionLookup(chef, node->op);
+            if (lookup == NULL || lookup->sorted_transitions == NULL) {
+                continue;
+            }
+            for (int t = 0; t < lookup->transition_count; t++) {
+                SortedTransition *transition = &lookup->sorted_transitions[t];
+                BeamNode candidate;
+                candidate.probability = node->probability * transition->probability;
+                if (min_probability > 0.0 && candidate.probability < min_probability) {
+                    break;
+                }
+                if (transition->next_op == NULL) {
+                    continue;
+                }
+                if (params->simplify && isRedundantTransition(node->op, transition->next_op)) {
+                    continue;
+                }
+                if (constraints.active &&
+                    !constraintAllowsOp(&constraints, transition->next_op, depth, node->bytes, 0)) {
+                    continue;
+                }
+                candidate.parent = i;
+                candidate.bytes = node->bytes + transition->next_op->length;
+                candidate.op = transition->next_op;
+                candidate.score = node->score * transition->probability;
+                candidate.order = order++;
+                if (!beamOffer(levels[depth + 1], &level_counts[depth + 1], width, &candidate)) {
+                    break;
+                }
+            }
+        }
+    }
+    flush_buffer(output_buffer);
+
+    long written = (long)(output_buffer->writeCount - written_before);
+    if (params->verbose) {
+        fprintf(stderr, "Beam search complete. Total rules: %ld\n", written);
+    }
+
+    for (int d = 1; d <= max_length; d++) {
+        free(levels[d]);
+    }
+    free(levels);
+    free(level_counts);
+    free(starters);
+    return written;
+}
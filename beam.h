@@ -0,0 +1,10 @@
+#ifndef BEAM_H
+#define BEAM_H
+
+#include "types.h"
+
+// Keeps the width most probable chains at each depth and writes every survivor within min..max length
+// Chains are ranked by their joint probability (starter times transitions), -p prunes as usual
+long generateBeamRules(RuleChef *chef, const RuleChefParams *params, long width, WBuffer *output_buffer);
+
+#endif
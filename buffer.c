@@ -14,22 +14,20 @@ void buffer_string2(WBuffer *WStruct, char *string, size_t max) {
 
     if (len >= (WStruct->bufferSize - WStruct->bufferUsed)) {
         // We need to increase the buffer larger than the default size to accommodate the len
-        if (len > WriteBufferSize) {
-            WStruct->buffer = (char *)realloc(WStruct->buffer, WStruct->bufferSize + (len * 2) + 1);
-            if (WStruct->buffer == NULL) {
-                fprintf(stderr, "Unable to realloc buffer for writing exiting");
-                exit(1);
-            } else {
+        size_t grow = len > WriteBufferSize ? len * 2 : WriteBufferSize;
+        char *grown = (char *)realloc(WStruct->buffer, WStruct->bufferSize + grow + 1);
+        if (grown != NULL) {
+            if (len > WriteBufferSize) {
                 fprintf(stderr, "Increasing write buffer\n");
-                WStruct->bufferSize += (len * 2);
             }
+            WStruct->buffer = grown;
+            WStruct->bufferSize += grow;
         } else {
-            WStruct->buffer = (char *)realloc(WStruct->buffer, WStruct->bufferSize + WriteBufferSize + 1);
-            if (WStruct->buffer == NULL) {
-                fprintf(stderr, "Unable to realloc buffer for writing exiting");
-                exit(1);
-            } else {
-                WStruct->bufferSize += (WriteBufferSize);
+            // Write out what is pending instead, the buffer keeps its size
+            flush_buffer(WStruct);
+            if (len >= WStruct->bufferSize) {
+                fprintf(stderr, "Unable to realloc buffer for writing, rule dropped\n");
+                return;
             }
         }
     }
@@ -40,40 +38,47 @@ void buffer_string2(WBuffer *WStruct, char *string, size_t max) {
     WStruct->writeCount++;
 }
 
-// Flush buffer to stdout
+// Flush buffer to its sink, or to its stream (stdout unless changed)
 void flush_buffer(WBuffer *WStruct) {
     if (WStruct->bufferUsed > 0) {
-        fwrite(WStruct->buffer, 1, WStruct->bufferUsed, stdout);
-        fflush(stdout);
+        if (WStruct->sink != NULL) {
+            WStruct->sink(WStruct->sink_arg, WStruct->buffer, WStruct->bufferUsed);
+        } else {
+            fwrite(WStruct->buffer, 1, WStruct->bufferUsed, WStruct->stream);
+            fflush(WStruct->stream);
+        }
         WStruct->bufferUsed = 0;
     }
 }
 
-// Initialize buffer
-void init_buffer(WBuffer *WStruct) {
+// Write a block of count newline terminated rules straight to the sink or stream, after anything pending
+void buffer_block(WBuffer *WStruct, const char *data, size_t len, size_t count) {
+    flush_buffer(WStruct);
+    if (len > 0) {
+        if (WStruct->sink != NULL) {
+            WStruct->sink(WStruct->sink_arg, data, len);
+        } else {
+            fwrite(data, 1, len, WStruct->stream);
+            fflush(WStruct->stream);
+        }
+    }
+    WStruct->writeCount += count;
+}
+
+// Initialize buffer, returns 0 when the buffer cannot be allocated
+int init_buffer(WBuffer *WStruct) {
     WStruct->bufferSize = WriteBufferSize;
     WStruct->bufferUsed = 0;
     WStruct->writeCount = 0;
+    WStruct->stream = stdout;
+    WStruct->sink = NULL;
+    WStruct->sink_arg = NULL;
     WStruct->buffer = (char *)malloc(WriteBufferSize + 1);
     if (WStruct->buffer == NULL) {
         fprintf(stderr, "Unable to allocate initial write buffer\n");
-#ifndef BUFFER_H
-#define BUFFER_H
-
-#include "types.h"
-
-// Buffer management functions
-void init_buffer(WBuffer *WStruct);
-void free_buffer(WBuffer *WStruct);
-void buffer_string2(WBuffer *WStruct, char *string, size_t max);
-void flush_buffer(WBuffer *WStruct);
-
-// Utility functions
-size_t mystrlen2(const char *string, size_t max);
-
-#endif
-        exit(1);
+        return 0;
     }
+    return 1;
 }
 
 // Free buffer
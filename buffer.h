@@ -4,10 +4,11 @@
 #include "types.h"
 
 // Buffer management functions
-void init_buffer(WBuffer *WStruct);
+int init_buffer(WBuffer *WStruct);
 void free_buffer(WBuffer *WStruct);
 void buffer_string2(WBuffer *WStruct, char *string, size_t max);
 void flush_buffer(WBuffer *WStruct);
+void buffer_block(WBuffer *WStruct, const char *data, size_t len, size_t count);
 
 // Utility functions
 size_t mystrlen2(const char *string, size_t max);
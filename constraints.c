@@ -0,0 +1,83 @@
+#include "constraints.h"
+#include "rule_parser.h"
+
+static int parseConstraintOps(const char *rule, const char *name, CompleteOperation *ops, int *count) {
+    char line[MAX_RULE_LEN];
+    ParsedRule parsed;
+    size_t length = strlen(rule);
+
+    if (length == 0 || length >= MAX_RULE_LEN) {
+        fprintf(stderr, "Error: %s must be between 1 and %d bytes\n", name, MAX_RULE_LEN - 1);
+        return 0;
+    }
+    memcpy(line, rule, length + 1);
+    if (!tokenizeRule(line, &parsed) || parsed.op_count == 0) {
+        fprintf(stderr, "Error: %s is not a valid rule: %s\n", name, rule);
+        return 0;
+    }
+    memcpy(ops, parsed.operations, parsed.op_count * sizeof(CompleteOperation));
+    *count = parsed.op_count;
+    return 1;
+}
+
+int compileConstraints(const RuleChefParams *params, RuleConstraints *constraints) {
+    memset(constraints, 0, sizeof(RuleConstraints));
+
+    // allow_ops restricts the classes, deny_ops then removes from whatever is left
+    int allow_all = params->allow_ops == NULL || params->allow_ops[0] == '\0';
+    memset(constraints->allowed, allow_all, sizeof(constraints->allowed));
+    if (!allow_all) {
+        for (const char *c = params->allow_ops; *c != '\0'; c++) {
+            constraints->allowed[(unsigned char)*c] = 1;
+        }
+        constraints->active = 1;
+    }
+    if (params->deny_ops != NULL) {
+        for (const char *c = params->deny_ops; *c != '\0'; c++) {
+            constraints->allowed[(unsigned char)*c] = 0;
+            constraints->active = 1;
+        }
+    }
+
+    if (params->prefix != NULL && params->prefix[0] != '\0' &&
+        !parseConstraintOps(params->prefix, "Prefix", constraints->prefix, &constraints->prefix_count)) {
+        return 0;
+    }
+    if (params->suffix != NULL && params->suffix[0] != '\0' &&
+        !parseConstraintOps(params->suffix, "Suffix", constraints->suffix, &constraints->suffix_count)) {
+        return 0;
+    }
+    constraints->max_bytes = params->max_bytes > 0 ? params->max_bytes : 0;
+
+    // No engine could place every op, the sampler would write the whole prefix past the length limit
+    if (constraintMinLength(constraints) > params->max_length) {
+        fprintf(stderr, "Error: %s has %d operations, more than the maximum rule length %d\n",
+                constraints->prefix_count > constraints->suffix_count ? "Prefix" : "Suffix",
+                constraintMinLength(constraints), params->max_length);
+        return 0;
+    }
+
+    if (constraints->prefix_count > 0 || constraints->suffix_count > 0 || constraints->max_bytes > 0) {
+        constraints->active = 1;
+        constraints->positional = 1;
+    }
+    return 1;
+}
+
+int constraintAllowsChain(const RuleConstraints *constraints, const CompleteOperation *ops, int length) {
+    if (!constraints->positional) {
+        return 1;
+    }
+    if (length < constraintMinLength(constraints)) {
+        return 0;
+    }
+
+    // Engines that do not know the final length while building check the suffix here
+    for (int i = 0; i < constraints->suffix_count; i++) {
+        const CompleteOperation *op = &ops[length - constraints->suffix_count + i];
+        if (strcmp(op->full_op, constraints->suffix[i].full_op) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef CONSTRAINTS_H
+#define CONSTRAINTS_H
+
+#include "types.h"
+
+// Generation constraints from RuleChefParams, compiled once per call and checked as each op is placed,
+// so transitions they exclude are never expanded and their whole subtree is skipped
+typedef struct {
+    int active;                             // Any constraint set, engines skip every check otherwise
+    int positional;                         // Prefix, suffix or byte limit, not just op classes
+    unsigned char allowed[256];             // By base_op
+    CompleteOperation prefix[MAX_RULE_LEN];
+    int prefix_count;
+    CompleteOperation suffix[MAX_RULE_LEN];
+    int suffix_count;
+    int max_bytes;                          // 0 for no limit
+} RuleConstraints;
+
+// Returns 0 with a message when the prefix or suffix is not a valid rule
+int compileConstraints(const RuleChefParams *params, RuleConstraints *constraints);
+
+// May op be placed at position (0 based) when the rule so far has bytes bytes
+// target_length is the length the chain is built for, 0 when it is not known yet (the suffix is not checked)
+static inline int constraintAllowsOp(const RuleConstraints *constraints, const CompleteOperation *op,
+                                     int position, int bytes, int target_length) {
+    if (!constraints->allowed[(unsigned char)op->base_op]) {
+        return 0;
+    }
+    if (!constraints->positional) {
+        return 1;
+    }
+    if (constraints->max_bytes > 0 && bytes + op->length > constraints->max_bytes) {
+        return 0;
+    }
+    if (position < constraints->prefix_count &&
+        strcmp(op->full_op, constraints->prefix[position].full_op) != 0) {
+        return 0;
+    }
+    int suffix_start = target_length - constraints->suffix_count;
+    if (target_length > 0 && position >= suffix_start &&
+        strcmp(op->full_op, constraints->suffix[position - suffix_start].full_op) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// Whether a chain of length ops, every one already accepted by constraintAllowsOp, may be written
+int constraintAllowsChain(const RuleConstraints *constraints, const CompleteOperation *ops, int length);
+
+// Shortest chain that can satisfy the prefix and suffix
+static inline int constraintMinLength(const RuleConstraints *constraints) {
+    return constraints->prefix_count > constraints->suffix_count ? constraints->prefix_count : constraints->suffix_count;
+}
+
+#endif
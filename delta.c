@@ -0,0 +1,288 @@
+#include <Judy.h>
+#include "delta.h"
+#include "buffer.h"
+#include "constraints.h"
+#include "hash_tables.h"
+#include "processor.h"
+#include "rule_parser.h"
+
+// Parallel to a row of chef->fast_lookup
+typedef struct {
+    double *previous;           // Probability of each transition under the previous model, 0 when it had none
+    int *next_row;              // Row of each successor, -1 when it has no transitions
+    int changed;                // Some transition has a different probability
+} DeltaRow;
+
+typedef struct {
+    RuleChef *chef;
+    const RuleChefParams *params;
+    WBuffer *output_buffer;
+    Pvoid_t emitted;            // Judy set of rules already written
+    void *commuted;             // Two op rules -s skips under each model, see buildCommutedRules
+    void *previous_commuted;
+    DeltaRow *rows;
+    int row_count;
+    unsigned char *dirty;       // [remaining * row_count + row], a changed row is reachable in remaining steps
+    RuleConstraints constraints;
+    CompleteOperation sequence[MAX_RULE_LEN];
+    int bytes[MAX_RULE_LEN + 1];
+    long skipped;
+} DeltaState;
+
+static int deltaRowIndex(RuleChef *chef, const CompleteOperation *op) {
+    FastTransitionLookup *lookup = findTransitionLookup(chef, op);
+    if (lookup == NULL || lookup->transition_count == 0) {
+        return -1;
+    }
+    return (int)(lookup - chef->fast_lookup);
+}
+
+static void freeDeltaRows(DeltaState *state) {
+    for (int r = 0; r < state->row_count; r++) {
+        free(state->rows[r].previous);
+        free(state->rows[r].next_row);
+    }
+    free(state->rows);
+    free(state->dirty);
+}
+
+// Previous probability of every transition, then which rows reach a changed row within each length
+// Returns the number of changed rows, or -1 when the rows cannot be allocated
+static long buildDeltaRows(DeltaState *state, RuleChef *previous, int max_length) {
+    RuleChef *chef = state->chef;
+    long changed = 0;
+
+    state->row_count = chef->fast_lookup_count;
+    state->rows = calloc(state->row_count + 1, sizeof(DeltaRow));
+    state->dirty = calloc((size_t)(max_length + 1) * (state->row_count + 1), 1);
+    if (state->rows == NULL || state->dirty == NULL) {
+        fprintf(stderr, "Failed to allocate delta rows\n");
+        state->row_count = 0;
+        return -1;
+    }
+
+    for (int r = 0; r < state->row_count; r++) {
+        FastTransitionLookup *lookup = &chef->fast_lookup[r];
+        DeltaRow *row = &state->rows[r];
+
+        row->previous = malloc((lookup->transition_count + 1) * sizeof(double));
+        row->next_row = malloc((lookup->transition_count + 1) * sizeof(int));
+        if (row->previous == NULL || row->next_row == NULL) {
+            fprintf(stderr, "Failed to allocate delta rows\n");
+            return -1;
+        }
+        for (int t = 0; t < lookup->transition_count; t++) {
+            SortedTransition *transition = &lookup->sorted_transitions[t];
+            CompleteOperation bigram[2] = {lookup->from_op, *transition->next_op};
+            NGramHashNode *node = findNGramInTable(&previous->bigram_hash_table, bigram, 2);
+
+            // Pruned and min count bigrams have probability 0 in the finalized model
+            row->previous[t] = node != NULL ? node->ngram.probability : 0.0;
+            row->next_row[t] = deltaRowIndex(chef, transition->next_op);
+            if (row->previous[t] != transition->probability) {
+                row->changed = 1;
+            }
+        }
+        changed += row->changed;
+    }
+
+    for (int remaining = 1; remaining <= max_length; remaining++) {
+        unsigned char *dirty = state->dirty + (size_t)remaining * state->row_count;
+        unsigned char *below = dirty - state->row_count;
+
+        for (int r = 0; r < state->row_count; r++) {
+            DeltaRow *row = &state->rows[r];
+            dirty[r] = row->changed;
+            for (int t = 0; t < chef->fast_lookup[r].transition_count && !dirty[r] && remaining > 1; t++) {
+                dirty[r] = row->next_row[t] >= 0 && below[row->next_row[t]];
+            }
+        }
+    }
+    return changed;
+}
+
+static void outputDeltaRule(DeltaState *state, int length) {
+    WBuffer *output_buffer = state->output_buffer;
+    PWord_t PValue;
+
+    if (state->constraints.active && !constraintAllowsChain(&state->constraints, state->sequence, length)) {
+        return;
+    }
+
+    // The same string and truncation as the generator
+    char rule_string[MAX_RULE_LEN] = "";
+    int total_len = 0;
+    for (int i = 0; i < length; i++) {
+        int op_len = strlen(state->sequence[i].full_op);
+        if (total_len + op_len >= MAX_RULE_LEN - 1) {
+            break;
+        }
+        memcpy(rule_string + total_len, state->sequence[i].full_op, op_len + 1);
+        total_len += op_len;
+    }
+
+    JSLG(PValue, state->emitted, (const uint8_t *)rule_string);
+    if (PValue != NULL) {
+        return;
+    }
+    buffer_string2(output_buffer, rule_string, MAX_RULE_LEN);
+    JSLI(PValue, state->emitted, (const uint8_t *)rule_string);
+    ++(*PValue);
+    if (output_buffer->writeCount % 1000 == 0) {
+        flush_buffer(output_buffer);
+    }
+}
+
+// The generator's walk, with the previous model's chain probability carried alongside
+static void walkDelta(DeltaState *state, int length, int target_length, int row,
+                      double probability, double previous_probability) {
+    const RuleChefParams *params = state->params;
+    double min_probability = params->min_probability;
+
+    if (length == target_length) {
+        if (isCommutedRule(state->commuted, state->sequence, length)) {
+            return;
+        }
+        if (!(previous_probability > 0.0 && previous_probability >= min_probability) ||
+            isCommutedRule(state->previous_commuted, state->sequence, length)) {
+            outputDeltaRule(state, length);
+        }
+        return;
+    }
+    if (row < 0 || generationStopped(params)) {
+        return;
+    }
+
+    // Every chain below scores the same under both models, none of them can newly pass. Two op rules
+    // may still differ in what -s skips, the starter of their canonical order can have changed
+    int commuted = target_length == 2 && (state->commuted != NULL || state->previous_commuted != NULL);
+    if (probability == previous_probability && !commuted &&
+        !state->dirty[(size_t)(target_length - length) * state->row_count + row]) {
+        state->skipped++;
+        return;
+    }
+
+    FastTransitionLookup *lookup = &state->chef->fast_lookup[row];
+    DeltaRow *delta = &state->rows[row];
+    for (int t = 0; t < lookup->transition_count; t++) {
+        const CompleteOperation *next_op = lookup->sorted_transitions[t].next_op;
+        double next_probability = probability * lookup->sorted_transitions[t].probability;
+
+        if (min_probability > 0.0 && next_probability < min_probability) {
+            break;
+        }
+        if (next_op == NULL) {
+            continue;
+        }
+        if (params->simplify && isRedundantTransition(&state->sequence[length - 1], next_op)) {
+            continue;
+        }
+        if (state->constraints.active &&
+            !constraintAllowsOp(&state->constraints, next_op, length, state->bytes[length], target_length)) {
+            continue;
+        }
+        state->sequence[length] = *next_op;
+        state->bytes[length + 1] = state->bytes[length] + next_op->length;
+        walkDelta(state, length + 1, target_length, delta->next_row[t],
+                  next_probability, previous_probability * delta->previous[t]);
+    }
+}
+
+long generateDeltaRules(RuleChef *chef, RuleChef *previous, const RuleChefParams *params, WBuffer *output_buffer) {
+    DeltaState *state = calloc(1, sizeof(DeltaState));
+    if (state == NULL) {
+        fprintf(stderr, "Failed to allocate delta generation\n");
+        return 0;
+    }
+    if (!compileConstraints(params, &state->constraints)) {
+        free(state);
+        return 0;
+    }
+    state->chef = chef;
+    state->params = params;
+    state->output_buffer = output_buffer;
+
+    int starter_count = 0;
+    OperationNGram *starters = getGenerationStarters(chef, params, &starter_count);
+    if (starters == NULL) {
+        free(state);
+        return 0;
+    }
+    starter_count = getStarterLimit(params->limit_unigrams, starter_count);
+
+    // Starters the previous run used, anything else never started a chain there
+    Pvoid_t previous_starters = (Pvoid_t)NULL;
+    PWord_t PValue;
+    Word_t freed;
+    int previous_count = 0;
+    OperationNGram *previous_sorted = getGenerationStarters(previous, params, &previous_count);
+    previous_count = getStarterLimit(params->limit_unigrams, previous_count);
+    for (int i = 0; previous_sorted != NULL && i < previous_count; i++) {
+        JSLI(PValue, previous_starters, (const uint8_t *)previous_sorted[i].ops[0].full_op);
+        *PValue = i + 1;
+    }
+
+    state->commuted = buildCommutedRules(chef, params, &state->constraints, starters, starter_count);
+    if (previous_sorted != NULL) {
+        state->previous_commuted = buildCommutedRules(previous, params, &state->constraints, previous_sorted,
+                                                      previous_count);
+    }
+
+    size_t before = output_buffer->writeCount;
+    long changed = buildDeltaRows(state, previous, params->max_length);
+    if (changed < 0) {
+        goto done;
+    }
+    if (params->verbose) {
+        fprintf(stderr, "\n=== Delta Generation (length: %d-%d, min probability: %.3f) ===\n",
+                params->min_length, params->max_length, params->min_probability);
+        fprintf(stderr, "%ld of %d operations have changed transitions\n", changed, state->row_count);
+    }
+
+    for (int target_length = params->min_length; target_length <= params->max_length; target_length++) {
+        for (int i = 0; i < starter_count && !generationStopped(params); i++) {
+            const CompleteOperation *starter = &starters[i].ops[0];
+            double probability = params->joint ? starters[i].probability : 1.0;
+            if (params->min_probability > 0.0 && probability < params->min_probability) {
+                break;
+            }
+            if (state->constraints.active &&
+                !constraintAllowsOp(&state->constraints, starter, 0, 0, target_length)) {
+                continue;
+            }
+
+            double previous_probability = 0.0;
+            JSLG(PValue, previous_starters, (const uint8_t *)starter->full_op);
+            if (PValue != NULL) {
+                previous_probability = params->joint ? previous_sorted[*PValue - 1].probability : 1.0;
+            }
+
+            state->sequence[0] = *starter;
+            state->bytes[1] = starter->length;
+            walkDelta(state, 1, target_length, deltaRowIndex(chef, starter), probability, previous_probability);
+        }
+        flush_buffer(output_buffer);
+
+        if (params->verbose) {
+            fprintf(stderr, "Completed length %d, %zu new rules so far\n",
+                    target_length, output_buffer->writeCount - before);
+        }
+    }
+
+    if (params->verbose) {
+        fprintf(stderr, "Delta complete: %zu new rules, %ld unchanged subtrees skipped\n",
+                output_buffer->writeCount - before, state->skipped);
+    }
+
+done:
+    JSLFA(freed, state->emitted);
+    JSLFA(freed, previous_starters);
+    (void)freed;
+    freeCommutedRules(state->commuted);
+    freeCommutedRules(state->previous_commuted);
+    freeDeltaRows(state);
+    free(previous_sorted);
+    free(starters);
+    free(state);
+    return (long)(output_buffer->writeCount - before);
+}
@@ -0,0 +1,12 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "types.h"
+
+// Writes the rules generation with params would write for chef but not for previous, the model the
+// last run used. Both are walked together and each chain carries its probability under both models.
+// A subtree is skipped when its chain probability is unchanged and no transition reachable from it
+// within the remaining length changed, so the work follows the part of the model that changed
+long generateDeltaRules(RuleChef *chef, RuleChef *previous, const RuleChefParams *params, WBuffer *output_buffer);
+
+#endif
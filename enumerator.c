@@ -0,0 +1,232 @@
+#include "enumerator.h"
+#include "buffer.h"
+#include "processor.h"
+#include "rule_parser.h"
+
+typedef struct {
+    char text[8];       // The op and a newline, padded so it is always copied as 8 bytes
+    int length;         // Without the newline
+    int row;            // Row of the op, -1 when it has no transitions
+} EnumOp;
+
+// Successors of one lookup row in generation order, already filtered by -s
+typedef struct {
+    EnumOp *next;
+    int count;
+} EnumRow;
+
+struct RuleEnumerator {
+    EnumRow *rows;      // Parallel to chef->fast_lookup
+    int row_count;
+    EnumRow starters;
+    EnumRow *pairs;     // Parallel to starters, their rows without the commuted rules, NULL when -s skips none
+    const RuleChefParams *params;
+};
+
+static int enumRowIndex(RuleChef *chef, const CompleteOperation *op) {
+    FastTransitionLookup *lookup = findTransitionLookup(chef, op);
+    if (lookup == NULL || lookup->transition_count == 0) {
+        return -1;
+    }
+    return (int)(lookup - chef->fast_lookup);
+}
+
+static void setEnumOp(RuleChef *chef, EnumOp *entry, const CompleteOperation *op, int *max_length) {
+    int length = strlen(op->full_op);
+
+    memset(entry->text, 0, sizeof(entry->text));
+    memcpy(entry->text, op->full_op, length);
+    entry->text[length] = '\n';
+    entry->length = length;
+    entry->row = enumRowIndex(chef, op);
+    if (length > *max_length) {
+        *max_length = length;
+    }
+}
+
+void freeRuleEnumerator(RuleEnumerator *enumerator) {
+    if (enumerator == NULL) return;
+
+    for (int r = 0; r < enumerator->row_count; r++) {
+        free(enumerator->rows[r].next);
+    }
+    free(enumerator->rows);
+    for (int s = 0; enumerator->pairs != NULL && s < enumerator->starters.count; s++) {
+        free(enumerator->pairs[s].next);
+    }
+    free(enumerator->pairs);
+    free(enumerator->starters.next);
+    free(enumerator);
+}
+
+RuleEnumerator *createRuleEnumerator(RuleChef *chef, const RuleChefParams *params,
+                                     const RuleConstraints *constraints,
+                                     const OperationNGram *starters, int starter_count, void *commuted) {
+    if (params->min_probability > 0.0 || constraints->positional) {
+        return NULL;
+    }
+
+    RuleEnumerator *enumerator = calloc(1, sizeof(RuleEnumerator));
+    if (enumerator == NULL) {
+        return NULL;
+    }
+    enumerator->row_count = chef->fast_lookup_count;
+    enumerator->params = params;
+    enumerator->rows = calloc(enumerator->row_count + 1, sizeof(EnumRow));
+    enumerator->starters.next = malloc((starter_count + 1) * sizeof(EnumOp));
+    if (commuted != NULL) {
+        enumerator->pairs = calloc(starter_count + 1, sizeof(EnumRow));
+    }
+    if (enumerator->rows == NULL || enumerator->starters.next == NULL ||
+        (commuted != NULL && enumerator->pairs == NULL)) {
+        freeRuleEnumerator(enumerator);
+        return NULL;
+    }
+
+    int max_op_length = 0;
+    for (int i = 0; i < starter_count; i++) {
+        if (!constraints->allowed[(unsigned char)starters[i].ops[0].base_op]) {
+            continue;
+        }
+        setEnumOp(chef, &enumerator->starters.next[enumerator->starters.count++], &starters[i].ops[0],
+                  &max_op_length);
+        if (commuted == NULL) {
+            continue;
+        }
+
+        // Two op rules are the starter row without the rules written in their canonical order instead
+        FastTransitionLookup *lookup = findTransitionLookup(chef, &starters[i].ops[0]);
+        EnumRow *pair = &enumerator->pairs[enumerator->starters.count - 1];
+        if (lookup == NULL || lookup->transition_count == 0) {
+            continue;
+        }
+        pair->next = malloc(lookup->transition_count * sizeof(EnumOp));
+        if (pair->next == NULL) {
+            freeRuleEnumerator(enumerator);
+            return NULL;
+        }
+        for (int t = 0; t < lookup->transition_count; t++) {
+            const CompleteOperation *next_op = lookup->sorted_transitions[t].next_op;
+            if (next_op == NULL || isRedundantTransition(&lookup->from_op, next_op) ||
+                !constraints->allowed[(unsigned char)next_op->base_op]) {
+                continue;
+            }
+            CompleteOperation rule[2] = {lookup->from_op, *next_op};
+            if (isCommutedRule(commuted, rule, 2)) {
+                continue;
+            }
+            setEnumOp(chef, &pair->next[pair->count++], next_op, &max_op_length);
+        }
+    }
+
+    for (int r = 0; r < enumerator->row_count; r++) {
+        FastTransitionLookup *lookup = &chef->fast_lookup[r];
+        EnumRow *row = &enumerator->rows[r];
+
+        row->next = malloc((lookup->transition_count + 1) * sizeof(EnumOp));
+        if (row->next == NULL) {
+            freeRuleEnumerator(enumerator);
+            return NULL;
+        }
+        for (int t = 0; t < lookup->transition_count; t++) {
+            const CompleteOperation *next_op = lookup->sorted_transitions[t].next_op;
+            if (next_op == NULL) {
+                continue;
+            }
+            if (params->simplify && isRedundantTransition(&lookup->from_op, next_op)) {
+                continue;
+            }
+            if (!constraints->allowed[(unsigned char)next_op->base_op]) {
+                continue;
+            }
+            setEnumOp(chef, &row->next[row->count++], next_op, &max_op_length);
+        }
+    }
+
+    // The generator truncates rules that would not fit, the enumerator never does
+    if (params->max_length * max_op_length >= MAX_RULE_LEN - 1) {
+        freeRuleEnumerator(enumerator);
+        return NULL;
+    }
+    return enumerator;
+}
+
+// Writes prefix followed by each op of the row, one rule per line
+static void emitSiblings(const EnumRow *row, const char *prefix, int prefix_length, WBuffer *output_buffer) {
+    char *buffer = output_buffer->buffer;
+    size_t used = output_buffer->bufferUsed;
+    size_t limit = output_buffer->bufferSize - (prefix_length + sizeof(row->next[0].text));
+
+    for (int i = 0; i < row->count; i++) {
+        const EnumOp *op = &row->next[i];
+        if (used > limit) {
+            output_buffer->bufferUsed = used;
+            flush_buffer(output_buffer);
+            used = 0;
+        }
+        memcpy(buffer + used, prefix, prefix_length);
+        memcpy(buffer + used + prefix_length, op->text, sizeof(op->text));
+        used += prefix_length + op->length + 1;
+    }
+    output_buffer->bufferUsed = used;
+    output_buffer->writeCount += row->count;
+}
+
+void enumerateRules(RuleEnumerator *enumerator, int length, WBuffer *output_buffer) {
+    char prefix[MAX_RULE_LEN + 8];
+    int rows[MAX_RULE_LEN];     // Row of the op at each depth
+    int next[MAX_RULE_LEN];     // Odometer digit: the next successor to try at each depth
+    int ends[MAX_RULE_LEN];     // Prefix length up to and including the op at each depth
+
+    prefix[0] = '\0';
+    if (length == 1) {
+        emitSiblings(&enumerator->starters, prefix, 0, output_buffer);
+        return;
+    }
+
+    for (int s = 0; s < enumerator->starters.count; s++) {
+        const EnumOp *starter = &enumerator->starters.next[s];
+        if (starter->row < 0) {
+            continue;
+        }
+
+        memcpy(prefix, starter->text, sizeof(starter->text));
+        ends[0] = starter->length;
+        rows[0] = starter->row;
+        next[0] = 0;
+        int depth = 0;
+
+        while (depth >= 0) {
+            const EnumRow *row = &enumerator->rows[rows[depth]];
+
+            // The last op varies fastest, its siblings share the whole prefix
+            if (depth == length - 2) {
+                if (generationStopped(enumerator->params)) {
+                    return;
+                }
+                if (length == 2 && enumerator->pairs != NULL) {
+                    row = &enumerator->pairs[s];
+                }
+                emitSiblings(row, prefix, ends[depth], output_buffer);
+                depth--;
+                continue;
+            }
+
+            // Ops without transitions cannot be extended to the full length
+            while (next[depth] < row->count && row->next[next[depth]].row < 0) {
+                next[depth]++;
+            }
+            if (next[depth] == row->count) {
+                depth--;
+                continue;
+            }
+
+            const EnumOp *op = &row->next[next[depth]++];
+            memcpy(prefix + ends[depth], op->text, sizeof(op->text));
+            ends[depth + 1] = ends[depth] + op->length;
+            depth++;
+            rows[depth] = op->row;
+            next[depth] = 0;
+        }
+    }
+}
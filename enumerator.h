@@ -0,0 +1,23 @@
+#ifndef ENUMERATOR_H
+#define ENUMERATOR_H
+
+#include "types.h"
+#include "constraints.h"
+
+// Exhaustive generation (-p 0), walks the successor lists with an odometer instead of recursing
+// Emits the same rules in the same order as the recursive generator, without a dedup set
+typedef struct RuleEnumerator RuleEnumerator;
+
+// NULL when the enumerator cannot reproduce the generator for these params, eg. when rules may be
+// long enough to be truncated or a constraint depends on the position. Op class constraints are applied
+// to the successor lists. starters are the sorted generation starters, count already limited by -l,
+// commuted is the generator's set from buildCommutedRules and must outlive the enumerator
+RuleEnumerator *createRuleEnumerator(RuleChef *chef, const RuleChefParams *params,
+                                     const RuleConstraints *constraints,
+                                     const OperationNGram *starters, int starter_count, void *commuted);
+void freeRuleEnumerator(RuleEnumerator *enumerator);
+
+// Writes every chain of exactly length ops
+void enumerateRules(RuleEnumerator *enumerator, int length, WBuffer *output_buffer);
+
+#endif
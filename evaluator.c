@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include <Judy.h>
+#include <math.h>
+#include "evaluator.h"
+#include "analysis.h"
+#include "buffer.h"
+#include "input_stream.h"
+#include "rule_parser.h"
+#include "scorer.h"
+
+typedef struct {
+    char *rule;                 // Normalised text
+    long weight;                // Occurrences in the held-out lines
+    int recovered;
+} EvalEntry;
+
+typedef struct {
+    long emitted;
+    long recovered;
+    long recovered_weight;
+} EvalCheckpoint;
+
+struct RuleChefEval {
+    Pvoid_t index;              // JudySL normalised rule -> entry + 1
+    EvalEntry *entries;
+    long count;
+    long capacity;
+    long total_weight;
+
+    // Progress of the generation run being measured
+    long emitted;
+    long recovered;
+    long recovered_weight;
+    long next_checkpoint;
+    EvalCheckpoint *checkpoints;
+    int checkpoint_count;
+    int checkpoint_capacity;
+};
+
+RuleChefEval *createEvalSet(void) {
+    RuleChefEval *eval = calloc(1, sizeof(RuleChefEval));
+    if (eval == NULL) {
+        fprintf(stderr, "Failed to allocate evaluation set\n");
+        return NULL;
+    }
+    eval->next_checkpoint = 1;
+    return eval;
+}
+
+void freeEvalSet(RuleChefEval *eval) {
+    if (eval == NULL) return;
+
+    Word_t freed;
+    JSLFA(freed, eval->index);
+    (void)freed;
+    for (long i = 0; i < eval->count; i++) {
+        free(eval->entries[i].rule);
+    }
+    free(eval->entries);
+    free(eval->checkpoints);
+    free(eval);
+}
+
+// The text generation would write for this rule: its operations concatenated
+static int normaliseEvalRule(const char *rule, char *normalised) {
+    char line[MAX_RULE_LEN];
+    ParsedRule parsed;
+    size_t length = strlen(rule);
+
+    if (length == 0 || length >= MAX_RULE_LEN) {
+        return 0;
+    }
+    memcpy(line, rule, length + 1);
+    if (!tokenizeRule(line, &parsed) || parsed.op_count == 0) {
+        return 0;
+    }
+
+    size_t used = 0;
+    for (int i = 0; i < parsed.op_count; i++) {
+        size_t op_length = strlen(parsed.operations[i].full_op);
+        if (used + op_length >= MAX_RULE_LEN) {
+            return 0;
+        }
+        memcpy(normalised + used, parsed.operations[i].full_op, op_length);
+        used += op_length;
+    }
+    normalised[used] = '\0';
+    return 1;
+}
+
+int addEvalRule(RuleChefEval *eval, const char *rule, long weight) {
+    char normalised[MAX_RULE_LEN];
+    PWord_t PValue;
+
+    if (weight <= 0 || !normaliseEvalRule(rule, normalised)) {
+        return 0;
+    }
+
+    // An index entry left at 0 by a failed allocation is filled in by the next occurrence
+    JSLI(PValue, eval->index, (const uint8_t *)normalised);
+    if (PValue == NULL) {
+        fprintf(stderr, "Failed to allocate evaluation index\n");
+        return -1;
+    }
+    if (*PValue == 0) {
+        if (eval->count == eval->capacity) {
+            long capacity = eval->capacity ? eval->capacity * 2 : 1024;
+            EvalEntry *entries = realloc(eval->entries, capacity * sizeof(EvalEntry));
+            if (entries == NULL) {
+                fprintf(stderr, "Failed to allocate held-out rules\n");
+                return -1;
+            }
+            eval->entries = entries;
+            eval->capacity = capacity;
+        }
+        EvalEntry *entry = &eval->entries[eval->count];
+        entry->rule = strdup(normalised);
+        if (entry->rule == NULL) {
+            fprintf(stderr, "Failed to allocate held-out rules\n");
+            return -1;
+        }
+        entry->weight = 0;
+        entry->recovered = 0;
+        *PValue = ++eval->count;
+    }
+    eval->entries[*PValue - 1].weight += weight;
+    eval->total_weight += weight;
+    return 1;
+}
+
+int addEvalFile(RuleChefEval *eval, const char *path, int weighted, int verbose) {
+    RuleInput *input = openRuleInput(path);
+    if (input == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", path);
+        return 0;
+    }
+
+    char buffer[MAX_RULE_LEN + 32];
+    long added = 0;
+    long skipped = 0;
+    size_t length;
+    char *raw;
+
+    while ((raw = readRuleLine(input, &length)) != NULL) {
+        if (length == 0) continue;
+        if (length >= sizeof(buffer)) {
+            skipped++;
+            continue;
+        }
+        memcpy(buffer, raw, length + 1);
+
+        char *rule = buffer;
+        long weight = weighted ? parseWeightedLine(buffer, &rule) : 1;
+        int result = addEvalRule(eval, rule, weight);
+        if (result < 0) {
+            break;
+        }
+        if (result) {
+            added++;
+        } else {
+            skipped++;
+        }
+    }
+    int failed = ruleInputFailed(input);
+    closeRuleInput(input);
+    if (raw != NULL) {
+        return 0;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: %s is truncated or unreadable\n", path);
+        return 0;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Held-out rules: %ld lines from %s, %ld skipped\n", added, path, skipped);
+    }
+    return 1;
+}
+
+static long nextCheckpoint(long checkpoint) {
+    long power = 1;
+    while (power * 10 <= checkpoint) {
+        power *= 10;
+    }
+    return checkpoint == power ? 2 * power : checkpoint == 2 * power ? 5 * power : 10 * power;
+}
+
+static void recordCheckpoint(RuleChefEval *eval) {
+    if (eval->checkpoint_count == eval->checkpoint_capacity) {
+        int capacity = eval->checkpoint_capacity ? eval->checkpoint_capacity * 2 : 64;
+        EvalCheckpoint *checkpoints = realloc(eval->checkpoints, capacity * sizeof(EvalCheckpoint));
+        if (checkpoints == NULL) {
+            // The report misses this row, the final totals are still written
+            fprintf(stderr, "Failed to allocate evaluation checkpoints\n");
+            return;
+        }
+        eval->checkpoints = checkpoints;
+        eval->checkpoint_capacity = capacity;
+    }
+    EvalCheckpoint *checkpoint = &eval->checkpoints[eval->checkpoint_count++];
+    checkpoint->emitted = eval->emitted;
+    checkpoint->recovered = eval->recovered;
+    checkpoint->recovered_weight = eval->recovered_weight;
+}
+
+void countEvalRules(RuleChefEval *eval, const char *data, size_t len) {
+    char rule[MAX_RULE_LEN];
+    const char *end = data + len;
+    PWord_t PValue;
+
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t length = (newline != NULL ? newline : end) - data;
+
+        if (length < MAX_RULE_LEN) {
+            memcpy(rule, data, length);
+            rule[length] = '\0';
+            JSLG(PValue, eval->index, (const uint8_t *)rule);
+            if (PValue != NULL) {
+                EvalEntry *entry = &eval->entries[*PValue - 1];
+                if (!entry->recovered) {
+                    entry->recovered = 1;
+                    eval->recovered++;
+                    eval->recovered_weight += entry->weight;
+                }
+            }
+        }
+
+        eval->emitted++;
+        if (eval->emitted == eval->next_checkpoint) {
+            recordCheckpoint(eval);
+            eval->next_checkpoint = nextCheckpoint(eval->next_checkpoint);
+        }
+        data += length + 1;
+    }
+}
+
+void rewindEvalSet(RuleChefEval *eval) {
+    for (long i = 0; i < eval->count; i++) {
+        eval->entries[i].recovered = 0;
+    }
+    eval->emitted = 0;
+    eval->recovered = 0;
+    eval->recovered_weight = 0;
+    eval->next_checkpoint = 1;
+    eval->checkpoint_count = 0;
+}
+
+static void writeCoverageRow(WBuffer *output_buffer, const RuleChefEval *eval, const EvalCheckpoint *checkpoint) {
+    char line[256];
+
+    snprintf(line, sizeof(line), "%ld\t%ld\t%.4f\t%.4f", checkpoint->emitted, checkpoint->recovered,
+             eval->count > 0 ? (double)checkpoint->recovered / eval->count : 0.0,
+             eval->total_weight > 0 ? (double)checkpoint->recovered_weight / eval->total_weight : 0.0);
+    buffer_string2(output_buffer, line, sizeof(line));
+}
+
+void writeEvalReport(RuleChef *chef, RuleChefEval *eval, WBuffer *output_buffer) {
+    char line[256];
+    char rule[MAX_RULE_LEN];
+    ScoreModel model;
+
+    // Occurrence weighted cross entropy per operation, over the held-out rules the model can produce
+    double log_sum = 0.0;
+    long op_sum = 0;
+    long unseen = 0;
+    initScoreModel(chef, &model);
+    for (long i = 0; i < eval->count; i++) {
+        int op_count = 0;
+        strcpy(rule, eval->entries[i].rule);
+        double probability = scoreOperations(chef, &model, rule, &op_count);
+        if (probability <= 0.0) {
+            unseen++;
+            continue;
+        }
+        log_sum += eval->entries[i].weight * log(probability);
+        op_sum += eval->entries[i].weight * op_count;
+    }
+
+    snprintf(line, sizeof(line), "# Held-out: %ld rules, %ld occurrences", eval->count, eval->total_weight);
+    buffer_string2(output_buffer, line, sizeof(line));
+    snprintf(line, sizeof(line), "# Perplexity per operation: %.4f over %ld rules, %ld rules have an unseen operation or transition",
+             op_sum > 0 ? exp(-log_sum / op_sum) : 0.0, eval->count - unseen, unseen);
+    buffer_string2(output_buffer, line, sizeof(line));
+    snprintf(line, sizeof(line), "# Recovered %ld rules (%ld occurrences) with %ld rules emitted, %.1f rules emitted per rule recovered",
+             eval->recovered, eval->recovered_weight, eval->emitted,
+             eval->recovered > 0 ? (double)eval->emitted / eval->recovered : 0.0);
+    buffer_string2(output_buffer, line, sizeof(line));
+
+    snprintf(line, sizeof(line), "emitted\trecovered\tcoverage\toccurrence_coverage");
+    buffer_string2(output_buffer, line, sizeof(line));
+    for (int i = 0; i < eval->checkpoint_count; i++) {
+        writeCoverageRow(output_buffer, eval, &eval->checkpoints[i]);
+    }
+    if (eval->checkpoint_count == 0 || eval->checkpoints[eval->checkpoint_count - 1].emitted != eval->emitted) {
+        EvalCheckpoint last = {eval->emitted, eval->recovered, eval->recovered_weight};
+        writeCoverageRow(output_buffer, eval, &last);
+    }
+}
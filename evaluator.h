@@ -0,0 +1,25 @@
+#ifndef EVALUATOR_H
+#define EVALUATOR_H
+
+#include "types.h"
+
+// Held-out rules keyed by their normalised text, so each generated rule is matched with a single lookup
+// Coverage is recorded at 1, 2, 5, 10, 20, 50... rules emitted
+// NULL when out of memory
+RuleChefEval *createEvalSet(void);
+void freeEvalSet(RuleChefEval *eval);
+
+// Adds one held-out rule, returns 0 when it does not parse and -1 when out of memory
+int addEvalRule(RuleChefEval *eval, const char *rule, long weight);
+int addEvalFile(RuleChefEval *eval, const char *path, int weighted, int verbose);
+
+// Sink for generated rules, counts the held-out rules recovered so far
+void countEvalRules(RuleChefEval *eval, const char *data, size_t len);
+
+// Forgets the rules recovered so another run can be measured against the same held-out set
+void rewindEvalSet(RuleChefEval *eval);
+
+// Coverage against rules emitted as tab separated rows, preceded by the model's perplexity on the held-out set
+void writeEvalReport(RuleChef *chef, RuleChefEval *eval, WBuffer *output_buffer);
+
+#endif
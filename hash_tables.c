@@ -1,21 +1,26 @@
 
+#include <Judy.h>
 #include "hash_tables.h"
 #include "rule_parser.h"
+#include "sketch.h"
+#include "sort_counter.h"
 
-// Global hash tables
-NGramHashNode **unigram_hash_table = NULL;
-NGramHashNode **bigram_hash_table = NULL;
-NGramHashNode **trigram_hash_table = NULL;
-HashNode *hash_table[HASH_SIZE] = {NULL};
-NGramHashNode **starter_hash_table = NULL;
-
-static double hm_threshold = 0.90; // Resize on 90% capcacity
-int curr_size_idx = 0;
-int max_operation_count[4];
-int op_prime_idx[4];
+static double hm_threshold = 0.80; // Resize on 80% capacity
 
 //Pre-computed primes which roughly double
-static const int prime_sizes[] = {
+static const long prime_sizes[] = {
+    251,
+    509,
+    1021,
+    2039,
+    4093,
+    8191,
+    16381,
+    32749,
+    65521,
+    131071,
+    262139,
+    524287,
     1048573,
     2097143,
     4194301,
@@ -30,135 +35,134 @@ static const int prime_sizes[] = {
     0
 };
 
-static NodePool *ngram_pool = NULL;
-
-// Global counters
-extern long unigram_count;
-extern long bigram_count;
-extern long trigram_count;
-extern long transition_count;
-extern long start_counter;
+#define SKETCH_DEPTH 4
 
-// Contiguous block of nodes for allocation
-void initNodePool() {
-    ngram_pool = malloc(sizeof(NodePool));
-    if (!ngram_pool) {
-        fprintf(stderr, "Failed to allocate node pool\n");
-        exit(1);
-    }
+// Contiguous blocks of nodes, the first block is small and later blocks double up to POOL_BLOCK_SIZE
+static NGramHashNode* allocateNGramNode(NGramHashTable *table) {
+    NodePool *pool = table->pool;
 
-    ngram_pool->nodes = malloc(POOL_BLOCK_SIZE * sizeof(NGramHashNode));
-    if (!ngram_pool->nodes) {
-        fprintf(stderr, "Failed to allocate node pool block\n");
-        exit(1);
+    // Reuse evicted nodes first
+    if (table->free_nodes != NULL) {
+        NGramHashNode *node = table->free_nodes;
+        table->free_nodes = node->next;
+        return node;
     }
 
-    ngram_pool->used_in_block = 0;
-    ngram_pool->block_size = POOL_BLOCK_SIZE;
-    ngram_pool->next_block = NULL;
-}
-
-NGramHashNode* allocateNGramNode() {
-    // Check if we need a new block
-    //fprintf(stderr,"used %ld size %ld\n",ngram_pool->used_in_block,ngram_pool->block_size);
-    if (ngram_pool->used_in_block >= ngram_pool->block_size) {
-        // Allocate a new block
+    if (pool == NULL || pool->used_in_block >= pool->block_size) {
+        long block_size = POOL_FIRST_BLOCK_SIZE;
+        if (pool != NULL) {
+            block_size = pool->block_size * 2 < POOL_BLOCK_SIZE ? pool->block_size * 2 : POOL_BLOCK_SIZE;
+        }
 
-        NodePool *new_block = malloc(sizeof(NodePool));
+        // The block header and its nodes share one arena allocation
+        NodePool *new_block = arenaAlloc(table->arena, sizeof(NodePool) + block_size * sizeof(NGramHashNode));
         if (!new_block) {
             fprintf(stderr, "Failed to allocate new node pool block\n");
             return NULL;
         }
 
-        new_block->nodes = malloc(POOL_BLOCK_SIZE * sizeof(NGramHashNode));
-        if (!new_block->nodes) {
-            fprintf(stderr, "Failed to allocate new node pool block memory\n");
-            free(new_block);
-            return NULL;
-        }
-
+        new_block->nodes = (NGramHashNode *)(new_block + 1);
         new_block->used_in_block = 0;
-        new_block->block_size = POOL_BLOCK_SIZE;
-        new_block->next_block = ngram_pool;
-        ngram_pool = new_block;
+        new_block->block_size = block_size;
+        new_block->next_block = pool;
+        table->pool = new_block;
+        pool = new_block;
     }
 
     // Return next available node
-    NGramHashNode *node = &ngram_pool->nodes[ngram_pool->used_in_block];
-    ngram_pool->used_in_block++;
+    NGramHashNode *node = &pool->nodes[pool->used_in_block];
+    pool->used_in_block++;
     return node;
 }
 
-void initHashTables() {
-
-    // Possibly use a loop for larger tables, for now it's fine.
-    op_prime_idx[1] = 0;
-    op_prime_idx[2] = 0;
-    op_prime_idx[3] = 0;
-    max_operation_count[1] = UNIGRAM_HASH_SIZE;
-    max_operation_count[2] = prime_sizes[op_prime_idx[2]];
-    max_operation_count[3] = prime_sizes[op_prime_idx[3]];
-
-    unigram_hash_table = calloc(UNIGRAM_HASH_SIZE, sizeof(NGramHashNode*)); // Uneeded to be dynamic, not expected to hit cap
-    bigram_hash_table = calloc(max_operation_count[2], sizeof(NGramHashNode*));
-    trigram_hash_table = calloc(max_operation_count[3], sizeof(NGramHashNode*)); // Unused
-    starter_hash_table = calloc(STARTER_HASH_SIZE, sizeof(NGramHashNode*)); // Uneeded to be dynamic, not expected to hit cap
-
-    if (!unigram_hash_table || !bigram_hash_table ||
-        !trigram_hash_table || !starter_hash_table) {
-        fprintf(stderr, "Failed to allocate hash tables\n");
-        exit(1);
-    }
-    initNodePool();
+void initNGramIterator(NGramIterator *it, NGramHashTable *table) {
+    it->block = table->pool;
+    it->index = 0;
 }
 
-
-static void freeNGramHashTable(NGramHashNode **table, int size) {
-    if (table) {
-        for (int i = 0; i < size; i++) {
-            NGramHashNode *node = table[i];
-            while (node) {
-                NGramHashNode *temp = node;
-                node = node->next;
-                free(temp);
+// Walks the live entries of a table through its node pool, skipping evicted nodes
+NGramHashNode* nextNGram(NGramIterator *it) {
+    while (it->block != NULL) {
+        while (it->index < it->block->used_in_block) {
+            NGramHashNode *node = &it->block->nodes[it->index++];
+            if (node->ngram.op_count != 0) {
+                return node;
             }
         }
-        free(table);
+        it->block = it->block->next_block;
+        it->index = 0;
     }
+    return NULL;
 }
 
-void freeHashTables() {
+// Empties a table, its nodes stay in the arena until the arena is reset or freed
+static void clearNGramHashTable(NGramHashTable *table, Arena *arena) {
+    free(table->buckets);
+    memset(table, 0, sizeof(NGramHashTable));
+    table->arena = arena;
+}
 
+void initHashTables(RuleChef *chef) {
+    // Tables are only allocated when the first n-gram of their kind is added
+    initArena(&chef->model_arena, 0);
+    clearNGramHashTable(&chef->unigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->bigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->trigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->starter_hash_table, &chef->model_arena);
+    memset(&chef->bigram_budget, 0, sizeof(BigramBudget));
+    chef->sort_counter = NULL;
+}
 
-    curr_size_idx = 0;
+void freeHashTables(RuleChef *chef) {
+    clearNGramHashTable(&chef->unigram_hash_table, NULL);
+    clearNGramHashTable(&chef->bigram_hash_table, NULL);
+    clearNGramHashTable(&chef->trigram_hash_table, NULL);
+    clearNGramHashTable(&chef->starter_hash_table, NULL);
 
-    // Free n-gram hash tables using the helper function
-    freeNGramHashTable(unigram_hash_table, UNIGRAM_HASH_SIZE);
-    freeNGramHashTable(bigram_hash_table, max_operation_count[2]);
-    freeNGramHashTable(trigram_hash_table, max_operation_count[3]);
-    freeNGramHashTable(starter_hash_table, STARTER_HASH_SIZE);
+    // Every node of every table goes with the arena
+    freeArena(&chef->model_arena);
 
-    // Set pointers to NULL after freeing
-    unigram_hash_table = NULL;
-    bigram_hash_table = NULL;
-    trigram_hash_table = NULL;
-    starter_hash_table = NULL;
+    freeCountMinSketch(chef->bigram_budget.sketch);
+    memset(&chef->bigram_budget, 0, sizeof(BigramBudget));
+    freeSortCounter(chef->sort_counter);
+    chef->sort_counter = NULL;
+}
 
-    // Free rule deduplication hash table
-    for (int i = 0; i < HASH_SIZE; i++) {
-        HashNode *node = hash_table[i];
-        while (node) {
-            HashNode *temp = node;
-            node = node->next;
-            free(temp);
-        }
-        hash_table[i] = NULL; // Clear the bucket pointer
+// Drops every n-gram but keeps the counting settings, and the arena blocks for the next analysis
+void resetHashTables(RuleChef *chef) {
+    size_t budget_bytes = chef->bigram_budget.bytes;
+    int sort_counting = chef->sort_counter != NULL;
+    ArenaMark empty = {NULL, 0};
+
+    clearNGramHashTable(&chef->unigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->bigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->trigram_hash_table, &chef->model_arena);
+    clearNGramHashTable(&chef->starter_hash_table, &chef->model_arena);
+    arenaReset(&chef->model_arena, empty);
+
+    freeCountMinSketch(chef->bigram_budget.sketch);
+    memset(&chef->bigram_budget, 0, sizeof(BigramBudget));
+    freeSortCounter(chef->sort_counter);
+    chef->sort_counter = NULL;
+
+    chef->rule_count = 0;
+    chef->unigram_count = 0;
+    chef->bigram_count = 0;
+    chef->trigram_count = 0;
+    chef->transition_count = 0;
+    chef->starter_count = 0;
+    chef->input_sampling.lines_read = 0;
+    chef->input_sampling.lines_sampled = 0;
+
+    if (budget_bytes > 0) {
+        setBigramMemoryBudget(chef, budget_bytes);
     }
+    setBigramSortCounting(chef, sort_counting);
 }
 
 
 
-unsigned int hashNGram(CompleteOperation *ops, long op_count, int hash_size) {
+unsigned int hashNGram(CompleteOperation *ops, long op_count, long hash_size) {
     unsigned int hash = 5381;
 
     // Hash each operation in the n-gram
@@ -183,122 +187,13 @@ unsigned int hash(char *str) {
     return hash % HASH_SIZE;
 }
 
-
-
-void addStarterOperationHashed(CompleteOperation *op) {
-
-    NGramHashNode *existing = findNGram(op, 1); // Reuse existing function
-    if (existing != NULL) {
-        unsigned int index = hashNGram(op, 1, STARTER_HASH_SIZE);
-        NGramHashNode *node = starter_hash_table[index];
-
-        while (node != NULL) {
-            if (node->ngram.op_count == 1 &&
-                compareCompleteOps(&node->ngram.ops[0], op)) {
-                node->ngram.frequency++;
-                return;
-            }
-            node = node->next;
-        }
-    }
-
-    NGramHashNode *new_node = malloc(sizeof(NGramHashNode));
-    if (new_node == NULL) {
-        fprintf(stderr, "Failed to allocate memory for starter hash node\n");
-        return;
+NGramHashNode* findNGramInTable(NGramHashTable *table, CompleteOperation *ops, long op_count) {
+    if (table->buckets == NULL) {
+        return NULL;
     }
 
-    new_node->ngram.op_count = 1;
-    new_node->ngram.ops[0] = *op;
-    new_node->ngram.frequency = 1;
-
-    unsigned int index = hashNGram(op, 1, STARTER_HASH_SIZE);
-    new_node->next = starter_hash_table[index];
-    starter_hash_table[index] = new_node;
-
-    starter_count++;
-}
-
-void calculateBigramProbabilities() {
-    // Count totals for each unique from_op (first operation in bigram)
-    typedef struct {
-        CompleteOperation from_op;
-        int total_count;
-    } FromOpTotal;
-
-    FromOpTotal *from_totals = malloc(max_operation_count[2] * sizeof(FromOpTotal));
-    int from_total_count = 0;
-
-    // First pass: Calculate totals for each unique from_op
-    for (int i = 0; i < max_operation_count[2]; i++) {
-        NGramHashNode *node = bigram_hash_table[i];
-        while (node != NULL) {
-            // Only process bigrams (op_count == 2)
-            if (node->ngram.op_count == 2) {
-                // Find or create total for this from_op (ops[0])
-                int found = 0;
-                for (int j = 0; j < from_total_count; j++) {
-                    if (compareCompleteOps(&from_totals[j].from_op, &node->ngram.ops[0])) {
-                        from_totals[j].total_count += node->ngram.frequency;
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found && from_total_count < max_operation_count[2]) {
-                    from_totals[from_total_count].from_op = node->ngram.ops[0];
-                    from_totals[from_total_count].total_count = node->ngram.frequency;
-                    from_total_count++;
-                }
-            }
-            node = node->next;
-        }
-    }
-
-    // Second pass: Calculate probabilities for each bigram
-    for (int i = 0; i < max_operation_count[2]; i++) {
-        NGramHashNode *node = bigram_hash_table[i];
-        while (node != NULL) {
-            if (node->ngram.op_count == 2) {
-                // Find the total for this from_op (ops[0])
-                for (int j = 0; j < from_total_count; j++) {
-                    if (compareCompleteOps(&from_totals[j].from_op, &node->ngram.ops[0])) {
-                        node->ngram.probability = (double)node->ngram.frequency / from_totals[j].total_count;
-                        break;
-                    }
-                }
-            }
-            node = node->next;
-        }
-    }
-
-    free(from_totals);
-}
-
-
-NGramHashNode* findNGram(CompleteOperation *ops, long op_count) {
-    NGramHashNode **hash_table;
-    int hash_size;
-
-    // Select appropriate hash table based on n-gram size
-    switch (op_count) {
-        case 1:
-            hash_table = unigram_hash_table;
-            hash_size = max_operation_count[1];
-            break;
-        case 2:
-            hash_table = bigram_hash_table;
-            hash_size = max_operation_count[2];
-            break;
-        case 3:
-            hash_table = trigram_hash_table;
-            hash_size = max_operation_count[3];
-            break;
-        default:
-            return NULL; // Unsupported n-gram size
-    }
-
-    unsigned int index = hashNGram(ops, op_count, hash_size);
-    NGramHashNode *node = hash_table[index];
+    unsigned int index = hashNGram(ops, op_count, table->size);
+    NGramHashNode *node = table->buckets[index];
 
     while (node != NULL) {
         if (node->ngram.op_count == op_count) {
@@ -318,17 +213,16 @@ NGramHashNode* findNGram(CompleteOperation *ops, long op_count) {
     return NULL;
 }
 
-static int resizeHT(int op_count){
-    int old_size = max_operation_count[op_count];
+static int resizeHT(NGramHashTable *table){
+    long old_size = table->size;
 
-    if (prime_sizes[op_prime_idx[op_count]+1] == 0)
+    if (prime_sizes[table->prime_idx + 1] == 0)
     {
         fprintf(stderr,"Warning: Maximum hashtable size reached... Exiting\n");
         return 0;
     }
 
-    op_prime_idx[op_count]++;
-    int new_size = prime_sizes[op_prime_idx[op_count]];
+    long new_size = prime_sizes[table->prime_idx + 1];
 
     // Alloc new table
     NGramHashNode ** new_HashMap = calloc(new_size, sizeof(NGramHashNode*));
@@ -337,110 +231,357 @@ static int resizeHT(int op_count){
         return 0;
     }
 
-    max_operation_count[op_count] = new_size;
-    NGramHashNode ** old_HashMap;
-    if (op_count == 2){
-        old_HashMap = bigram_hash_table;
-        bigram_hash_table = new_HashMap;
-    }
-    else if(op_count == 3){
-         old_HashMap = trigram_hash_table;
-         trigram_hash_table = new_HashMap;
+    //Rehash from the live entries rather than the old buckets
+    long rehash_count = 0;
+    NGramIterator it;
+    NGramHashNode *node;
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        unsigned int new_idx = hashNGram(node->ngram.ops,
+                           node->ngram.op_count,
+                           new_size);
+        node->next = new_HashMap[new_idx];
+        new_HashMap[new_idx] = node;
+        rehash_count++;
     }
-    else{
-        fprintf(stderr,"Error, something when wrong resizing hash map with %d ops",op_count);
-        free(new_HashMap);
-        return 0;
+
+    free(table->buckets);
+    table->buckets = new_HashMap;
+    table->size = new_size;
+    table->prime_idx++;
+    if (new_size > 1048573) {
+        fprintf(stderr,"Hash map resized: %ld -> %ld buckets, rehashed %ld\n",old_size,new_size,rehash_count);
     }
 
-    //Rehash
+    return 1;
+}
 
-    int rehash_count = 0;
-    for (int i=0; i<old_size; i++)
-    {
-        NGramHashNode * node = old_HashMap[i];
-        while(node != NULL){
-            NGramHashNode * next = node->next;
-            unsigned int new_idx = hashNGram(node->ngram.ops,
-                               node->ngram.op_count,
-                               new_size);
-            node->next = new_HashMap[new_idx];
-            new_HashMap[new_idx] = node;
-            rehash_count++;
-            node=next;
+// Insert a new n-gram, allocating or growing the table as needed
+static NGramHashNode* insertNGram(NGramHashTable *table, CompleteOperation *ops, long op_count, long weight) {
+    if (table->buckets == NULL) {
+        table->prime_idx = 0;
+        table->size = prime_sizes[0];
+        table->buckets = calloc(table->size, sizeof(NGramHashNode*));
+        if (!table->buckets) {
+            fprintf(stderr, "Failed to allocate hash tables\n");
+            return NULL;
+        }
+    }
 
+    if (table->count >= table->size * hm_threshold) {
+        if(!resizeHT(table)){
+            fprintf(stderr,"Warning: Hash table resize failed");
         }
     }
 
-    free(old_HashMap);
-    fprintf(stderr,"Hash map resized: %d -> %d buckets, rehashed %d\n",old_size,new_size,rehash_count);
+    NGramHashNode *new_node = allocateNGramNode(table); //Request from pool of nodes
+    if (new_node == NULL) {
+        return NULL;
+    }
+    new_node->ngram.op_count = op_count;
+    for (long i = 0; i < op_count; i++) {
+        new_node->ngram.ops[i] = ops[i];
+    }
+    new_node->ngram.frequency = weight;
+    new_node->ngram.probability = 0.0;
+
+    unsigned int index = hashNGram(ops, op_count, table->size);
+    new_node->next = table->buckets[index];
+    table->buckets[index] = new_node;
+    table->count++;
 
-    return 1;
+    return new_node;
 }
 
-void addOperationNGramHashed(CompleteOperation *ops, long op_count, long *count, long max_count) {
-    // Check if n-gram already exists
-    NGramHashNode *existing = findNGram(ops, op_count);
+void addStarterOperationHashed(RuleChef *chef, CompleteOperation *op, long weight) {
+
+    NGramHashNode *existing = findNGramInTable(&chef->starter_hash_table, op, 1);
     if (existing != NULL) {
-        existing->ngram.frequency++;
+        existing->ngram.frequency += weight;
         return;
     }
 
-    if (op_count > 1)
-    {
-        if (*count >= (max_operation_count[op_count]  * 0.8)) {
-            if(!resizeHT(op_count)){
-                fprintf(stderr,"Warning: Hash table resize failed");
-            }
+    if (insertNGram(&chef->starter_hash_table, op, 1, weight) == NULL) {
+        fprintf(stderr, "Failed to allocate memory for starter hash node\n");
+        return;
+    }
+
+    chef->starter_count++;
+}
+
+// Transition probability of each bigram given its first op, bigrams under the minimum count are left out
+// of the totals and get probability 0. Totals are found through a JudySL keyed by the first op
+void calculateBigramProbabilities(RuleChef *chef) {
+    Pvoid_t totals = (Pvoid_t)NULL;
+    PWord_t PValue;
+    NGramIterator it;
+    NGramHashNode *node;
+
+    initNGramIterator(&it, &chef->bigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count == 2 && node->ngram.frequency >= chef->min_count) {
+            JSLI(PValue, totals, (const uint8_t *)node->ngram.ops[0].full_op);
+            *PValue += node->ngram.frequency;
         }
     }
 
-    NGramHashNode *new_node = allocateNGramNode(); //Request from pool of nodes
-    new_node->ngram.op_count = op_count;
-    for (long i = 0; i < op_count; i++) {
-        new_node->ngram.ops[i] = ops[i];
+    initNGramIterator(&it, &chef->bigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count != 2) {
+            continue;
+        }
+        node->ngram.probability = 0.0;
+        if (node->ngram.frequency >= chef->min_count) {
+            JSLG(PValue, totals, (const uint8_t *)node->ngram.ops[0].full_op);
+            if (PValue != NULL && *PValue > 0) {
+                node->ngram.probability = (double)node->ngram.frequency / *PValue;
+            }
+        }
     }
-    new_node->ngram.frequency = 1;
 
-    // Select appropriate hash table and insert
-    NGramHashNode **hash_table;
-    int hash_size;
+    Word_t freed;
+    JSLFA(freed, totals);
+    (void)freed;
+}
 
+
+// Select the table that holds n-grams of this size
+static NGramHashTable* tableForNGram(RuleChef *chef, long op_count) {
     switch (op_count) {
         case 1:
-            hash_table = unigram_hash_table;
-            hash_size = UNIGRAM_HASH_SIZE;
-            break;
+            return &chef->unigram_hash_table;
         case 2:
-            hash_table = bigram_hash_table;
-            hash_size = max_operation_count[op_count];
-            break;
+            return &chef->bigram_hash_table;
         case 3:
-            hash_table = trigram_hash_table;
-            hash_size = max_operation_count[op_count];
-            break;
+            return &chef->trigram_hash_table;
         default:
-            //free(new_node);
-            return; // Unsupported n-gram size
+            return NULL; // Unsupported n-gram size
+    }
+}
+
+NGramHashNode* findNGram(RuleChef *chef, CompleteOperation *ops, long op_count) {
+    NGramHashTable *table = tableForNGram(chef, op_count);
+    if (table == NULL) {
+        return NULL;
     }
+    return findNGramInTable(table, ops, op_count);
+}
 
-    unsigned int index = hashNGram(ops, op_count, hash_size);
-    new_node->next = hash_table[index];
-    hash_table[index] = new_node;
+static int compareLongs(const void *a, const void *b) {
+    long la = *(const long *)a;
+    long lb = *(const long *)b;
+    return (la > lb) - (la < lb);
+}
 
-    (*count)++;
+// Split the memory budget between the sketch and the exact bigram table
+// Returns 0 and leaves counting unbounded when the sketch cannot be allocated
+int setBigramMemoryBudget(RuleChef *chef, size_t bytes) {
+    BigramBudget *budget = &chef->bigram_budget;
+    // Each exact entry costs its node plus a share of the bucket array (load factor and prime growth)
+    size_t entry_cost = sizeof(NGramHashNode) + 3 * sizeof(NGramHashNode *);
+
+    freeCountMinSketch(budget->sketch);
+    budget->sketch = createCountMinSketch(bytes / 4, SKETCH_DEPTH);
+    if (budget->sketch == NULL) {
+        budget->bytes = 0;
+        return 0;
+    }
+    budget->bytes = bytes;
+    budget->capacity = (long)((bytes - getSketchBytes(budget->sketch)) / entry_cost);
+    if (budget->capacity < POOL_FIRST_BLOCK_SIZE) {
+        budget->capacity = POOL_FIRST_BLOCK_SIZE;
+    }
+    return 1;
+}
+
+// Evict the lower half of the exact bigram counts, their counts stay in the sketch. Entries strictly below
+// the median go first, so ties at the median never take the heavy hitters with them. When nothing is below
+// the median (eg. every count is still 1) exactly half of the lowest count entries are evicted instead.
+// Without memory to sort the counts the table simply grows past its capacity
+static void pruneBigramTable(RuleChef *chef, long *count) {
+    BigramBudget *budget = &chef->bigram_budget;
+    NGramHashTable *table = &chef->bigram_hash_table;
+    long *frequencies = malloc(table->count * sizeof(long));
+    long n = 0;
+    NGramIterator it;
+    NGramHashNode *node;
+
+    if (frequencies == NULL) {
+        fprintf(stderr, "Failed to allocate memory for bigram pruning\n");
+        return;
+    }
+
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        frequencies[n++] = node->ngram.frequency;
+    }
+    qsort(frequencies, n, sizeof(long), compareLongs);
+    long median = frequencies[n / 2];
+    long below = 0;
+    while (below < n && frequencies[below] < median) {
+        below++;
+    }
+
+    // Evict counts below threshold, plus up to ties entries of exactly threshold
+    long threshold = median;
+    long ties = 0;
+    if (below == 0) {
+        ties = n / 2;
+    }
+    long evicted_max = below > 0 ? frequencies[below - 1] : median;
+    free(frequencies);
+
+    for (long i = 0; i < table->size; i++) {
+        NGramHashNode **link = &table->buckets[i];
+        while (*link != NULL) {
+            node = *link;
+            int evict = node->ngram.frequency < threshold;
+            if (!evict && node->ngram.frequency == threshold && ties > 0) {
+                evict = 1;
+                ties--;
+            }
+            if (evict) {
+                *link = node->next;
+                node->ngram.op_count = 0;
+                node->next = table->free_nodes;
+                table->free_nodes = node;
+                table->count--;
+                (*count)--;
+                budget->evicted_total++;
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+
+    if (evicted_max > budget->evicted_max) {
+        budget->evicted_max = evicted_max;
+    }
+    budget->prune_count++;
+}
+
+static void addBudgetedBigram(RuleChef *chef, CompleteOperation *ops, long *count, long weight) {
+    BigramBudget *budget = &chef->bigram_budget;
+    long estimate = addCountMinSketch(budget->sketch, ops, 2, weight);
+
+    NGramHashNode *existing = findNGramInTable(&chef->bigram_hash_table, ops, 2);
+    if (existing != NULL) {
+        existing->ngram.frequency += weight;
+        return;
+    }
+
+    if (chef->bigram_hash_table.count >= budget->capacity) {
+        pruneBigramTable(chef, count);
+    }
+
+    // A re-admitted bigram lost at most evicted_max counts, the sketch gives a tighter bound when it can
+    long seed = budget->evicted_max + weight;
+    if (estimate < seed) {
+        seed = estimate;
+    }
+    if (insertNGram(&chef->bigram_hash_table, ops, 2, seed) != NULL) {
+        (*count)++;
+    }
+}
+
+int setBigramSortCounting(RuleChef *chef, int enabled) {
+    if (enabled && chef->sort_counter == NULL) {
+        chef->sort_counter = createSortCounter();
+        return chef->sort_counter != NULL;
+    } else if (!enabled && chef->sort_counter != NULL) {
+        flushSortedBigrams(chef);
+        freeSortCounter(chef->sort_counter);
+        chef->sort_counter = NULL;
+    }
+    return 1;
+}
+
+// Moves the sorted counts into the bigram table, one lookup per distinct bigram instead of per occurrence
+// Returns 0 when the sort counter ran out of memory and dropped counts
+int flushSortedBigrams(RuleChef *chef) {
+    if (chef->sort_counter == NULL) {
+        return 1;
+    }
+
+    long count;
+    SortedCount *counts = drainSortCounter(chef->sort_counter, &count);
+    for (long i = 0; i < count; i++) {
+        CompleteOperation ops[2];
+        unpackSortKey(counts[i].key, ops);
+
+        NGramHashNode *existing = findNGramInTable(&chef->bigram_hash_table, ops, 2);
+        if (existing != NULL) {
+            existing->ngram.frequency += counts[i].count;
+        } else if (insertNGram(&chef->bigram_hash_table, ops, 2, counts[i].count) != NULL) {
+            chef->bigram_count++;
+        }
+    }
+    free(counts);
+    return !sortCounterFailed(chef->sort_counter);
+}
+
+void printBigramMemoryStats(RuleChef *chef) {
+    BigramBudget *budget = &chef->bigram_budget;
+    CountMinSketch *sketch = budget->sketch;
+    if (sketch == NULL) {
+        return;
+    }
+
+    size_t exact_bytes = chef->bigram_hash_table.size * sizeof(NGramHashNode *);
+    for (NodePool *block = chef->bigram_hash_table.pool; block != NULL; block = block->next_block) {
+        exact_bytes += block->block_size * sizeof(NGramHashNode) + sizeof(NodePool);
+    }
+    double epsilon = getSketchEpsilon(sketch);
+
+    fprintf(stderr, "Bigram memory budget: %.2f MB\n", (double)budget->bytes / (1024 * 1024));
+    fprintf(stderr, "  Count-min sketch: %ld x %d counters, %.2f MB\n",
+            sketch->width, sketch->depth, (double)getSketchBytes(sketch) / (1024 * 1024));
+    fprintf(stderr, "  Exact bigrams: %ld tracked (capacity %ld), %.2f MB\n",
+            chef->bigram_hash_table.count, budget->capacity, (double)exact_bytes / (1024 * 1024));
+    fprintf(stderr, "  Pruned %ld times, %ld long tail bigrams evicted (max evicted count %ld)\n",
+            budget->prune_count, budget->evicted_total, budget->evicted_max);
+    fprintf(stderr, "  Error bound: counts overestimated by at most %.6g x %ld = %.1f with probability %.4f\n",
+            epsilon, sketch->total, epsilon * sketch->total, 1.0 - getSketchDelta(sketch));
+}
+
+void addOperationNGramHashed(RuleChef *chef, CompleteOperation *ops, long op_count, long *count, long weight) {
+    NGramHashTable *table = tableForNGram(chef, op_count);
+    if (table == NULL) {
+        return;
+    }
+
+    if (op_count == 2 && chef->sort_counter != NULL) {
+        addSortCounter(chef->sort_counter, ops, weight);
+        return;
+    }
+
+    if (op_count == 2 && chef->bigram_budget.sketch != NULL) {
+        addBudgetedBigram(chef, ops, count, weight);
+        return;
+    }
+
+    // Check if n-gram already exists
+    NGramHashNode *existing = findNGramInTable(table, ops, op_count);
+    if (existing != NULL) {
+        existing->ngram.frequency += weight;
+        return;
+    }
+
+    if (insertNGram(table, ops, op_count, weight) != NULL) {
+        (*count)++;
+    }
 }
 
-void addUnigramHashed(CompleteOperation *op) {
-    addOperationNGramHashed(op, 1, &unigram_count, max_operation_count[1]);
+void addUnigramHashed(RuleChef *chef, CompleteOperation *op, long weight) {
+    addOperationNGramHashed(chef, op, 1, &chef->unigram_count, weight);
 }
 
-void addBigramHashed(CompleteOperation *ops) {
-    addOperationNGramHashed(ops, 2, &bigram_count, max_operation_count[2]);
+void addBigramHashed(RuleChef *chef, CompleteOperation *ops, long weight) {
+    addOperationNGramHashed(chef, ops, 2, &chef->bigram_count, weight);
 }
 
-void addTrigramHashed(CompleteOperation *ops) {
-    addOperationNGramHashed(ops, 3, &trigram_count, max_operation_count[3]);
+void addTrigramHashed(RuleChef *chef, CompleteOperation *ops, long weight) {
+    addOperationNGramHashed(chef, ops, 3, &chef->trigram_count, weight);
 }
 
 
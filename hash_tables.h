@@ -4,41 +4,55 @@
 #include "types.h"
 
 // Hash table management functions
-void initHashTables();
-void freeHashTables();
+void initHashTables(RuleChef *chef);
+void freeHashTables(RuleChef *chef);
+void resetHashTables(RuleChef *chef);
 
 // Hash functions
 unsigned int hashTransition(CompleteOperation *from_op, CompleteOperation *to_op);
-unsigned int hashNGram(CompleteOperation *ops, long op_count, int hash_size);
+unsigned int hashNGram(CompleteOperation *ops, long op_count, long hash_size);
 unsigned int hash(char *str);
 
 // Transition hash table functions
-void addStarterOperationHashed(CompleteOperation *op);
+void addStarterOperationHashed(RuleChef *chef, CompleteOperation *op, long weight);
 
 
 // N-gram hash table functions
-NGramHashNode* findNGram(CompleteOperation *ops, long op_count);
-void addOperationNGramHashed(CompleteOperation *ops, long op_count, long *count, long max_count);
-void addUnigramHashed(CompleteOperation *op);
-void addBigramHashed(CompleteOperation *ops);
-void addTrigramHashed(CompleteOperation *ops);
+NGramHashNode* findNGram(RuleChef *chef, CompleteOperation *ops, long op_count);
+NGramHashNode* findNGramInTable(NGramHashTable *table, CompleteOperation *ops, long op_count);
+void addOperationNGramHashed(RuleChef *chef, CompleteOperation *ops, long op_count, long *count, long weight);
+void addUnigramHashed(RuleChef *chef, CompleteOperation *op, long weight);
+void addBigramHashed(RuleChef *chef, CompleteOperation *ops, long weight);
+void addTrigramHashed(RuleChef *chef, CompleteOperation *ops, long weight);
+
+// Iteration over live entries
+void initNGramIterator(NGramIterator *it, NGramHashTable *table);
+NGramHashNode* nextNGram(NGramIterator *it);
 
 // Extraction functions
-OperationNGram* extractNGramsFromHashTable(NGramHashNode **hash_table, int hash_size, int ngram_type, int *total_count);
-OperationNGram* getSortedUnigramsFromHashTable(int *count, int limit_unigrams);
+OperationNGram* getSortedUnigramsFromHashTable(RuleChef *chef, int *count, int limit_unigrams);
 
 
 
 // Count functions
 long getUnigramCountFromHashTable();
-long getBigramCountFromHashTable();
+long getBigramCountFromHashTable(RuleChef *chef);
 long getTrigramCountFromHashTable();
 long getTransitionCountFromHashTable();
 
+// Bounded bigram counting
+int setBigramMemoryBudget(RuleChef *chef, size_t bytes);
+void printBigramMemoryStats(RuleChef *chef);
+
+// Sort based bigram counting, counts reach the bigram table when flushed
+// Both return 0 when out of memory
+int setBigramSortCounting(RuleChef *chef, int enabled);
+int flushSortedBigrams(RuleChef *chef);
+
 // Statistics and debugging
-void printTopNGramsFromHashTable();
-void printAllNGramHashTableStats();
-void calculateBigramProbabilities();
+void printTopNGramsFromHashTable(RuleChef *chef);
+void printAllNGramHashTableStats(RuleChef *chef);
+void calculateBigramProbabilities(RuleChef *chef);
 // Comparison functions
 int compareNGramsByFrequency(const void *a, const void *b);
 
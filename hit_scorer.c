@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "hit_scorer.h"
+#include "rule_parser.h"
+#include "rule_engine.h"
+#include "buffer.h"
+
+#define LOAD_CHUNK_SIZE (16 * 1024 * 1024)
+
+// Open addressing set over the lines of a LineList, slots hold line index + 1
+typedef struct {
+    uint32_t *slots;
+    uint32_t *tags;
+    size_t mask;
+    const LineList *lines;
+} PlainSet;
+
+typedef struct {
+    const LineList *rules;
+    const LineList *words;
+    const PlainSet *plains;
+    long *hits;
+    long next_rule;
+    long unsupported;
+} HitJob;
+
+typedef struct {
+    long hits;
+    long index;
+} RuleHits;
+
+int getDefaultThreadCount(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static uint64_t hashBytes(const char *str, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void appendLineData(LineList *list, const char *data, size_t len) {
+    if (list->failed) {
+        return;
+    }
+    if (list->size + len + 1 > list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity : LOAD_CHUNK_SIZE;
+        while (new_capacity < list->size + len + 1) {
+            new_capacity *= 2;
+        }
+        char *data_grown = realloc(list->data, new_capacity);
+        if (data_grown == NULL) {
+            fprintf(stderr, "Failed to allocate memory for line data\n");
+            list->failed = 1;
+            return;
+        }
+        list->data = data_grown;
+        list->capacity = new_capacity;
+    }
+    memcpy(list->data + list->size, data, len);
+    list->size += len;
+}
+
+void collectRulesSink(void *arg, const char *data, size_t len) {
+    appendLineData((LineList *)arg, data, len);
+}
+
+// Split the raw data into NUL terminated lines, stripping CR/LF
+int splitLineList(LineList *list) {
+    if (list->failed) {
+        return 0;
+    }
+    long count = 0;
+    for (size_t i = 0; i < list->size; i++) {
+        if (list->data[i] == '\n') count++;
+    }
+    if (list->size > 0 && list->data[list->size - 1] != '\n') {
+        appendLineData(list, "\n", 1);
+        count++;
+    }
+
+    free(list->offsets);
+    free(list->lengths);
+    list->offsets = malloc((count + 1) * sizeof(size_t));
+    list->lengths = malloc((count + 1) * sizeof(int));
+    if (list->offsets == NULL || list->lengths == NULL) {
+        fprintf(stderr, "Failed to allocate memory for line index\n");
+        list->failed = 1;
+        return 0;
+    }
+
+    list->count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < list->size; i++) {
+        if (list->data[i] != '\n') continue;
+        size_t end = i;
+        list->data[i] = '\0';
+        if (end > start && list->data[end - 1] == '\r') {
+            list->data[--end] = '\0';
+        }
+        list->offsets[list->count] = start;
+        list->lengths[list->count] = (int)(end - start);
+        list->count++;
+        start = i + 1;
+    }
+    return 1;
+}
+
+int loadLineList(const char *path, LineList *list) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error opening file: %s\n", path);
+        return 0;
+    }
+
+    char *chunk = malloc(LOAD_CHUNK_SIZE);
+    if (chunk == NULL) {
+        fprintf(stderr, "Failed to allocate read buffer\n");
+        fclose(file);
+        return 0;
+    }
+
+    size_t read;
+    while (!list->failed && (read = fread(chunk, 1, LOAD_CHUNK_SIZE, file)) > 0) {
+        appendLineData(list, chunk, read);
+    }
+    free(chunk);
+    fclose(file);
+
+    return splitLineList(list);
+}
+
+void freeLineList(LineList *list) {
+    free(list->data);
+    free(list->offsets);
+    free(list->lengths);
+    memset(list, 0, sizeof(LineList));
+}
+
+static int initPlainSet(PlainSet *set, const LineList *lines) {
+    size_t capacity = 16;
+    while (capacity < (size_t)lines->count * 2) {
+        capacity <<= 1;
+    }
+
+    set->slots = calloc(capacity, sizeof(uint32_t));
+    set->tags = calloc(capacity, sizeof(uint32_t));
+    if (set->slots == NULL || set->tags == NULL) {
+        fprintf(stderr, "Failed to allocate plaintext hash set\n");
+        free(set->slots);
+        free(set->tags);
+        return 0;
+    }
+    set->mask = capacity - 1;
+    set->lines = lines;
+
+    for (long i = 0; i < lines->count; i++) {
+        const char *plain = lines->data + lines->offsets[i];
+        int len = lines->lengths[i];
+        uint64_t hash = hashBytes(plain, len);
+        size_t slot = hash & set->mask;
+
+        while (set->slots[slot] != 0) {
+            uint32_t other = set->slots[slot] - 1;
+            if (set->tags[slot] == (uint32_t)(hash >> 32) && lines->lengths[other] == len &&
+                memcmp(lines->data + lines->offsets[other], plain, len) == 0) {
+                break; // Duplicate plaintext
+            }
+            slot = (slot + 1) & set->mask;
+        }
+        set->slots[slot] = (uint32_t)(i + 1);
+        set->tags[slot] = (uint32_t)(hash >> 32);
+    }
+    return 1;
+}
+
+static int plainSetContains(const PlainSet *set, const char *word, int len) {
+    uint64_t hash = hashBytes(word, len);
+    size_t slot = hash & set->mask;
+
+    while (set->slots[slot] != 0) {
+        uint32_t index = set->slots[slot] - 1;
+        if (set->tags[slot] == (uint32_t)(hash >> 32) && set->lines->lengths[index] == len &&
+            memcmp(set->lines->data + set->lines->offsets[index], word, len) == 0) {
+            return 1;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    return 0;
+}
+
+static void freePlainSet(PlainSet *set) {
+    free(set->slots);
+    free(set->tags);
+}
+
+// Each worker takes whole rules and pushes every base word through the compiled rule
+static void *hitWorker(void *arg) {
+    HitJob *job = (HitJob *)arg;
+    char rule[MAX_RULE_LEN];
+    char out[RULE_WORD_MAX];
+    ParsedRule parsed;
+    CompiledOperation compiled[MAX_RULE_LEN];
+
+    while (1) {
+        long r = __sync_fetch_and_add(&job->next_rule, 1);
+        if (r >= job->rules->count) break;
+
+        int rule_len = job->rules->lengths[r];
+        if (rule_len <= 0 || rule_len >= MAX_RULE_LEN) continue;
+        memcpy(rule, job->rules->data + job->rules->offsets[r], rule_len + 1);
+
+        if (!parseRuleIntoOperations(rule, &parsed) ||
+            !compileRule(parsed.operations, parsed.op_count, compiled)) {
+            __sync_fetch_and_add(&job->unsupported, 1);
+            continue;
+        }
+
+        long hits = 0;
+        const LineList *words = job->words;
+        for (long w = 0; w < words->count; w++) {
+            int len = applyCompiledRule(compiled, parsed.op_count,
+                                        words->data + words->offsets[w], words->lengths[w], out);
+            if (len >= 0 && plainSetContains(job->plains, out, len)) {
+                hits++;
+            }
+        }
+        job->hits[r] = hits;
+    }
+    return NULL;
+}
+
+static int compareRuleHits(const void *a, const void *b) {
+    const RuleHits *hits_a = (const RuleHits *)a;
+    const RuleHits *hits_b = (const RuleHits *)b;
+
+    if (hits_a->hits != hits_b->hits) {
+        return hits_a->hits < hits_b->hits ? 1 : -1;
+    }
+    return hits_a->index < hits_b->index ? -1 : (hits_a->index > hits_b->index);
+}
+
+int scoreRulesByHits(LineList *rules, const char *wordlist, const char *cracked,
+                     long min_hits, int threads, int verbose, WBuffer *output_buffer) {
+    LineList words = {0};
+    LineList plains = {0};
+    PlainSet plain_set;
+    time_t start = time(NULL);
+
+    if (!loadLineList(wordlist, &words) || !loadLineList(cracked, &plains) || !initPlainSet(&plain_set, &plains)) {
+        freeLineList(&words);
+        freeLineList(&plains);
+        return 0;
+    }
+
+    if (threads < 1) threads = getDefaultThreadCount();
+    if (verbose) {
+        fprintf(stderr, "\n=== Hit Scoring ===\n");
+        fprintf(stderr, "Scoring %ld rules against %ld base words and %ld cracked plaintexts using %d threads\n",
+                rules->count, words.count, plains.count, threads);
+    }
+
+    HitJob job;
+    job.rules = rules;
+    job.words = &words;
+    job.plains = &plain_set;
+    job.hits = calloc(rules->count + 1, sizeof(long));
+    job.next_rule = 0;
+    job.unsupported = 0;
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    RuleHits *ranked = malloc((rules->count + 1) * sizeof(RuleHits));
+    if (job.hits == NULL || workers == NULL || ranked == NULL) {
+        fprintf(stderr, "Failed to allocate memory for hit scoring\n");
+        free(ranked);
+        free(workers);
+        free(job.hits);
+        freePlainSet(&plain_set);
+        freeLineList(&words);
+        freeLineList(&plains);
+        return 0;
+    }
+
+    // With no thread started the rules are scored here
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, hitWorker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        hitWorker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    for (long i = 0; i < rules->count; i++) {
+        ranked[i].hits = job.hits[i];
+        ranked[i].index = i;
+    }
+    qsort(ranked, rules->count, sizeof(RuleHits), compareRuleHits);
+
+    long emitted = 0;
+    for (long i = 0; i < rules->count; i++) {
+        if (ranked[i].hits < min_hits) break;
+        buffer_string2(output_buffer, rules->data + rules->offsets[ranked[i].index], MAX_RULE_LEN);
+        emitted++;
+    }
+    flush_buffer(output_buffer);
+
+    if (verbose) {
+        int show_count = rules->count < 20 ? (int)rules->count : 20;
+        fprintf(stderr, "Top rules by hits:\n");
+        for (int i = 0; i < show_count; i++) {
+            fprintf(stderr, "'%s': %ld hits\n", rules->data + rules->offsets[ranked[i].index], ranked[i].hits);
+        }
+        fprintf(stderr, "Hit scoring complete in %lds. Emitted %ld rules (min hits %ld), %ld unsupported\n",
+                (long)(time(NULL) - start), emitted, min_hits, job.unsupported);
+    }
+
+    free(ranked);
+    free(workers);
+    free(job.hits);
+    freePlainSet(&plain_set);
+    freeLineList(&words);
+    freeLineList(&plains);
+    return 1;
+}
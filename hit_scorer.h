@@ -0,0 +1,31 @@
+#ifndef HIT_SCORER_H
+#define HIT_SCORER_H
+
+#include "types.h"
+
+// Lines of a text file (or of collected output) held in a single allocation
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t *offsets;
+    int *lengths;
+    long count;
+    int failed;         // Lines were dropped because memory ran out
+} LineList;
+
+// Line list functions, both return 0 when the file cannot be read or memory runs out
+int loadLineList(const char *path, LineList *list);
+int splitLineList(LineList *list);
+void freeLineList(LineList *list);
+
+// WBuffer sink that appends generated rules to a LineList, setting failed when they cannot be kept
+void collectRulesSink(void *arg, const char *data, size_t len);
+
+// Rank rules by the number of cracked plaintexts they produce from the base wordlist
+int scoreRulesByHits(LineList *rules, const char *wordlist, const char *cracked,
+                     long min_hits, int threads, int verbose, WBuffer *output_buffer);
+
+int getDefaultThreadCount(void);
+
+#endif
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "input_stream.h"
+
+typedef struct {
+    char *data;
+    size_t length;
+} InputChunk;
+
+struct RuleInput {
+    int fd;
+    int compressed;
+    size_t file_size;
+    size_t raw_read;    // Bytes read from the underlying file, compressed or not
+    int eof;
+    int skip_line;
+    int failed;         // Set by whichever side hit the error, read once the data is consumed
+
+    // Line buffer owned by the parser
+    char *buffer;
+    size_t start;
+    size_t end;
+
+    // Bounded queue between the decompression thread and the parser
+    pthread_t inflater;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    InputChunk queue[INPUT_QUEUE_DEPTH];
+    int head;
+    int queued;
+    int producer_done;
+    int stop;
+    InputChunk *current;
+    size_t current_offset;
+
+    // First raw bytes, read to detect the gzip magic
+    char peek[2];
+    size_t peek_length;
+};
+
+static ssize_t readFully(int fd, char *data, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t got = read(fd, data + total, size - total);
+        if (got < 0) return -1;
+        if (got == 0) break;
+        total += got;
+    }
+    return (ssize_t)total;
+}
+
+// Hands a filled chunk to the parser, blocking while the queue is full
+static int pushChunk(RuleInput *input, char *data, size_t length) {
+    pthread_mutex_lock(&input->lock);
+    while (input->queued == INPUT_QUEUE_DEPTH && !input->stop) {
+        pthread_cond_wait(&input->not_full, &input->lock);
+    }
+    if (input->stop) {
+        pthread_mutex_unlock(&input->lock);
+        return 0;
+    }
+    InputChunk *slot = &input->queue[(input->head + input->queued) % INPUT_QUEUE_DEPTH];
+    memcpy(slot->data, data, length);
+    slot->length = length;
+    input->queued++;
+    pthread_cond_signal(&input->not_empty);
+    pthread_mutex_unlock(&input->lock);
+    return 1;
+}
+
+static void *inflateWorker(void *arg) {
+    RuleInput *input = (RuleInput *)arg;
+    unsigned char *raw = malloc(INPUT_CHUNK_SIZE);
+    char *out = malloc(INPUT_CHUNK_SIZE);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    int failed = 0;
+
+    if (raw == NULL || out == NULL || inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "Failed to initialise gzip decompression\n");
+        failed = 1;
+        goto done;
+    }
+
+    // Start with the bytes consumed while detecting the format
+    memcpy(raw, input->peek, input->peek_length);
+    stream.next_in = raw;
+    stream.avail_in = input->peek_length;
+    int in_member = 1;      // Inside a gzip member that has not reached its end yet
+
+    while (1) {
+        if (stream.avail_in == 0) {
+            ssize_t got = read(input->fd, raw, INPUT_CHUNK_SIZE);
+            if (got < 0) {
+                fprintf(stderr, "Error reading compressed input\n");
+                failed = 1;
+                break;
+            }
+            if (got == 0) {
+                if (in_member) {
+                    fprintf(stderr, "Error decompressing input: unexpected end of gzip data\n");
+                    failed = 1;
+                }
+                break;
+            }
+            __sync_fetch_and_add(&input->raw_read, (size_t)got);
+            stream.next_in = raw;
+            stream.avail_in = got;
+        }
+        in_member = 1;
+
+        stream.next_out = (unsigned char *)out;
+        stream.avail_out = INPUT_CHUNK_SIZE;
+        int rc = inflate(&stream, Z_NO_FLUSH);
+        size_t produced = INPUT_CHUNK_SIZE - stream.avail_out;
+
+        if (produced > 0 && !pushChunk(input, out, produced)) break;
+
+        if (rc == Z_STREAM_END) {
+            // Concatenated gzip members are valid, continue with the next one
+            inflateReset(&stream);
+            in_member = 0;
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            fprintf(stderr, "Error decompressing input: %s\n", stream.msg ? stream.msg : "corrupt data");
+            failed = 1;
+            break;
+        }
+    }
+    inflateEnd(&stream);
+
+done:
+    free(raw);
+    free(out);
+    pthread_mutex_lock(&input->lock);
+    // A stop requested by closeRuleInput is not an input error
+    input->failed = failed && !input->stop;
+    input->producer_done = 1;
+    pthread_cond_signal(&input->not_empty);
+    pthread_mutex_unlock(&input->lock);
+    return NULL;
+}
+
+// The queue of a compressed input whose decompression thread has stopped or never started
+static void freeInputQueue(RuleInput *input) {
+    for (int i = 0; i < INPUT_QUEUE_DEPTH; i++) {
+        free(input->queue[i].data);
+    }
+    pthread_mutex_destroy(&input->lock);
+    pthread_cond_destroy(&input->not_empty);
+    pthread_cond_destroy(&input->not_full);
+}
+
+RuleInput *openRuleInput(const char *path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    RuleInput *input = calloc(1, sizeof(RuleInput));
+    if (input == NULL) {
+        fprintf(stderr, "Failed to allocate input stream\n");
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        return NULL;
+    }
+    input->fd = fd;
+    input->buffer = malloc(INPUT_BUFFER_SIZE + 1);
+    if (input->buffer == NULL) {
+        fprintf(stderr, "Failed to allocate input buffer\n");
+        closeRuleInput(input);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        input->file_size = st.st_size;
+    }
+
+    ssize_t got = readFully(fd, input->peek, 2);
+    input->peek_length = got > 0 ? (size_t)got : 0;
+    input->raw_read = input->peek_length;
+    input->compressed = input->peek_length == 2 &&
+                        (unsigned char)input->peek[0] == 0x1f && (unsigned char)input->peek[1] == 0x8b;
+
+    if (input->compressed) {
+        pthread_mutex_init(&input->lock, NULL);
+        pthread_cond_init(&input->not_empty, NULL);
+        pthread_cond_init(&input->not_full, NULL);
+        for (int i = 0; i < INPUT_QUEUE_DEPTH; i++) {
+            input->queue[i].data = malloc(INPUT_CHUNK_SIZE);
+        }
+        for (int i = 0; i < INPUT_QUEUE_DEPTH; i++) {
+            if (input->queue[i].data == NULL) {
+                fprintf(stderr, "Failed to allocate input queue\n");
+                input->compressed = 0;
+                freeInputQueue(input);
+                closeRuleInput(input);
+                return NULL;
+            }
+        }
+        if (pthread_create(&input->inflater, NULL, inflateWorker, input) != 0) {
+            fprintf(stderr, "Failed to start decompression thread\n");
+            input->compressed = 0;
+            freeInputQueue(input);
+            closeRuleInput(input);
+            return NULL;
+        }
+    } else {
+        memcpy(input->buffer, input->peek, input->peek_length);
+        input->end = input->peek_length;
+    }
+
+    return input;
+}
+
+// Pull more data into the line buffer after start..end, returns bytes added
+static size_t fillBuffer(RuleInput *input) {
+    size_t space = INPUT_BUFFER_SIZE - input->end;
+    if (space == 0) return 0;
+
+    if (!input->compressed) {
+        ssize_t got = read(input->fd, input->buffer + input->end, space);
+        if (got <= 0) {
+            if (got < 0) {
+                fprintf(stderr, "Error reading input\n");
+                input->failed = 1;
+            }
+            return 0;
+        }
+        input->raw_read += got;
+        input->end += got;
+        return got;
+    }
+
+    pthread_mutex_lock(&input->lock);
+    if (input->current == NULL) {
+        while (input->queued == 0 && !input->producer_done) {
+            pthread_cond_wait(&input->not_empty, &input->lock);
+        }
+        if (input->queued == 0) {
+            pthread_mutex_unlock(&input->lock);
+            return 0;
+        }
+        input->current = &input->queue[input->head];
+        input->current_offset = 0;
+    }
+    pthread_mutex_unlock(&input->lock);
+
+    size_t available = input->current->length - input->current_offset;
+    size_t take = available < space ? available : space;
+    memcpy(input->buffer + input->end, input->current->data + input->current_offset, take);
+    input->end += take;
+    input->current_offset += take;
+
+    if (input->current_offset == input->current->length) {
+        pthread_mutex_lock(&input->lock);
+        input->current = NULL;
+        input->head = (input->head + 1) % INPUT_QUEUE_DEPTH;
+        input->queued--;
+        pthread_cond_signal(&input->not_full);
+        pthread_mutex_unlock(&input->lock);
+    }
+    return take;
+}
+
+char *readRuleLine(RuleInput *input, size_t *length) {
+    while (1) {
+        char *line = input->buffer + input->start;
+        char *newline = memchr(line, '\n', input->end - input->start);
+
+        if (newline != NULL) {
+            size_t len = newline - line;
+            *newline = '\0';
+            input->start += len + 1;
+            if (input->skip_line) {
+                // Tail of a line that overflowed the buffer
+                input->skip_line = 0;
+                continue;
+            }
+            if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+            *length = len;
+            return line;
+        }
+
+        if (input->eof) {
+            if (input->start == input->end || input->skip_line) return NULL;
+            // Last line without a trailing newline
+            size_t len = input->end - input->start;
+            line[len] = '\0';
+            if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+            input->start = input->end;
+            *length = len;
+            return line;
+        }
+
+        // Compact, then refill
+        if (input->start > 0) {
+            memmove(input->buffer, input->buffer + input->start, input->end - input->start);
+            input->end -= input->start;
+            input->start = 0;
+        }
+        if (input->end == INPUT_BUFFER_SIZE) {
+            // A single line filled the whole buffer, nothing useful can be parsed from it
+            input->start = input->end = 0;
+            input->skip_line = 1;
+        }
+        if (fillBuffer(input) == 0) {
+            input->eof = 1;
+        }
+    }
+}
+
+size_t skipRuleLines(RuleInput *input, size_t count) {
+    size_t skipped = 0;
+
+    while (skipped < count) {
+        char *line = input->buffer + input->start;
+        char *newline = memchr(line, '\n', input->end - input->start);
+
+        if (newline != NULL) {
+            input->start += newline - line + 1;
+            if (input->skip_line) {
+                input->skip_line = 0;
+            } else {
+                skipped++;
+            }
+            continue;
+        }
+
+        if (input->eof) {
+            if (input->start < input->end && !input->skip_line) {
+                skipped++;
+            }
+            input->start = input->end;
+            return skipped;
+        }
+
+        // The partial line at the end of the buffer is skipped as a whole, its tail is dropped on arrival
+        if (input->start < input->end && !input->skip_line) {
+            skipped++;
+            input->skip_line = 1;
+        }
+        input->start = input->end = 0;
+        if (fillBuffer(input) == 0) {
+            input->eof = 1;
+        }
+    }
+    return skipped;
+}
+
+int ruleInputFailed(RuleInput *input) {
+    if (!input->compressed) {
+        return input->failed;
+    }
+    pthread_mutex_lock(&input->lock);
+    int failed = input->failed;
+    pthread_mutex_unlock(&input->lock);
+    return failed;
+}
+
+size_t getRuleInputSize(RuleInput *input) {
+    return input->file_size;
+}
+
+size_t getRuleInputPosition(RuleInput *input) {
+    return __sync_fetch_and_add(&input->raw_read, 0);
+}
+
+int isRuleInputCompressed(RuleInput *input) {
+    return input->compressed;
+}
+
+void closeRuleInput(RuleInput *input) {
+    if (input == NULL) return;
+
+    if (input->compressed) {
+        pthread_mutex_lock(&input->lock);
+        input->stop = 1;
+        pthread_cond_signal(&input->not_full);
+        pthread_mutex_unlock(&input->lock);
+        pthread_join(input->inflater, NULL);
+        freeInputQueue(input);
+    }
+
+    if (input->fd != STDIN_FILENO) {
+        close(input->fd);
+    }
+    free(input->buffer);
+    free(input);
+}
@@ -0,0 +1,34 @@
+#ifndef INPUT_STREAM_H
+#define INPUT_STREAM_H
+
+#include "types.h"
+
+#define INPUT_BUFFER_SIZE (4 * 1024 * 1024)
+#define INPUT_CHUNK_SIZE (1024 * 1024)
+#define INPUT_QUEUE_DEPTH 8
+
+typedef struct RuleInput RuleInput;
+
+// Open a rule source, "-" reads stdin, gzip data (detected by magic) is inflated on a separate thread
+// NULL when path cannot be opened or the stream cannot be set up
+RuleInput *openRuleInput(const char *path);
+void closeRuleInput(RuleInput *input);
+
+// Returns the next line without its line ending, or NULL at end of input
+// The line is writable and remains valid until the next call
+char *readRuleLine(RuleInput *input, size_t *length);
+
+// Moves past up to count lines without copying or terminating them, returns the number skipped
+// (fewer at the end of input). Used for sampling, the skipped bytes are only scanned for newlines
+size_t skipRuleLines(RuleInput *input, size_t count);
+
+// Nonzero once the input ended early: a read error, or gzip data that is corrupt or ends inside a member.
+// Everything read before the error was returned as usual, check this after the last line
+int ruleInputFailed(RuleInput *input);
+
+// Progress reporting, the size is 0 when it is unknown (pipes, stdin)
+size_t getRuleInputSize(RuleInput *input);
+size_t getRuleInputPosition(RuleInput *input);
+int isRuleInputCompressed(RuleInput *input);
+
+#endif
@@ -4,22 +4,158 @@
 #include <time.h>
 #include <math.h>
 #include <getopt.h>
-#include "processor.h"
+#include "rulechef.h"
 #include "types.h"
 #include "buffer.h"
-#include "rule_parser.h"
-#include "hash_tables.h"
-#include "analysis.h"
-#include <Judy.h>
+#include "hit_scorer.h"
+#include "server.h"
+#include "constraints.h"
 
-extern long unigram_count;
-extern long transition_count;
-extern long bigram_count;
-extern long trigram_count;
+// Long only options
+enum {
+    OPT_WORDLIST = 256,
+    OPT_CRACKED,
+    OPT_MIN_HITS,
+    OPT_MAX_MEMORY,
+    OPT_SAMPLE,
+    OPT_SEED,
+    OPT_SAMPLE_DEDUP,
+    OPT_BEAM,
+    OPT_SCORE,
+    OPT_SCORE_SORT,
+    OPT_SORT_MEMORY,
+    OPT_SORT_COUNT,
+    OPT_HUGE_PAGES,
+    OPT_MIN_COUNT,
+    OPT_MAX_BRANCH,
+    OPT_RENORMALIZE,
+    OPT_SAMPLE_RATE,
+    OPT_SAMPLE_LINES,
+    OPT_EVAL,
+    OPT_EVAL_SPLIT,
+    OPT_DENY_OPS,
+    OPT_ALLOW_OPS,
+    OPT_PREFIX,
+    OPT_SUFFIX,
+    OPT_MAX_BYTES,
+    OPT_TRIE,
+    OPT_SAVE_MODEL,
+    OPT_PREV_MODEL,
+    OPT_TIERS,
+    OPT_TIER_PREFIX,
+    OPT_EXPORT,
+    OPT_EXPORT_FORMAT
+};
+
+// Parses sizes such as 512M, 2G or 1024K, a plain number is taken as MB
+static size_t parseMemorySize(const char *arg) {
+    char *end;
+    double value = strtod(arg, &end);
+    if (value <= 0) {
+        return 0;
+    }
+    switch (*end) {
+        case 'k': case 'K': return (size_t)(value * 1024);
+        case 'g': case 'G': return (size_t)(value * 1024 * 1024 * 1024);
+        case 't': case 'T': return (size_t)(value * 1024 * 1024 * 1024 * 1024);
+        default: return (size_t)(value * 1024 * 1024);
+    }
+}
+
+static int compareThresholdsDescending(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da < db) - (da > db);
+}
+
+// Parses "1e-3,1e-4,1e-5" into descending thresholds, returns the count or 0 when the list is invalid
+static int parseTiers(const char *arg, double **thresholds) {
+    int count = 1;
+    for (const char *c = arg; *c != '\0'; c++) {
+        count += *c == ',';
+    }
+    *thresholds = malloc(count * sizeof(double));
+    if (*thresholds == NULL) {
+        return 0;
+    }
+
+    const char *start = arg;
+    for (int t = 0; t < count; t++) {
+        char *end;
+        (*thresholds)[t] = strtod(start, &end);
+        if (end == start || (*end != ',' && *end != '\0') || (*thresholds)[t] <= 0.0 || (*thresholds)[t] > 1.0) {
+            return 0;
+        }
+        start = end + 1;
+    }
+    qsort(*thresholds, count, sizeof(double), compareThresholdsDescending);
+    for (int t = 1; t < count; t++) {
+        if ((*thresholds)[t] == (*thresholds)[t - 1]) {
+            return 0;
+        }
+    }
+    return count;
+}
+
+// Sink for a tier file
+static void writeTierFile(void *file, const char *data, size_t len) {
+    fwrite(data, 1, len, (FILE *)file);
+}
+
+// Opens PREFIX1.rule, PREFIX2.rule... and fills them with one tiered pass
+static int runTiers(RuleChef *chef, const RuleChefParams *params, const double *thresholds, int count,
+                    const char *prefix, int verbose) {
+    FILE **files = calloc(count, sizeof(FILE *));
+    RuleChefSink *sinks = malloc(count * sizeof(RuleChefSink));
+    long *written = calloc(count, sizeof(long));
+    char **paths = calloc(count, sizeof(char *));
+    int ok = files != NULL && sinks != NULL && written != NULL && paths != NULL;
+
+    for (int t = 0; ok && t < count; t++) {
+        size_t length = strlen(prefix) + 32;
+        paths[t] = malloc(length);
+        if (paths[t] == NULL) {
+            ok = 0;
+            break;
+        }
+        snprintf(paths[t], length, "%s%d.rule", prefix, t + 1);
+        files[t] = fopen(paths[t], "w");
+        if (files[t] == NULL) {
+            fprintf(stderr, "Error creating tier file: %s\n", paths[t]);
+            ok = 0;
+        }
+        sinks[t] = writeTierFile;
+    }
+
+    if (ok && rulechef_generate_tiers(chef, params, count, thresholds, sinks, (void **)files, written) < 0) {
+        ok = 0;
+    }
+    for (int t = 0; files != NULL && t < count; t++) {
+        if (files[t] != NULL && fclose(files[t]) != 0) {
+            fprintf(stderr, "Error writing tier file: %s\n", paths[t]);
+            ok = 0;
+        }
+        if (ok && verbose) {
+            fprintf(stderr, "Tier %d (probability >= %g): %ld rules in %s\n", t + 1, thresholds[t], written[t], paths[t]);
+        }
+    }
+
+    for (int t = 0; paths != NULL && t < count; t++) {
+        free(paths[t]);
+    }
+    free(paths);
+    free(files);
+    free(sinks);
+    free(written);
+    return ok;
+}
 
 void show_help(const char *program_name) {
     fprintf(stderr, "%s by CynosurePrime (CsP)\n\n", program_name);
     fprintf(stderr, "Usage: %s <rulefile1> [rulefile2] [options]\n", program_name);
+    fprintf(stderr, "       %s serve <socket> [--max-memory SIZE] [-v]\n", program_name);
+    fprintf(stderr, "       %s expand <triefile>\n", program_name);
+    fprintf(stderr, "Use - to read rules from stdin, gzip compressed rulefiles are decompressed transparently\n");
     fprintf(stderr, "Analyses rules and cooks up all possible combinations using markov chains\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "\t-m N, --min-length N       Minimum rule length (operations) (default: 1)\n");
@@ -27,17 +163,72 @@ void show_help(const char *program_name) {
     fprintf(stderr, "\t-l N, --limit N            Limit starting chain to TopN (can be used with -p)\n");
     fprintf(stderr, "\t                           If N is less than 1 and greater than 0, then TopN percent\n");
     fprintf(stderr, "\t-p X, --probability X      Minimum probability threshold (0.0-1.0) (default: 0.0)\n");
+    fprintf(stderr, "\t-j, --joint                Include the starter probability in the chain probability\n");
+    fprintf(stderr, "\t-w, --weighted             Input lines are \"count<TAB>rule\" with a multiplicity\n");
+    fprintf(stderr, "\t-s, --simplify             Skip redundant chains (eg. 'lu', 'tt', '^1$2', ':')\n");
+    fprintf(stderr, "\t--beam W                   Keep only the W most probable chains at each length\n");
+    fprintf(stderr, "\t--min-count C              Drop transitions seen fewer than C times before computing probabilities\n");
+    fprintf(stderr, "\t--max-branch K             Keep only the K most probable transitions out of each operation\n");
+    fprintf(stderr, "\t--renormalize              Rescale the transitions kept by --max-branch to sum to 1\n");
+    fprintf(stderr, "\t--deny-ops OPS             Never use operations whose base op is one of OPS (eg. 'M46X')\n");
+    fprintf(stderr, "\t--allow-ops OPS            Only use operations whose base op is one of OPS\n");
+    fprintf(stderr, "\t--prefix RULE              Only generate rules that start with the operations of RULE\n");
+    fprintf(stderr, "\t--suffix RULE              Only generate rules that end with the operations of RULE\n");
+    fprintf(stderr, "\t--max-bytes N              Only generate rules of at most N bytes\n");
+    fprintf(stderr, "\t--trie                     Write rules as a compact binary prefix trie, read it back with expand\n");
     fprintf(stderr, "\t-v, --verbose              Verbose mode (show analysis and statistics)\n");
+    fprintf(stderr, "\t--max-memory SIZE          Bound bigram counting memory (eg. 512M, 4G), long tail counts become approximate\n");
+    fprintf(stderr, "\t--sort-count               Count bigrams by sorting batches, faster with hundreds of millions of distinct bigrams\n");
+    fprintf(stderr, "\t--huge-pages               Back the model with huge pages to reduce TLB misses on large models\n");
+    fprintf(stderr, "\t--sample-rate R            Build the model from a random fraction R (0-1) of the input lines\n");
+    fprintf(stderr, "\t--sample-lines N           Build the model from a uniform random sample of N input lines\n");
+    fprintf(stderr, "\t-t N, --threads N          Worker threads for scoring and sampling (default: all cores)\n");
     fprintf(stderr, "\t-h, --help                 Show this help message\n\n");
+    fprintf(stderr, "Sampling:\n");
+    fprintf(stderr, "\t--sample N                 Draw N random rules from the model instead of enumerating (-p is ignored)\n");
+    fprintf(stderr, "\t--seed S                   Seed for --sample and input sampling, the same seed gives the same rules (default: time)\n");
+    fprintf(stderr, "\t--sample-dedup SIZE        Drop repeated samples with a bloom filter of SIZE (eg. 256M)\n\n");
+    fprintf(stderr, "Scoring:\n");
+    fprintf(stderr, "\t--score FILE               Write \"probability<TAB>rule\" for each rule of FILE instead of generating\n");
+    fprintf(stderr, "\t--score-sort               Sort the scored rules by descending probability\n");
+    fprintf(stderr, "\t--sort-memory SIZE         Memory for --score-sort before spilling sorted runs to disk (default: 512M)\n\n");
+    fprintf(stderr, "Evaluation:\n");
+    fprintf(stderr, "\t--eval FILE                Report coverage of the held-out rules in FILE against rules generated, instead of the rules\n");
+    fprintf(stderr, "\t--eval-split R             Hold out a random fraction R of the input rules and evaluate against them (seeded by --seed)\n\n");
+    fprintf(stderr, "Export:\n");
+    fprintf(stderr, "\t--export FILE              Analyse only and write the starter, unigram and bigram tables to FILE (- for stdout)\n");
+    fprintf(stderr, "\t--export-format FMT        tsv or bin (default: tsv)\n\n");
+    fprintf(stderr, "Tiers:\n");
+    fprintf(stderr, "\t--tiers LIST               Write rules to one file per probability tier in a single pass (eg. 1e-3,1e-4,1e-5)\n");
+    fprintf(stderr, "\t--tier-prefix PREFIX       Tier files are PREFIX1.rule, PREFIX2.rule... (default: tier)\n\n");
+    fprintf(stderr, "Model updates:\n");
+    fprintf(stderr, "\t--save-model FILE          Save the analysed counts to FILE for a later --prev-model\n");
+    fprintf(stderr, "\t--prev-model FILE          Only write rules that pass -p now but did not under the model saved in FILE\n\n");
+    fprintf(stderr, "Hit ranking:\n");
+    fprintf(stderr, "\t--wordlist FILE            Base wordlist the generated rules are applied to\n");
+    fprintf(stderr, "\t--cracked FILE             Known plaintexts, rules are emitted sorted by hits against them\n");
+    fprintf(stderr, "\t--min-hits N               Only emit rules with at least N hits (default: 0)\n\n");
+    fprintf(stderr, "Server mode:\n");
+    fprintf(stderr, "\tKeeps analysed models in memory and serves requests on a Unix domain socket\n");
+    fprintf(stderr, "\tRequest \"GENERATE [-m N] [-M N] [-p X] [-l N] [-s] [-j] [-w] rulefile...\" or \"MODELS\"\n");
+    fprintf(stderr, "\tThe reply is \"OK\" followed by the rules, or \"ERROR <reason>\"\n\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "\t%s rules.txt --max-length 4\n", program_name);
     fprintf(stderr, "\t%s rules.txt -m 2 -M 5 -p 0.01\n", program_name);
     fprintf(stderr, "\t%s rules.txt -M 3 -p 0.5 -v\n", program_name);
     fprintf(stderr, "\t%s rules.txt -M 5 -l 200 -v\n", program_name);
+    fprintf(stderr, "\t%s rules.txt -m 4 -M 12 --sample 1000000 --seed 42\n", program_name);
+    fprintf(stderr, "\t%s rules.txt --score candidates.txt --score-sort\n", program_name);
+    fprintf(stderr, "\t%s rules.txt -M 4 -p 0.0001 --eval-split 0.1 --seed 1\n", program_name);
+    fprintf(stderr, "\t%s rules.txt --export stats.tsv\n", program_name);
+    fprintf(stderr, "\t%s rules.txt -M 5 --tiers 1e-3,1e-4,1e-5 --tier-prefix tier\n", program_name);
+    fprintf(stderr, "\t%s rules.txt new.txt -M 4 -p 0.00001 --prev-model old.model --save-model new.model\n", program_name);
+    fprintf(stderr, "\t%s rules.txt -M 3 --wordlist base.txt --cracked found.txt --min-hits 10\n", program_name);
+    fprintf(stderr, "\t%s rules.txt -M 5 -p 0.00001 --trie > rules.trie\n", program_name);
+    fprintf(stderr, "\t%s expand rules.trie\n", program_name);
+    fprintf(stderr, "\t%s serve /tmp/rulechef.sock -v\n", program_name);
 }
 
-// Global buffer for output
-WBuffer output_buffer;
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         show_help(argv[0]);
@@ -50,6 +241,44 @@ int main(int argc, char *argv[]) {
     double min_probability = 0.0;
     int verbose = 0;
     double limit_unigrams = 0;
+    int simplify = 0;
+    int weighted = 0;
+    int joint = 0;
+    int threads = 0;
+    const char *wordlist = NULL;
+    const char *cracked = NULL;
+    long min_hits = 0;
+    size_t max_memory = 0;
+    int sort_count = 0;
+    int huge_pages = 0;
+    long min_count = 0;
+    int max_branch = 0;
+    int renormalize = 0;
+    RuleChefSampleParams sample = {0, 0, 0, 0};
+    int seeded = 0;
+    double sample_rate = 0.0;
+    long sample_lines = 0;
+    char *eval_file = NULL;
+    char *deny_ops = NULL;
+    char *allow_ops = NULL;
+    char *prefix = NULL;
+    char *suffix = NULL;
+    int max_bytes = 0;
+    double eval_split = 0.0;
+    long beam_width = 0;
+    const char *score_file = NULL;
+    int score_sort = 0;
+    size_t sort_memory = 0;
+    int trie = 0;
+    const char *save_model = NULL;
+    const char *prev_model = NULL;
+    double *tiers = NULL;
+    int tier_count = 0;
+    const char *tier_prefix = NULL;
+    const char *export_file = NULL;
+    int export_format = -1;
+    int serve = strcmp(argv[1], "serve") == 0;
+    int expand = strcmp(argv[1], "expand") == 0;
 
 
     int c;
@@ -61,13 +290,49 @@ int main(int argc, char *argv[]) {
             {"max-length", required_argument, 0, 'M'},
             {"limit", required_argument, 0, 'l'},
             {"probability", required_argument, 0, 'p'},
+            {"simplify", no_argument, 0, 's'},
+            {"weighted", no_argument, 0, 'w'},
+            {"joint", no_argument, 0, 'j'},
             {"verbose", no_argument, 0, 'v'},
+            {"threads", required_argument, 0, 't'},
+            {"wordlist", required_argument, 0, OPT_WORDLIST},
+            {"cracked", required_argument, 0, OPT_CRACKED},
+            {"min-hits", required_argument, 0, OPT_MIN_HITS},
+            {"max-memory", required_argument, 0, OPT_MAX_MEMORY},
+            {"sort-count", no_argument, 0, OPT_SORT_COUNT},
+            {"huge-pages", no_argument, 0, OPT_HUGE_PAGES},
+            {"min-count", required_argument, 0, OPT_MIN_COUNT},
+            {"max-branch", required_argument, 0, OPT_MAX_BRANCH},
+            {"renormalize", no_argument, 0, OPT_RENORMALIZE},
+            {"sample-rate", required_argument, 0, OPT_SAMPLE_RATE},
+            {"sample-lines", required_argument, 0, OPT_SAMPLE_LINES},
+            {"eval", required_argument, 0, OPT_EVAL},
+            {"deny-ops", required_argument, 0, OPT_DENY_OPS},
+            {"allow-ops", required_argument, 0, OPT_ALLOW_OPS},
+            {"prefix", required_argument, 0, OPT_PREFIX},
+            {"suffix", required_argument, 0, OPT_SUFFIX},
+            {"max-bytes", required_argument, 0, OPT_MAX_BYTES},
+            {"trie", no_argument, 0, OPT_TRIE},
+            {"save-model", required_argument, 0, OPT_SAVE_MODEL},
+            {"prev-model", required_argument, 0, OPT_PREV_MODEL},
+            {"tiers", required_argument, 0, OPT_TIERS},
+            {"tier-prefix", required_argument, 0, OPT_TIER_PREFIX},
+            {"export", required_argument, 0, OPT_EXPORT},
+            {"export-format", required_argument, 0, OPT_EXPORT_FORMAT},
+            {"eval-split", required_argument, 0, OPT_EVAL_SPLIT},
+            {"sample", required_argument, 0, OPT_SAMPLE},
+            {"seed", required_argument, 0, OPT_SEED},
+            {"sample-dedup", required_argument, 0, OPT_SAMPLE_DEDUP},
+            {"beam", required_argument, 0, OPT_BEAM},
+            {"score", required_argument, 0, OPT_SCORE},
+            {"score-sort", no_argument, 0, OPT_SCORE_SORT},
+            {"sort-memory", required_argument, 0, OPT_SORT_MEMORY},
             {"help", no_argument, 0, 'h'},
             {0, 0, 0, 0}
         };
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "m:M:l:p:vh", long_options, &option_index);
+        c = getopt_long(argc, argv, "m:M:l:p:swjvt:h", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -110,9 +375,183 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             break;
+        case 's':
+            simplify = 1;
+            break;
+        case 'w':
+            weighted = 1;
+            break;
+        case 'j':
+            joint = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0 || threads > 1024) {
+                fprintf(stderr, "Threads must be between 1 and 1024\n");
+                return 1;
+            }
+            break;
+        case OPT_WORDLIST:
+            wordlist = optarg;
+            break;
+        case OPT_CRACKED:
+            cracked = optarg;
+            break;
+        case OPT_MAX_MEMORY:
+            max_memory = parseMemorySize(optarg);
+            if (max_memory < 1024 * 1024) {
+                fprintf(stderr, "Max memory must be at least 1M\n");
+                return 1;
+            }
+            break;
+        case OPT_SORT_COUNT:
+            sort_count = 1;
+            break;
+        case OPT_HUGE_PAGES:
+            huge_pages = 1;
+            break;
+        case OPT_MIN_COUNT:
+            min_count = atol(optarg);
+            if (min_count < 1) {
+                fprintf(stderr, "Min count must be at least 1\n");
+                return 1;
+            }
+            break;
+        case OPT_MAX_BRANCH:
+            max_branch = atoi(optarg);
+            if (max_branch < 1) {
+                fprintf(stderr, "Max branch must be at least 1\n");
+                return 1;
+            }
+            break;
+        case OPT_RENORMALIZE:
+            renormalize = 1;
+            break;
+        case OPT_SAMPLE_RATE:
+            sample_rate = atof(optarg);
+            if (sample_rate <= 0.0 || sample_rate > 1.0) {
+                fprintf(stderr, "Sample rate must be greater than 0 and at most 1\n");
+                return 1;
+            }
+            break;
+        case OPT_EVAL:
+            eval_file = optarg;
+            break;
+        case OPT_DENY_OPS:
+            deny_ops = optarg;
+            break;
+        case OPT_ALLOW_OPS:
+            allow_ops = optarg;
+            break;
+        case OPT_PREFIX:
+            prefix = optarg;
+            break;
+        case OPT_SUFFIX:
+            suffix = optarg;
+            break;
+        case OPT_MAX_BYTES:
+            max_bytes = atoi(optarg);
+            if (max_bytes <= 0) {
+                fprintf(stderr, "Max bytes must be a positive number\n");
+                return 1;
+            }
+            break;
+        case OPT_EVAL_SPLIT:
+            eval_split = atof(optarg);
+            if (eval_split <= 0.0 || eval_split >= 1.0) {
+                fprintf(stderr, "Eval split must be between 0 and 1\n");
+                return 1;
+            }
+            break;
+        case OPT_SAMPLE_LINES:
+            sample_lines = atol(optarg);
+            if (sample_lines <= 0) {
+                fprintf(stderr, "Sample lines must be a positive number\n");
+                return 1;
+            }
+            break;
+        case OPT_SAMPLE:
+            sample.count = atol(optarg);
+            if (sample.count <= 0) {
+                fprintf(stderr, "Sample count must be greater than 0\n");
+                return 1;
+            }
+            break;
+        case OPT_SEED:
+            sample.seed = strtoull(optarg, NULL, 10);
+            seeded = 1;
+            break;
+        case OPT_SAMPLE_DEDUP:
+            sample.dedup_bytes = parseMemorySize(optarg);
+            if (sample.dedup_bytes < 1024) {
+                fprintf(stderr, "Sample dedup size must be at least 1K\n");
+                return 1;
+            }
+            break;
+        case OPT_TRIE:
+            trie = 1;
+            break;
+        case OPT_SAVE_MODEL:
+            save_model = optarg;
+            break;
+        case OPT_PREV_MODEL:
+            prev_model = optarg;
+            break;
+        case OPT_TIERS:
+            free(tiers);
+            tier_count = parseTiers(optarg, &tiers);
+            if (tier_count == 0) {
+                fprintf(stderr, "Tiers must be distinct probabilities between 0.0 and 1.0, separated by commas\n");
+                free(tiers);
+                return 1;
+            }
+            break;
+        case OPT_TIER_PREFIX:
+            tier_prefix = optarg;
+            break;
+        case OPT_EXPORT:
+            export_file = optarg;
+            break;
+        case OPT_EXPORT_FORMAT:
+            if (strcmp(optarg, "tsv") == 0) {
+                export_format = RULECHEF_EXPORT_TSV;
+            } else if (strcmp(optarg, "bin") == 0) {
+                export_format = RULECHEF_EXPORT_BIN;
+            } else {
+                fprintf(stderr, "Export format must be tsv or bin\n");
+                return 1;
+            }
+            break;
+        case OPT_BEAM:
+            beam_width = atol(optarg);
+            if (beam_width <= 0) {
+                fprintf(stderr, "Beam width must be greater than 0\n");
+                return 1;
+            }
+            break;
+        case OPT_SCORE:
+            score_file = optarg;
+            break;
+        case OPT_SCORE_SORT:
+            score_sort = 1;
+            break;
+        case OPT_SORT_MEMORY:
+            sort_memory = parseMemorySize(optarg);
+            if (sort_memory < 1024 * 1024) {
+                fprintf(stderr, "Sort memory must be at least 1M\n");
+                return 1;
+            }
+            break;
+        case OPT_MIN_HITS:
+            min_hits = atol(optarg);
+            if (min_hits < 0) {
+                fprintf(stderr, "Min hits cannot be negative\n");
+                return 1;
+            }
+            break;
         case 'h':
             show_help(argv[0]);
             return 1;
@@ -126,31 +565,243 @@ int main(int argc, char *argv[]) {
     }
 
 
+    if (serve) {
+        // argv[optind] is "serve" itself
+        if (optind + 2 != argc) {
+            fprintf(stderr, "Error: serve takes exactly one socket path\n");
+            return 1;
+        }
+        return runRuleServer(argv[optind + 1], max_memory, verbose);
+    }
+
+    if (expand) {
+        // argv[optind] is "expand" itself
+        if (optind + 2 != argc) {
+            fprintf(stderr, "Error: expand takes exactly one trie file\n");
+            return 1;
+        }
+        return rulechef_expand(argv[optind + 1], NULL, NULL) < 0 ? 1 : 0;
+    }
+
     if (optind >= argc) {
         fprintf(stderr, "Error: No rulefile specified\n");
         return 1;
     }
 
+    if ((wordlist == NULL) != (cracked == NULL)) {
+        fprintf(stderr, "Error: --wordlist and --cracked must be used together\n");
+        return 1;
+    }
+
     if (min_length > max_length) {
         fprintf(stderr, "Error: Min length (%d) cannot be greater than max length (%d)\n",
                 min_length, max_length);
         return 1;
     }
 
+    if (sample_rate > 0.0 && sample_lines > 0) {
+        fprintf(stderr, "Error: --sample-rate and --sample-lines cannot be used together\n");
+        return 1;
+    }
+
+    if (seeded && sample.count == 0 && sample_rate == 0.0 && sample_lines == 0 && eval_split == 0.0) {
+        fprintf(stderr, "Error: --seed requires --sample, --sample-rate, --sample-lines or --eval-split\n");
+        return 1;
+    }
+    if (!seeded) {
+        sample.seed = (unsigned long long)time(NULL);
+    }
+
+    if (sample.count > 0) {
+        sample.threads = threads;
+    } else if (sample.dedup_bytes > 0) {
+        fprintf(stderr, "Error: --sample-dedup requires --sample\n");
+        return 1;
+    }
+
+    if (beam_width > 0 && sample.count > 0) {
+        fprintf(stderr, "Error: --beam and --sample cannot be used together\n");
+        return 1;
+    }
+
+    if (renormalize && max_branch == 0) {
+        fprintf(stderr, "Error: --renormalize requires --max-branch\n");
+        return 1;
+    }
+
+    if (sort_count && max_memory > 0) {
+        fprintf(stderr, "Error: --sort-count and --max-memory cannot be used together\n");
+        return 1;
+    }
+
+    if (score_file != NULL && (sample.count > 0 || beam_width > 0 || wordlist != NULL)) {
+        fprintf(stderr, "Error: --score cannot be used with --sample, --beam or --wordlist\n");
+        return 1;
+    }
+    if (eval_file != NULL && eval_split > 0.0) {
+        fprintf(stderr, "Error: --eval and --eval-split cannot be used together\n");
+        return 1;
+    }
+    if ((eval_file != NULL || eval_split > 0.0) && (score_file != NULL || wordlist != NULL)) {
+        fprintf(stderr, "Error: --eval and --eval-split cannot be used with --score or --wordlist\n");
+        return 1;
+    }
+    if (trie && (score_file != NULL || wordlist != NULL || eval_file != NULL || eval_split > 0.0)) {
+        fprintf(stderr, "Error: --trie cannot be used with --score, --wordlist, --eval or --eval-split\n");
+        return 1;
+    }
+    if (prev_model != NULL && (sample.count > 0 || beam_width > 0 || score_file != NULL || wordlist != NULL ||
+                               eval_file != NULL || eval_split > 0.0)) {
+        fprintf(stderr, "Error: --prev-model cannot be used with --sample, --beam, --score, --wordlist or --eval\n");
+        return 1;
+    }
+    if (tier_count > 0 && (min_probability > 0.0 || sample.count > 0 || beam_width > 0 || score_file != NULL ||
+                           wordlist != NULL || eval_file != NULL || eval_split > 0.0 || prev_model != NULL || trie)) {
+        fprintf(stderr, "Error: --tiers cannot be used with -p, --sample, --beam, --score, --wordlist, --eval, --prev-model or --trie\n");
+        return 1;
+    }
+    if (export_file != NULL && (sample.count > 0 || beam_width > 0 || score_file != NULL || wordlist != NULL ||
+                                eval_file != NULL || eval_split > 0.0 || prev_model != NULL || tier_count > 0 || trie)) {
+        fprintf(stderr, "Error: --export only analyses, it cannot be used with generation, scoring or evaluation options\n");
+        return 1;
+    }
+    if (export_format >= 0 && export_file == NULL) {
+        fprintf(stderr, "Error: --export-format requires --export\n");
+        return 1;
+    }
+    if (tier_prefix != NULL && tier_count == 0) {
+        fprintf(stderr, "Error: --tier-prefix requires --tiers\n");
+        return 1;
+    }
+    if (score_file == NULL && (score_sort || sort_memory > 0)) {
+        fprintf(stderr, "Error: --score-sort and --sort-memory require --score\n");
+        return 1;
+    }
+
     if (verbose) {
-        printf("Configuration:\n");
-        printf("  Min length: %d\n", min_length);
-        printf("  Max length: %d\n", max_length);
-        printf("  Min probability: %.3f\n", min_probability);
-        printf("  Limit unigrams: %.2f\n", limit_unigrams);
-        printf("  Verbose: %s\n", verbose ? "enabled" : "disabled");
-        printf("\n");
+        fprintf(stderr, "Configuration:\n");
+        fprintf(stderr, "  Min length: %d\n", min_length);
+        fprintf(stderr, "  Max length: %d\n", max_length);
+        fprintf(stderr, "  Min probability: %.3f\n", min_probability);
+        fprintf(stderr, "  Limit unigrams: %.2f\n", limit_unigrams);
+        fprintf(stderr, "  Simplify: %s\n", simplify ? "enabled" : "disabled");
+        fprintf(stderr, "  Weighted input: %s\n", weighted ? "enabled" : "disabled");
+        fprintf(stderr, "  Joint probability: %s\n", joint ? "enabled" : "disabled");
+        fprintf(stderr, "  Bigram counting: %s\n", sort_count ? "sorted batches" : "hash table");
+        fprintf(stderr, "  Huge pages: %s\n", huge_pages ? "enabled" : "disabled");
+        if (min_count > 0 || max_branch > 0) {
+            fprintf(stderr, "  Transition pruning: min count %ld, max branch %d%s\n",
+                    min_count, max_branch, renormalize ? ", renormalized" : "");
+        }
+        if (deny_ops != NULL || allow_ops != NULL) {
+            fprintf(stderr, "  Operations: allow %s, deny %s\n",
+                    allow_ops ? allow_ops : "all", deny_ops ? deny_ops : "none");
+        }
+        if (prefix != NULL || suffix != NULL) {
+            fprintf(stderr, "  Prefix: %s, suffix: %s\n", prefix ? prefix : "any", suffix ? suffix : "any");
+        }
+        if (max_bytes > 0) {
+            fprintf(stderr, "  Max rule bytes: %d\n", max_bytes);
+        }
+        if (sample_rate > 0.0) {
+            fprintf(stderr, "  Input sampling: %.4f%% of lines\n", sample_rate * 100.0);
+        } else if (sample_lines > 0) {
+            fprintf(stderr, "  Input sampling: %ld lines\n", sample_lines);
+        }
+        if (sample.count > 0) {
+            fprintf(stderr, "  Sample: %ld rules\n", sample.count);
+        }
+        if (beam_width > 0) {
+            fprintf(stderr, "  Beam width: %ld\n", beam_width);
+        }
+        if (score_file != NULL) {
+            fprintf(stderr, "  Score: %s%s\n", score_file, score_sort ? " (sorted)" : "");
+        }
+        if (eval_file != NULL) {
+            fprintf(stderr, "  Evaluate against: %s\n", eval_file);
+        } else if (eval_split > 0.0) {
+            fprintf(stderr, "  Evaluate against: %.2f%% of the input held out\n", eval_split * 100.0);
+        }
+        if (trie) {
+            fprintf(stderr, "  Output: prefix trie\n");
+        }
+        if (tier_count > 0) {
+            fprintf(stderr, "  Tiers:");
+            for (int t = 0; t < tier_count; t++) {
+                fprintf(stderr, " %g", tiers[t]);
+            }
+            fprintf(stderr, " (%s1.rule...)\n", tier_prefix ? tier_prefix : "tier");
+        }
+        if (export_file != NULL) {
+            fprintf(stderr, "  Export: %s (%s)\n",
+                    export_file, export_format == RULECHEF_EXPORT_BIN ? "bin" : "tsv");
+        }
+        if (save_model != NULL) {
+            fprintf(stderr, "  Save model: %s\n", save_model);
+        }
+        if (prev_model != NULL) {
+            fprintf(stderr, "  Delta against: %s\n", prev_model);
+        }
+        fprintf(stderr, "  Verbose: %s\n", verbose ? "enabled" : "disabled");
+        fprintf(stderr, "\n");
     }
 
     // Initialize
-    init_buffer(&output_buffer);
-    initRuleMaps();
-    initHashTables();
+    RuleChef *chef = rulechef_create();
+    if (chef == NULL) {
+        return 1;
+    }
+    if ((max_memory > 0 && !rulechef_set_max_memory(chef, max_memory)) ||
+        (sort_count && !rulechef_set_sort_counting(chef, 1))) {
+        rulechef_destroy(chef);
+        return 1;
+    }
+    if (huge_pages) {
+        rulechef_set_huge_pages(chef, 1);
+    }
+    if (min_count > 0 || max_branch > 0) {
+        rulechef_set_pruning(chef, min_count, max_branch, renormalize);
+    }
+    if (sample_rate > 0.0 || sample_lines > 0) {
+        rulechef_set_input_sampling(chef, sample_rate, sample_lines, sample.seed);
+    }
+
+    RuleChefEval *eval = NULL;
+    if (eval_file != NULL || eval_split > 0.0) {
+        eval = rulechef_eval_create();
+        if (eval == NULL || (eval_file != NULL && !rulechef_eval_add_file(eval, eval_file, weighted, verbose))) {
+            rulechef_eval_destroy(eval);
+            rulechef_destroy(chef);
+            return 1;
+        }
+        if (eval_split > 0.0) {
+            rulechef_set_holdout(chef, eval, eval_split, sample.seed);
+        }
+    }
+
+    RuleChefParams params;
+    rulechef_default_params(&params);
+    params.min_length = min_length;
+    params.max_length = max_length;
+    params.min_probability = min_probability;
+    params.limit_unigrams = limit_unigrams;
+    params.simplify = simplify;
+    params.joint = joint;
+    params.verbose = verbose;
+    params.deny_ops = deny_ops;
+    params.allow_ops = allow_ops;
+    params.prefix = prefix;
+    params.suffix = suffix;
+    params.max_bytes = max_bytes;
+    RuleChefStats stats;
+
+    // Reject a bad prefix or suffix before spending time on analysis
+    RuleConstraints constraints;
+    if (!compileConstraints(&params, &constraints)) {
+        rulechef_eval_destroy(eval);
+        rulechef_destroy(chef);
+        return 1;
+    }
 
 
     if (verbose) {
@@ -172,34 +823,143 @@ int main(int argc, char *argv[]) {
                     file_idx - optind + 1, argc - optind, rulefile);
         }
 
-        FILE *file = fopen(rulefile, "r");
-        if (!file) {
-            fprintf(stderr, "Error opening file: %s\n", rulefile);
+        int analysed = rulechef_analyse_file(chef, rulefile, weighted, verbose);
+        if (analysed < 0) {
+            rulechef_destroy(chef);
+            return 1;
+        }
+        if (analysed == 0) {
             continue;
         }
 
-        analyseRuleStream(file, verbose);
-        fclose(file);
-
         if (verbose) {
+            rulechef_get_stats(chef, &stats);
             fprintf(stderr, "Completed analysis of: %s\n", rulefile);
-            fprintf(stderr, "Current totals: %ld unigrams, %ld bigrams, %ld trigrams, %ld transitions\n",
-                    unigram_count, bigram_count, trigram_count, transition_count);
+            fprintf(stderr, "Current totals: %ld unigrams, %ld bigrams, %ld trigrams\n",
+                    stats.unigrams, stats.bigrams, stats.trigrams);
         }
     }
 
     if (verbose) {
         fprintf(stderr, "\n=== Final Statistics (all files combined) ===\n");
-        printAllNGramHashTableStats();
-        printTopNGramsFromHashTable();
+        rulechef_print_stats(chef);
     }
-    if (unigram_count == 0) {
+    rulechef_get_stats(chef, &stats);
+    if (stats.unigrams == 0) {
         fprintf(stderr, "No valid rules found!\n");
+        rulechef_eval_destroy(eval);
+        rulechef_destroy(chef);
+        return 1;
+    }
+
+    if (save_model != NULL && !rulechef_save_model(chef, save_model, verbose)) {
+        rulechef_eval_destroy(eval);
+        rulechef_destroy(chef);
+        return 1;
+    }
+
+    if (export_file != NULL) {
+        int exported = rulechef_export(chef, export_file,
+                                       export_format >= 0 ? export_format : RULECHEF_EXPORT_TSV, threads, verbose);
+        rulechef_destroy(chef);
+        return exported ? 0 : 1;
+    }
+
+    // The previous model is rebuilt from its counts with the same pruning, so unchanged rows score the same
+    RuleChef *previous = NULL;
+    if (prev_model != NULL) {
+        previous = rulechef_create();
+        if (previous == NULL) {
+            rulechef_destroy(chef);
+            return 1;
+        }
+        if (min_count > 0 || max_branch > 0) {
+            rulechef_set_pruning(previous, min_count, max_branch, renormalize);
+        }
+        if (!rulechef_load_model(previous, prev_model, verbose)) {
+            rulechef_destroy(previous);
+            rulechef_destroy(chef);
+            return 1;
+        }
+    }
+
+    if (eval != NULL) {
+        // Generated rules are only matched against the held-out set, the report replaces them
+        if (sample.count > 0) {
+            rulechef_sample(chef, &params, &sample, rulechef_eval_sink, eval);
+        } else if (beam_width > 0) {
+            rulechef_beam(chef, &params, beam_width, rulechef_eval_sink, eval);
+        } else {
+            rulechef_generate(chef, &params, rulechef_eval_sink, eval);
+        }
+        rulechef_eval_report(chef, eval, NULL, NULL);
+        rulechef_eval_destroy(eval);
+        rulechef_destroy(chef);
+        return 0;
+    }
+
+    if (score_file != NULL) {
+        long scored = rulechef_score_file(chef, score_file, score_sort, threads, sort_memory, verbose, NULL, NULL);
+        rulechef_destroy(chef);
+        return scored < 0 ? 1 : 0;
+    }
+
+    if (wordlist != NULL) {
+        // Collect the generated rules instead of writing them, then emit them ranked by hits
+        LineList generated = {0};
+        if (sample.count > 0) {
+            rulechef_sample(chef, &params, &sample, collectRulesSink, &generated);
+        } else if (beam_width > 0) {
+            rulechef_beam(chef, &params, beam_width, collectRulesSink, &generated);
+        } else {
+            rulechef_generate(chef, &params, collectRulesSink, &generated);
+        }
+        int collected = splitLineList(&generated);
+        rulechef_destroy(chef);
+        if (!collected) {
+            freeLineList(&generated);
+            return 1;
+        }
+
+        WBuffer output_buffer;
+        if (!init_buffer(&output_buffer)) {
+            freeLineList(&generated);
+            return 1;
+        }
+        int scored = scoreRulesByHits(&generated, wordlist, cracked, min_hits, threads, verbose, &output_buffer);
         free_buffer(&output_buffer);
+        freeLineList(&generated);
+        return scored ? 0 : 1;
+    }
+
+    if (tier_count > 0) {
+        int ok = runTiers(chef, &params, tiers, tier_count, tier_prefix ? tier_prefix : "tier", verbose);
+        free(tiers);
+        rulechef_destroy(chef);
+        return ok ? 0 : 1;
+    }
+
+    // The trie writer re-encodes the generated rules on their way to stdout
+    RuleChefTrieWriter *writer = trie ? rulechef_trie_create(NULL, NULL) : NULL;
+    RuleChefSink sink = trie ? rulechef_trie_sink : NULL;
+    if (trie && writer == NULL) {
+        rulechef_destroy(previous);
+        rulechef_destroy(chef);
         return 1;
     }
 
-    generateRulesFromHT(max_length, min_length, min_probability, verbose,&output_buffer,limit_unigrams);
+    if (sample.count > 0) {
+        rulechef_sample(chef, &params, &sample, sink, writer);
+    } else if (beam_width > 0) {
+        rulechef_beam(chef, &params, beam_width, sink, writer);
+    } else if (previous != NULL) {
+        rulechef_generate_delta(chef, previous, &params, sink, writer);
+    } else {
+        rulechef_generate(chef, &params, sink, writer);
+    }
+    rulechef_trie_close(writer, verbose);
+    rulechef_destroy(previous);
+    rulechef_destroy(chef);
 
     return 0;
 }
@@ -0,0 +1,143 @@
+#include "model_file.h"
+#include "hash_tables.h"
+#include "rule_parser.h"
+
+static void writeModelRecord(FILE *file, char type, const OperationNGram *ngram) {
+    long count = ngram->frequency;
+
+    fputc(type, file);
+    fwrite(&count, sizeof(long), 1, file);
+    for (int i = 0; i < ngram->op_count; i++) {
+        unsigned char length = (unsigned char)strlen(ngram->ops[i].full_op);
+        fputc(length, file);
+        fwrite(ngram->ops[i].full_op, 1, length, file);
+    }
+}
+
+// Nodes in the order they were added, so a loaded model breaks probability ties the same way
+// The pool keeps its newest block first, returns the records written or -1 when out of memory
+static long writeModelTable(FILE *file, char type, NGramHashTable *table, int op_count) {
+    long block_count = 0;
+    long written = 0;
+
+    for (NodePool *block = table->pool; block != NULL; block = block->next_block) {
+        block_count++;
+    }
+    NodePool **blocks = malloc((block_count + 1) * sizeof(NodePool *));
+    if (blocks == NULL) {
+        fprintf(stderr, "Failed to allocate model blocks\n");
+        return -1;
+    }
+    long b = block_count;
+    for (NodePool *block = table->pool; block != NULL; block = block->next_block) {
+        blocks[--b] = block;
+    }
+
+    for (b = 0; b < block_count; b++) {
+        for (long i = 0; i < blocks[b]->used_in_block; i++) {
+            const OperationNGram *ngram = &blocks[b]->nodes[i].ngram;
+            if (ngram->op_count == op_count) {
+                writeModelRecord(file, type, ngram);
+                written++;
+            }
+        }
+    }
+    free(blocks);
+    return written;
+}
+
+int saveModelFile(RuleChef *chef, const char *path, int verbose) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating model file: %s\n", path);
+        return 0;
+    }
+
+    fwrite(MODEL_FILE_MAGIC, 1, MODEL_FILE_MAGIC_LENGTH, file);
+    fwrite(&chef->rule_count, sizeof(long), 1, file);
+    long starters = writeModelTable(file, 'S', &chef->starter_hash_table, 1);
+    long unigrams = writeModelTable(file, 'U', &chef->unigram_hash_table, 1);
+    long bigrams = writeModelTable(file, 'B', &chef->bigram_hash_table, 2);
+    fputc('E', file);
+
+    int failed = ferror(file) || starters < 0 || unigrams < 0 || bigrams < 0;
+    if (fclose(file) != 0 || failed) {
+        fprintf(stderr, "Error writing model file: %s\n", path);
+        return 0;
+    }
+    if (verbose) {
+        fprintf(stderr, "Saved model to %s: %ld starters, %ld unigrams, %ld bigrams\n",
+                path, starters, unigrams, bigrams);
+    }
+    return 1;
+}
+
+// One op of a record, checked against the rule maps so a damaged file cannot produce an unknown op
+static int readModelOp(FILE *file, CompleteOperation *op) {
+    int length = fgetc(file);
+
+    memset(op, 0, sizeof(CompleteOperation));
+    if (length < 1 || length >= (int)sizeof(op->full_op) ||
+        fread(op->full_op, 1, length, file) != (size_t)length) {
+        return 0;
+    }
+    op->base_op = op->full_op[0];
+    op->length = length;
+    return RuleOPs[(unsigned char)op->base_op] == length;
+}
+
+int loadModelFile(RuleChef *chef, const char *path, int verbose) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening model file: %s\n", path);
+        return 0;
+    }
+
+    char magic[MODEL_FILE_MAGIC_LENGTH];
+    long rule_count;
+    if (fread(magic, 1, MODEL_FILE_MAGIC_LENGTH, file) != MODEL_FILE_MAGIC_LENGTH ||
+        memcmp(magic, MODEL_FILE_MAGIC, MODEL_FILE_MAGIC_LENGTH) != 0 ||
+        fread(&rule_count, sizeof(long), 1, file) != 1) {
+        fprintf(stderr, "Error: %s is not a saved model\n", path);
+        fclose(file);
+        return 0;
+    }
+
+    long records = 0;
+    int complete = 0;
+    int type;
+    while ((type = fgetc(file)) != EOF) {
+        CompleteOperation ops[2];
+        long count;
+
+        if (type == 'E') {
+            complete = 1;
+            break;
+        }
+        if ((type != 'S' && type != 'U' && type != 'B') ||
+            fread(&count, sizeof(long), 1, file) != 1 || count <= 0 ||
+            !readModelOp(file, &ops[0]) || (type == 'B' && !readModelOp(file, &ops[1]))) {
+            break;
+        }
+
+        if (type == 'S') {
+            addStarterOperationHashed(chef, &ops[0], count);
+        } else if (type == 'U') {
+            addUnigramHashed(chef, &ops[0], count);
+        } else {
+            addBigramHashed(chef, ops, count);
+        }
+        records++;
+    }
+    fclose(file);
+
+    if (!complete) {
+        fprintf(stderr, "Error: model file %s is truncated or corrupt after %ld records\n", path, records);
+        return 0;
+    }
+    chef->rule_count += rule_count;
+    if (verbose) {
+        fprintf(stderr, "Loaded model from %s: %ld rules, %ld n-grams\n", path, rule_count, records);
+    }
+    return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef MODEL_FILE_H
+#define MODEL_FILE_H
+
+#include "types.h"
+
+// Saved model: the starter, unigram and bigram counts after analysis, so a later run can load them instead
+// of the rule files or compare against them. Probabilities are not stored, they are recomputed from the
+// counts with the loading context's pruning settings
+//
+// After the "RCMODEL1" magic and the rule count (long), one record per n-gram:
+//   type ('S', 'U' or 'B'), count (long), then each op as its length byte and bytes
+// and a single 'E' at the end
+#define MODEL_FILE_MAGIC "RCMODEL1"
+#define MODEL_FILE_MAGIC_LENGTH 8
+
+// Returns 0 with a message when the file cannot be written
+int saveModelFile(RuleChef *chef, const char *path, int verbose);
+
+// Adds the counts of a saved model to chef, as if its rules had been analysed again
+// Returns 0 with a message when the file cannot be read or is not a saved model
+int loadModelFile(RuleChef *chef, const char *path, int verbose);
+
+#endif
@@ -0,0 +1,335 @@
+#include "ngram_export.h"
+#include "hash_tables.h"
+#include "hit_scorer.h"
+
+// Descending count, then table order
+static int compareNGramRefs(const void *a, const void *b) {
+    const NGramRef *ref_a = (const NGramRef *)a;
+    const NGramRef *ref_b = (const NGramRef *)b;
+
+    if (ref_a->ngram->frequency != ref_b->ngram->frequency) {
+        return ref_a->ngram->frequency > ref_b->ngram->frequency ? -1 : 1;
+    }
+    return (ref_a->order > ref_b->order) - (ref_a->order < ref_b->order);
+}
+
+// The heap root is the entry that sorts last, the first one to give up its place
+static void siftTopDown(NGramRef *heap, int count, int index) {
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= count) {
+            return;
+        }
+        if (child + 1 < count && compareNGramRefs(&heap[child + 1], &heap[child]) > 0) {
+            child++;
+        }
+        if (compareNGramRefs(&heap[child], &heap[index]) <= 0) {
+            return;
+        }
+        NGramRef swap = heap[index];
+        heap[index] = heap[child];
+        heap[child] = swap;
+        index = child;
+    }
+}
+
+int selectTopNGrams(NGramHashTable *table, int op_count, int k, NGramRef *top) {
+    NGramIterator it;
+    NGramHashNode *node;
+    int count = 0;
+    long order = 0;
+
+    if (k <= 0) {
+        return 0;
+    }
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count != op_count) {
+            continue;
+        }
+        NGramRef ref = {&node->ngram, order++};
+
+        if (count < k) {
+            // Sift up
+            int index = count++;
+            top[index] = ref;
+            while (index > 0 && compareNGramRefs(&top[index], &top[(index - 1) / 2]) > 0) {
+                NGramRef swap = top[index];
+                top[index] = top[(index - 1) / 2];
+                top[(index - 1) / 2] = swap;
+                index = (index - 1) / 2;
+            }
+        } else if (compareNGramRefs(&ref, &top[0]) < 0) {
+            top[0] = ref;
+            siftTopDown(top, count, 0);
+        }
+    }
+
+    qsort(top, count, sizeof(NGramRef), compareNGramRefs);
+    return count;
+}
+
+// Returns -1 when the references cannot be allocated
+static long collectNGramRefs(NGramHashTable *table, int op_count, NGramRef **refs) {
+    NGramIterator it;
+    NGramHashNode *node;
+    long count = 0;
+
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        count += node->ngram.op_count == op_count;
+    }
+    *refs = malloc((count + 1) * sizeof(NGramRef));
+    if (*refs == NULL) {
+        fprintf(stderr, "Failed to allocate n-gram export\n");
+        return -1;
+    }
+
+    long order = 0;
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count == op_count) {
+            (*refs)[order].ngram = &node->ngram;
+            (*refs)[order].order = order;
+            order++;
+        }
+    }
+    return count;
+}
+
+// One run to sort, or two adjacent sorted runs [start, middle) and [middle, end) to merge into target
+typedef struct {
+    NGramRef *source;
+    NGramRef *target;
+    long start;
+    long middle;
+    long end;
+} SortTask;
+
+static void *sortTaskWorker(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    qsort(task->source + task->start, task->end - task->start, sizeof(NGramRef), compareNGramRefs);
+    return NULL;
+}
+
+static void *mergeTaskWorker(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    long left = task->start;
+    long right = task->middle;
+    long out = task->start;
+
+    while (left < task->middle && right < task->end) {
+        if (compareNGramRefs(&task->source[right], &task->source[left]) < 0) {
+            task->target[out++] = task->source[right++];
+        } else {
+            task->target[out++] = task->source[left++];
+        }
+    }
+    memcpy(task->target + out, task->source + left, (task->middle - left) * sizeof(NGramRef));
+    out += task->middle - left;
+    memcpy(task->target + out, task->source + right, (task->end - right) * sizeof(NGramRef));
+    return NULL;
+}
+
+// Tasks whose thread cannot be started run in the calling thread instead
+static void runSortTasks(void *(*worker)(void *), SortTask *tasks, int count) {
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    int *started = calloc(count, sizeof(int));
+    for (int i = 1; threads != NULL && started != NULL && i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, worker, &tasks[i]) == 0;
+    }
+    worker(&tasks[0]);
+    for (int i = 1; i < count; i++) {
+        if (started != NULL && started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            worker(&tasks[i]);
+        }
+    }
+    free(started);
+    free(threads);
+}
+
+// Each thread sorts a run, then pairs of runs are merged in parallel until one is left
+static void sortNGramRefs(NGramRef *refs, long count, int threads) {
+    if (threads < 1) threads = getDefaultThreadCount();
+    if (count < 65536) threads = 1;
+
+    long *bounds = malloc((threads + 1) * sizeof(long));
+    SortTask *tasks = malloc(threads * sizeof(SortTask));
+    NGramRef *scratch = threads > 1 ? malloc(count * sizeof(NGramRef)) : NULL;
+    if (bounds == NULL || tasks == NULL || (threads > 1 && scratch == NULL)) {
+        // Without room for the runs, sorting in place gives the same order
+        qsort(refs, count, sizeof(NGramRef), compareNGramRefs);
+        free(scratch);
+        free(tasks);
+        free(bounds);
+        return;
+    }
+
+    int runs = threads;
+    for (int r = 0; r <= runs; r++) {
+        bounds[r] = count * r / runs;
+    }
+    for (int r = 0; r < runs; r++) {
+        tasks[r] = (SortTask){refs, NULL, bounds[r], bounds[r + 1], bounds[r + 1]};
+    }
+    runSortTasks(sortTaskWorker, tasks, runs);
+
+    NGramRef *source = refs;
+    NGramRef *target = scratch;
+    while (runs > 1) {
+        int merged = 0;
+        for (int r = 0; r < runs; r += 2) {
+            // An odd run out is merged with nothing, which copies it across
+            long middle = bounds[r + 1];
+            long end = r + 1 < runs ? bounds[r + 2] : bounds[r + 1];
+            tasks[merged] = (SortTask){source, target, bounds[r], middle, end};
+            bounds[merged] = bounds[r];
+            merged++;
+        }
+        bounds[merged] = count;
+        runSortTasks(mergeTaskWorker, tasks, merged);
+        runs = merged;
+
+        NGramRef *swap = source;
+        source = target;
+        target = swap;
+    }
+    if (source != refs) {
+        memcpy(refs, source, count * sizeof(NGramRef));
+    }
+
+    free(scratch);
+    free(tasks);
+    free(bounds);
+}
+
+static void writeExportOp(FILE *file, const char *op) {
+    for (; *op != '\0'; op++) {
+        if (*op == '\t') {
+            fputs("\\t", file);
+        } else if (*op == '\\') {
+            fputs("\\\\", file);
+        } else {
+            fputc(*op, file);
+        }
+    }
+}
+
+static void writeExportRecord(FILE *file, int format, char table, const OperationNGram *ngram, double probability) {
+    if (format == EXPORT_FORMAT_BIN) {
+        long count = ngram->frequency;
+        fputc(table, file);
+        fwrite(&count, sizeof(long), 1, file);
+        fwrite(&probability, sizeof(double), 1, file);
+        for (int i = 0; i < ngram->op_count; i++) {
+            unsigned char length = (unsigned char)strlen(ngram->ops[i].full_op);
+            fputc(length, file);
+            fwrite(ngram->ops[i].full_op, 1, length, file);
+        }
+        return;
+    }
+
+    const char *name = table == 'S' ? "starter" : table == 'U' ? "unigram" : "bigram";
+    fprintf(file, "%s\t%ld\t%.10g\t", name, ngram->frequency, probability);
+    writeExportOp(file, ngram->ops[0].full_op);
+    fputc('\t', file);
+    if (ngram->op_count > 1) {
+        writeExportOp(file, ngram->ops[1].full_op);
+    }
+    fputc('\n', file);
+}
+
+static long totalFrequency(NGramHashTable *table, int op_count, long *entries) {
+    NGramIterator it;
+    NGramHashNode *node;
+    long total = 0;
+
+    *entries = 0;
+    initNGramIterator(&it, table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count == op_count) {
+            total += node->ngram.frequency;
+            (*entries)++;
+        }
+    }
+    return total;
+}
+
+int exportNGramTables(RuleChef *chef, const char *path, int format, int threads, int verbose) {
+    int to_stdout = strcmp(path, "-") == 0;
+    FILE *file = to_stdout ? stdout : fopen(path, format == EXPORT_FORMAT_BIN ? "wb" : "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating export file: %s\n", path);
+        return 0;
+    }
+    // setvbuf is only valid before the first write, stdout may already have been used by the caller
+    if (!to_stdout) {
+        setvbuf(file, NULL, _IOFBF, 1 << 20);
+    }
+
+    if (format == EXPORT_FORMAT_BIN) {
+        fwrite(EXPORT_BIN_MAGIC, 1, strlen(EXPORT_BIN_MAGIC), file);
+    } else {
+        fputs("table\tcount\tprobability\top\tnext_op\n", file);
+    }
+
+    // Starter probabilities are smoothed over every unigram the way generation ranks starters
+    long unigram_width;
+    long starter_entries;
+    long unigram_total = totalFrequency(&chef->unigram_hash_table, 1, &unigram_width);
+    long starter_total = totalFrequency(&chef->starter_hash_table, 1, &starter_entries);
+    double starter_denominator = starter_total + K_SMOOTHING_FACTOR * unigram_width;
+
+    struct {
+        char table;
+        NGramHashTable *hash_table;
+        int op_count;
+    } sections[] = {
+        {'S', &chef->starter_hash_table, 1},
+        {'U', &chef->unigram_hash_table, 1},
+        {'B', &chef->bigram_hash_table, 2},
+    };
+
+    for (size_t s = 0; s < sizeof(sections) / sizeof(sections[0]); s++) {
+        NGramRef *refs;
+        long count = collectNGramRefs(sections[s].hash_table, sections[s].op_count, &refs);
+        if (count < 0) {
+            if (!to_stdout) fclose(file);
+            return 0;
+        }
+        sortNGramRefs(refs, count, threads);
+
+        for (long i = 0; i < count; i++) {
+            const OperationNGram *ngram = refs[i].ngram;
+            double probability;
+            if (sections[s].table == 'S') {
+                probability = starter_denominator > 0 ? (ngram->frequency + K_SMOOTHING_FACTOR) / starter_denominator : 0.0;
+            } else if (sections[s].table == 'U') {
+                probability = unigram_total > 0 ? (double)ngram->frequency / unigram_total : 0.0;
+            } else {
+                probability = ngram->probability;
+            }
+            writeExportRecord(file, format, sections[s].table, ngram, probability);
+        }
+        if (verbose) {
+            fprintf(stderr, "Exported %ld %s\n", count,
+                    sections[s].table == 'S' ? "starters" : sections[s].table == 'U' ? "unigrams" : "bigrams");
+        }
+        free(refs);
+    }
+    if (format == EXPORT_FORMAT_BIN) {
+        fputc('E', file);
+    }
+
+    int failed = fflush(file) != 0 || ferror(file);
+    if (!to_stdout && fclose(file) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        fprintf(stderr, "Error writing export file: %s\n", path);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef NGRAM_EXPORT_H
+#define NGRAM_EXPORT_H
+
+#include "types.h"
+
+// An n-gram where it lives in its table, order is its position in table order for stable ties
+typedef struct {
+    const OperationNGram *ngram;
+    long order;
+} NGramRef;
+
+// The k most frequent n-grams of op_count ops, most frequent first, with a bounded heap instead of
+// sorting the table. top must hold k entries, returns how many were found
+int selectTopNGrams(NGramHashTable *table, int op_count, int k, NGramRef *top);
+
+// Full export of the starter, unigram and bigram tables with their counts and the probabilities generation
+// uses, each sorted by descending count (across threads). path may be "-" for stdout
+//   tsv: "table<TAB>count<TAB>probability<TAB>op<TAB>next_op" rows after a header, tabs in ops are
+//        written as \t and backslashes doubled
+//   bin: after the "RCEXPRT1" magic, one record per n-gram: table ('S', 'U' or 'B'), count (long),
+//        probability (double), then each op as its length byte and bytes, and a single 'E' at the end
+#define EXPORT_FORMAT_TSV 0
+#define EXPORT_FORMAT_BIN 1
+#define EXPORT_BIN_MAGIC "RCEXPRT1"
+int exportNGramTables(RuleChef *chef, const char *path, int format, int threads, int verbose);
+
+#endif
@@ -1,23 +1,29 @@
 #include <Judy.h>
 #include "processor.h"
+#include "enumerator.h"
+#include "constraints.h"
 #include "types.h"
 
 #include "hash_tables.h"
 #include "buffer.h"
+#include "rule_parser.h"
+
+// Per call generation state, the model itself is shared and only read
+typedef struct {
+    RuleChef *chef;
+    const RuleChefParams *params;
+    WBuffer *output_buffer;
+    Pvoid_t emitted;           // Judy set of rules already written
+    Pvoid_t commuted;          // Two op rules -s skips, see buildCommutedRules
+    OperationNGram *starters;
+    int starter_count;
+    RuleConstraints constraints;
+    int bytes[MAX_RULE_LEN + 1];    // Rule bytes up to each depth, for --max-bytes
+    const double *tier_thresholds;  // Descending, NULL when every rule goes to output_buffer
+    WBuffer *tier_buffers;
+    int tier_count;
+} GenerationState;
 
-#define MAXLINE 1000000
-
-int counter = 0;
-static FastTransitionLookup *fast_lookup = NULL;
-static int fast_lookup_count = 0;
-
-
-Pvoid_t   PJArray = (PWord_t)NULL;
-PWord_t   PValue;
-Word_t    Bytes;
-uint8_t   Index[MAXLINE];
-
-extern int max_operation_count[4];
 // Compare chains
 int compareTransitionsByProbability(const void *a, const void *b)
 {
@@ -29,7 +35,7 @@ int compareTransitionsByProbability(const void *a, const void *b)
     {
         return (trans_b->probability > trans_a->probability) ? 1 : -1;
     }
-    return trans_b->frequency - trans_a->frequency;
+    return (trans_b->frequency > trans_a->frequency) - (trans_b->frequency < trans_a->frequency);
 }
 
 
@@ -42,150 +48,287 @@ int compareNGramsByFrequency(const void *a, const void *b)
 {
     OperationNGram *ngram_a = (OperationNGram *)a;
     OperationNGram *ngram_b = (OperationNGram *)b;
-    return ngram_b->frequency - ngram_a->frequency; // Descending order
+    return (ngram_b->frequency > ngram_a->frequency) - (ngram_b->frequency < ngram_a->frequency); // Descending order
 }
 
-// Build optimised lookup table after analysis is complete
-void buildLookupTable(int verbose) {
-    if (verbose) {
-        fprintf(stderr, "Building transition lookup table from bigrams...\n");
+// Starters are ranked on the probability generation prunes with, ties keep frequency order
+static int compareNGramsByProbability(const void *a, const void *b)
+{
+    const OperationNGram *ngram_a = (const OperationNGram *)a;
+    const OperationNGram *ngram_b = (const OperationNGram *)b;
+    if (ngram_a->probability != ngram_b->probability) {
+        return ngram_b->probability > ngram_a->probability ? 1 : -1;
     }
+    return compareNGramsByFrequency(a, b);
+}
 
-    CompleteOperation *unique_ops = malloc(max_operation_count[2] * sizeof(CompleteOperation));
-    long unique_from_count = 0;
-
-    // Find all unique from_ops (first operation in bigrams)
-    for (int i = 0; i < max_operation_count[2]; i++) {
-        NGramHashNode *node = bigram_hash_table[i];
-        while (node != NULL) {
-            if (node->ngram.op_count == 2) {
-                long found = 0;
-                for (long j = 0; j < unique_from_count; j++) {
-                    if (compareCompleteOps(&unique_ops[j], &node->ngram.ops[0])) {
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found && unique_from_count < max_operation_count[2]) {
-                    unique_ops[unique_from_count] = node->ngram.ops[0];
-                    unique_from_count++;
-                }
+// Keeps the most probable successors of a sorted row, pruned bigrams get probability 0 in the model too
+static long pruneTransitions(RuleChef *chef, FastTransitionLookup *lookup) {
+    long pruned = 0;
+
+    if (chef->max_branch > 0 && lookup->transition_count > chef->max_branch) {
+        for (int t = chef->max_branch; t < lookup->transition_count; t++) {
+            lookup->sorted_transitions[t].node->ngram.probability = 0.0;
+        }
+        pruned = lookup->transition_count - chef->max_branch;
+        lookup->transition_count = chef->max_branch;
+
+        if (chef->renormalize) {
+            double total = 0.0;
+            for (int t = 0; t < lookup->transition_count; t++) {
+                total += lookup->sorted_transitions[t].probability;
+            }
+            for (int t = 0; t < lookup->transition_count && total > 0.0; t++) {
+                lookup->sorted_transitions[t].probability /= total;
+                lookup->sorted_transitions[t].node->ngram.probability = lookup->sorted_transitions[t].probability;
             }
-            node = node->next;
         }
     }
 
+    lookup->max_probability = lookup->sorted_transitions[0].probability;
+    lookup->min_probability = lookup->sorted_transitions[lookup->transition_count - 1].probability;
+    return pruned;
+}
+
+// Build optimised lookup table after analysis is complete
+// Bigrams are grouped by from_op in two passes (count, then place), rows keep the order in which their
+// from_op first appears and transitions keep table order before the sort
+void buildLookupTable(RuleChef *chef, int verbose) {
     if (verbose) {
-        fprintf(stderr, "Found %ld unique 'from' operations\n", unique_from_count);
+        fprintf(stderr, "Building transition lookup table from bigrams...\n");
     }
 
-    // Allocate lookup table
-    fast_lookup = malloc(unique_from_count * sizeof(FastTransitionLookup));
+    // Every from_op is also a unigram, a good first guess for the number of rows
+    long max_from_ops = chef->unigram_hash_table.count + 1;
+    long *row_sizes = malloc(max_from_ops * sizeof(long));
+    Pvoid_t rows = (Pvoid_t)NULL;
+    PWord_t PValue;
+    long row_count = 0;
+    long below_min_count = 0;
+    NGramIterator it;
+    NGramHashNode *node;
 
-    if (fast_lookup == NULL) {
-        fprintf(stderr, "ERROR: Failed to allocate fast lookup table\n");
-        free(unique_ops);
+    if (row_sizes == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate lookup rows\n");
         return;
     }
 
-    fast_lookup_count = 0;
-
-    // Build lookup table for each unique 'from' operation
-    for (long i = 0; i < unique_from_count; i++) {
-        CompleteOperation *current_from_op = &unique_ops[i];
-
-        // Count bigrams for this 'from' operation
-        long trans_count = 0;
-        for (int j = 0; j < max_operation_count[2]; j++) {
-            NGramHashNode *node = bigram_hash_table[j];
-            while (node != NULL) {
-                if (node->ngram.op_count == 2 &&
-                    compareCompleteOps(&node->ngram.ops[0], current_from_op)) {
-                    trans_count++;
+    initNGramIterator(&it, &chef->bigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count != 2) {
+            continue;
+        }
+        if (node->ngram.frequency < chef->min_count) {
+            below_min_count++;
+            continue;
+        }
+        JSLI(PValue, rows, (const uint8_t *)node->ngram.ops[0].full_op);
+        if (*PValue == 0) {
+            if (row_count == max_from_ops) {
+                long *grown = realloc(row_sizes, max_from_ops * 2 * sizeof(long));
+                if (grown == NULL) {
+                    fprintf(stderr, "ERROR: Failed to allocate lookup rows\n");
+                    Word_t freed;
+                    free(row_sizes);
+                    JSLFA(freed, rows);
+                    (void)freed;
+                    return;
                 }
-                node = node->next;
+                row_sizes = grown;
+                max_from_ops *= 2;
             }
+            row_sizes[row_count] = 0;
+            *PValue = ++row_count;
         }
+        row_sizes[*PValue - 1]++;
+    }
 
-        if (trans_count == 0) continue; // Skip if no transitions
-
-        // Allocate sorted transitions array
-        FastTransitionLookup *lookup = &fast_lookup[fast_lookup_count];
-        lookup->from_op = *current_from_op;
-        lookup->sorted_transitions = malloc(trans_count * sizeof(SortedTransition));
-        lookup->transition_count = trans_count;
-        lookup->max_probability = 0.0;
-        lookup->min_probability = 1.0;
+    if (verbose) {
+        fprintf(stderr, "Found %ld unique 'from' operations\n", row_count);
+    }
 
+    chef->fast_lookup = arenaAlloc(&chef->lookup_arena, (row_count + 1) * sizeof(FastTransitionLookup));
+    if (chef->fast_lookup == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate fast lookup table\n");
+        Word_t freed;
+        free(row_sizes);
+        JSLFA(freed, rows);
+        (void)freed;
+        return;
+    }
+    for (long r = 0; r < row_count; r++) {
+        FastTransitionLookup *lookup = &chef->fast_lookup[r];
+        lookup->sorted_transitions = arenaAlloc(&chef->lookup_arena, row_sizes[r] * sizeof(SortedTransition));
+        lookup->transition_count = 0;
         if (lookup->sorted_transitions == NULL) {
+            // Without a lookup table nothing longer than one op is generated
             fprintf(stderr, "ERROR: Failed to allocate sorted transitions\n");
-            continue;
+            Word_t freed;
+            free(row_sizes);
+            JSLFA(freed, rows);
+            (void)freed;
+            freeLookupTable(chef);
+            return;
         }
+    }
+    free(row_sizes);
 
-        // Populate sorted transitions from bigrams
-        int sorted_index = 0;
-        for (int j = 0; j < max_operation_count[2]; j++) {
-            NGramHashNode *node = bigram_hash_table[j];
-            while (node != NULL && sorted_index < trans_count) {
-                if (node->ngram.op_count == 2 &&
-                    compareCompleteOps(&node->ngram.ops[0], current_from_op)) {
-
-                    lookup->sorted_transitions[sorted_index].next_op = &node->ngram.ops[1];
-                    lookup->sorted_transitions[sorted_index].probability = node->ngram.probability;
-                    lookup->sorted_transitions[sorted_index].frequency = node->ngram.frequency;
+    initNGramIterator(&it, &chef->bigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count != 2 || node->ngram.frequency < chef->min_count) {
+            continue;
+        }
+        JSLG(PValue, rows, (const uint8_t *)node->ngram.ops[0].full_op);
+        if (PValue == NULL) {
+            continue;
+        }
+        FastTransitionLookup *lookup = &chef->fast_lookup[*PValue - 1];
+        SortedTransition *transition = &lookup->sorted_transitions[lookup->transition_count++];
+        lookup->from_op = node->ngram.ops[0];
+        transition->next_op = &node->ngram.ops[1];
+        transition->probability = node->ngram.probability;
+        transition->frequency = node->ngram.frequency;
+        transition->node = node;
+    }
 
-                    // Track min/max probabilities
-                    if (node->ngram.probability > lookup->max_probability) {
-                        lookup->max_probability = node->ngram.probability;
-                    }
-                    if (node->ngram.probability < lookup->min_probability) {
-                        lookup->min_probability = node->ngram.probability;
-                    }
+    chef->fast_lookup_count = row_count;
+    chef->max_transition_count = 0;
+    chef->lookup_index = rows;
 
-                    sorted_index++;
-                }
-                node = node->next;
-            }
-        }
+    long beyond_max_branch = 0;
+    for (long r = 0; r < row_count; r++) {
+        FastTransitionLookup *lookup = &chef->fast_lookup[r];
 
         // Sort transitions by probability (descending)
         qsort(lookup->sorted_transitions, lookup->transition_count,
               sizeof(SortedTransition), compareTransitionsByProbability);
+        beyond_max_branch += pruneTransitions(chef, lookup);
 
-        fast_lookup_count++;
+        if (lookup->transition_count > chef->max_transition_count) {
+            chef->max_transition_count = lookup->transition_count;
+        }
 
-        if (verbose && i < 10) {
+        if (verbose && r < 10) {
             fprintf(stderr, "  Operation '%s': %d transitions, prob range: %.4f - %.4f\n",
                     lookup->from_op.full_op, lookup->transition_count,
                     lookup->min_probability, lookup->max_probability);
         }
     }
 
-    free(unique_ops);
-
     if (verbose) {
-        fprintf(stderr, "Lookup table built: %d unique operations\n", fast_lookup_count);
+        fprintf(stderr, "Lookup table built: %d unique operations\n", chef->fast_lookup_count);
+        if (chef->min_count > 1 || chef->max_branch > 0) {
+            fprintf(stderr, "Pruned %ld bigrams below the minimum count, %ld beyond the maximum branch%s\n",
+                    below_min_count, beyond_max_branch, chef->renormalize ? " (renormalised)" : "");
+        }
     }
 }
-// Fast lookup with early probability pruning
-int getNextOperations(CompleteOperation *current_op, CompleteOperation **next_ops,
-                     double *next_probs, int *count, double min_probability,
-                     double current_rule_probability) {
-    *count = 0;
 
-    if (current_op == NULL || fast_lookup == NULL) {
-        return 0;
+// Find the lookup entry for this operation through the JudySL index
+FastTransitionLookup *findTransitionLookup(RuleChef *chef, const CompleteOperation *op) {
+    PWord_t PValue;
+
+    JSLG(PValue, chef->lookup_index, (const uint8_t *)op->full_op);
+    return PValue != NULL ? &chef->fast_lookup[*PValue - 1] : NULL;
+}
+
+// Key of a two op rule in the commuted set, the ops are kept apart so different splits never collide
+static void commutedKey(const CompleteOperation *first, const CompleteOperation *second, char *key) {
+    int first_length = strlen(first->full_op);
+    memcpy(key, first->full_op, first_length);
+    key[first_length] = '\n';
+    strcpy(key + first_length + 1, second->full_op);
+}
+
+void addCommutedRule(void **commuted, const CompleteOperation *first, const CompleteOperation *second) {
+    char key[2 * MAX_RULE_LEN];
+    PWord_t PValue;
+
+    if (RulePairs[(unsigned char)second->base_op][(unsigned char)first->base_op] != PAIR_COMMUTES) {
+        return;
+    }
+    commutedKey(second, first, key);
+    JSLI(PValue, *commuted, (const uint8_t *)key);
+    *PValue = 1;
+}
+
+// -s writes ops that commute in one canonical order ($1^2, not ^2$1). Whether the canonical order of a
+// longer chain is written depends on the ops around the pair, so only two op rules are dropped: the
+// canonical rule then needs just its starter and one transition, both checked here against -l, -p, -j
+// and the constraints. Longer chains keep both orders
+void *buildCommutedRules(RuleChef *chef, const RuleChefParams *params, const RuleConstraints *constraints,
+                         const OperationNGram *starters, int starter_count) {
+    double min_probability = params->min_probability;
+    void *commuted = NULL;
+
+    if (!params->simplify || params->min_length > 2 || params->max_length < 2) {
+        return NULL;
     }
 
-    // Find the lookup entry for this operation - O(log n) or O(1) with hash
-    FastTransitionLookup *lookup = NULL;
-    for (int i = 0; i < fast_lookup_count; i++) {
-        if (compareCompleteOps(&fast_lookup[i].from_op, current_op)) {
-            lookup = &fast_lookup[i];
+    for (int i = 0; i < starter_count; i++) {
+        const CompleteOperation *first = &starters[i].ops[0];
+        double starter_probability = params->joint ? starters[i].probability : 1.0;
+        if (min_probability > 0.0 && starter_probability < min_probability) {
             break;
         }
+        if (constraints->active && !constraintAllowsOp(constraints, first, 0, 0, 2)) {
+            continue;
+        }
+
+        FastTransitionLookup *lookup = findTransitionLookup(chef, first);
+        for (int t = 0; lookup != NULL && t < lookup->transition_count; t++) {
+            const CompleteOperation *second = lookup->sorted_transitions[t].next_op;
+            if (min_probability > 0.0 && starter_probability * lookup->sorted_transitions[t].probability < min_probability) {
+                break;
+            }
+            if (second == NULL || isRedundantTransition(first, second) ||
+                RulePairs[(unsigned char)second->base_op][(unsigned char)first->base_op] != PAIR_COMMUTES) {
+                continue;
+            }
+            CompleteOperation canonical[2] = {*first, *second};
+            if (constraints->active &&
+                (!constraintAllowsOp(constraints, second, 1, first->length, 2) ||
+                 !constraintAllowsChain(constraints, canonical, 2))) {
+                continue;
+            }
+            addCommutedRule(&commuted, first, second);
+        }
     }
+    return commuted;
+}
+
+int isCommutedRule(void *commuted, const CompleteOperation *ops, int length) {
+    char key[2 * MAX_RULE_LEN];
+    PWord_t PValue;
+
+    if (commuted == NULL || length != 2 ||
+        RulePairs[(unsigned char)ops[0].base_op][(unsigned char)ops[1].base_op] != PAIR_COMMUTES) {
+        return 0;
+    }
+    commutedKey(&ops[0], &ops[1], key);
+    JSLG(PValue, (Pvoid_t)commuted, (const uint8_t *)key);
+    return PValue != NULL;
+}
+
+void freeCommutedRules(void *commuted) {
+    Pvoid_t rules = (Pvoid_t)commuted;
+    Word_t freed;
 
+    JSLFA(freed, rules);
+    (void)freed;
+}
+
+// Fast lookup with early probability pruning
+int getNextOperations(RuleChef *chef, CompleteOperation *current_op, CompleteOperation **next_ops,
+                     double *next_probs, int *count, double min_probability,
+                     double current_rule_probability, int simplify) {
+    *count = 0;
+
+    if (current_op == NULL || chef->fast_lookup == NULL) {
+        return 0;
+    }
+
+    FastTransitionLookup *lookup = findTransitionLookup(chef, current_op);
     if (lookup == NULL || lookup->sorted_transitions == NULL) {
         return 0; // No transitions found
     }
@@ -197,7 +340,7 @@ int getNextOperations(CompleteOperation *current_op, CompleteOperation **next_op
     }
 
     // Iterate through PRE-SORTED transitions (highest probability first)
-    for (int i = 0; i < lookup->transition_count && *count < max_operation_count[2]; i++) {
+    for (int i = 0; i < lookup->transition_count; i++) {
         double transition_prob = lookup->sorted_transitions[i].probability;
         double new_rule_probability = current_rule_probability * transition_prob;
 
@@ -211,6 +354,11 @@ int getNextOperations(CompleteOperation *current_op, CompleteOperation **next_op
             continue;
         }
 
+        // Never expand transitions that make the chain reducible
+        if (simplify && isRedundantTransition(current_op, lookup->sorted_transitions[i].next_op)) {
+            continue;
+        }
+
         // Add valid transition
         next_ops[*count] = lookup->sorted_transitions[i].next_op;
         next_probs[*count] = transition_prob;
@@ -221,10 +369,13 @@ int getNextOperations(CompleteOperation *current_op, CompleteOperation **next_op
 }
 
 // Optimised output function that doesn't recalculate probability
-void outputRule(CompleteOperation *ops, int length, int min_length,
-                         double min_probability, double rule_probability,
-                         WBuffer *output_buffer)
+static void outputRule(GenerationState *state, CompleteOperation *ops, int length,
+                       double rule_probability)
 {
+    int min_length = state->params->min_length;
+    double min_probability = state->params->min_probability;
+    WBuffer *output_buffer = state->output_buffer;
+    PWord_t PValue;
 
     if (length < min_length || (min_probability > 0.0 && rule_probability < min_probability))
     {
@@ -236,6 +387,27 @@ void outputRule(CompleteOperation *ops, int length, int min_length,
         return;
     }
 
+    if (state->constraints.active && !constraintAllowsChain(&state->constraints, ops, length))
+    {
+        return;
+    }
+
+    if (isCommutedRule(state->commuted, ops, length))
+    {
+        return;
+    }
+
+    // The highest tier the rule reaches, the last one takes everything down to min_probability
+    if (state->tier_count > 0)
+    {
+        int tier = 0;
+        while (tier < state->tier_count - 1 && rule_probability < state->tier_thresholds[tier])
+        {
+            tier++;
+        }
+        output_buffer = &state->tier_buffers[tier];
+    }
+
     // Build rule string with bounds checking
     char rule_string[MAX_RULE_LEN] = "";
     int total_len = 0;
@@ -252,14 +424,14 @@ void outputRule(CompleteOperation *ops, int length, int min_length,
     }
 
 
-    JSLG(PValue,PJArray,rule_string)
+    JSLG(PValue, state->emitted, rule_string)
     if (PValue != NULL)
     {
         return;
     }
 
     buffer_string2(output_buffer, rule_string, MAX_RULE_LEN);
-    JSLI(PValue, PJArray, rule_string);
+    JSLI(PValue, state->emitted, rule_string);
     ++(*PValue);
     // Periodic buffer flush
     if (output_buffer->writeCount % 1000 == 0)
@@ -268,20 +440,19 @@ void outputRule(CompleteOperation *ops, int length, int min_length,
     }
 }
 
-OperationNGram *getSortedUnigramsFromHashTable(int *count, int limit_unigrams)
+OperationNGram *getSortedUnigramsFromHashTable(RuleChef *chef, int *count, int limit_unigrams)
 {
     // Extract unigrams from hash table
+    NGramIterator it;
+    NGramHashNode *node;
+
     *count = 0;
-    for (int i = 0; i < UNIGRAM_HASH_SIZE; i++)
+    initNGramIterator(&it, &chef->unigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL)
     {
-        NGramHashNode *node = unigram_hash_table[i];
-        while (node != NULL)
+        if (node->ngram.op_count == 1)
         {
-            if (node->ngram.op_count == 1)
-            {
-                (*count)++;
-            }
-            node = node->next;
+            (*count)++;
         }
     }
 
@@ -294,20 +465,27 @@ OperationNGram *getSortedUnigramsFromHashTable(int *count, int limit_unigrams)
         return NULL;
 
     int index = 0;
-    for (int i = 0; i < UNIGRAM_HASH_SIZE; i++)
+    initNGramIterator(&it, &chef->unigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL && index < *count)
     {
-        NGramHashNode *node = unigram_hash_table[i];
-        while (node != NULL && index < *count)
+        if (node->ngram.op_count == 1)
         {
-            if (node->ngram.op_count == 1)
-            {
-                unigrams[index] = node->ngram;
-                index++;
-            }
-            node = node->next;
+            unigrams[index] = node->ngram;
+            index++;
         }
     }
 
+    // Unigram share doubles as the starter probability when no starters were recorded
+    long total_frequency = 0;
+    for (int i = 0; i < *count; i++)
+    {
+        total_frequency += unigrams[i].frequency;
+    }
+    for (int i = 0; i < *count; i++)
+    {
+        unigrams[i].probability = total_frequency > 0 ? (double)unigrams[i].frequency / total_frequency : 0.0;
+    }
+
     // Sort by frequency (descending)
     qsort(unigrams, *count, sizeof(OperationNGram), compareNGramsByFrequency);
 
@@ -320,17 +498,31 @@ OperationNGram *getSortedUnigramsFromHashTable(int *count, int limit_unigrams)
     return unigrams;
 }
 
+// Number of starters used, -l is either TopN or a TopN fraction
+int getStarterLimit(double limit_unigrams, int starter_count)
+{
+    int max_unigrams = starter_count;
+
+    if (limit_unigrams >= 1 && limit_unigrams < max_unigrams)
+        max_unigrams = limit_unigrams;
+    else if(limit_unigrams < 1 && limit_unigrams > 0)
+    {
+        max_unigrams = (int)(limit_unigrams * max_unigrams);
+    }
+    return max_unigrams;
+}
+
 // Recursive function
-void generateRules(CompleteOperation *current_sequence, int current_length,
-                            int target_length, int max_depth, int min_length,
-                            double min_probability, double current_probability, int verbose,
-                            OperationNGram *unigrams, int unigram_count,
-                            WBuffer *output_buffer,
-                            double limit_unigrams)
+static void generateRules(GenerationState *state, CompleteOperation *current_sequence, int current_length,
+                          int target_length, double current_probability)
 {
+    const RuleChefParams *params = state->params;
+    int min_length = params->min_length;
+    double min_probability = params->min_probability;
+    int max_depth = target_length;
 
     // Prevent infinite recursion
-    if (current_length > max_depth || current_length > MAX_RULE_LEN)
+    if (current_length > max_depth || current_length > MAX_RULE_LEN || generationStopped(params))
     {
         return;
     }
@@ -344,8 +536,7 @@ void generateRules(CompleteOperation *current_sequence, int current_length,
     // Output current sequence if it meets criteria
     if (current_length >= min_length && current_length <= target_length)
     {
-        outputRule(current_sequence, current_length, min_length,
-                            min_probability, current_probability, output_buffer);
+        outputRule(state, current_sequence, current_length, current_probability);
     }
 
     // Stop if we've reached the target length
@@ -358,34 +549,44 @@ void generateRules(CompleteOperation *current_sequence, int current_length,
     if (current_length == 0)
     {
 
-        int max_unigrams = unigram_count;
-
-        if (limit_unigrams >= 1)
-            max_unigrams = limit_unigrams;
-        else if(limit_unigrams < 1 && limit_unigrams > 0)
-        {
-            max_unigrams = (int)(limit_unigrams * max_unigrams);
-        }
-
+        int max_unigrams = getStarterLimit(params->limit_unigrams, state->starter_count);
 
         for (int i = 0; i < max_unigrams; i++)
         {
-            current_sequence[0] = unigrams[i].ops[0];
-            generateRules(current_sequence, 1, target_length, max_depth,
-                                   min_length, min_probability, 1.0, verbose,
-                                   unigrams, unigram_count, output_buffer,
-                                   limit_unigrams);
+            // Starters are sorted by probability, so a rare starter ends the loop when pruning
+            double starter_probability = params->joint ? state->starters[i].probability : 1.0;
+            if (min_probability > 0.0 && starter_probability < min_probability)
+            {
+                break;
+            }
+            const CompleteOperation *starter = &state->starters[i].ops[0];
+            if (state->constraints.active &&
+                !constraintAllowsOp(&state->constraints, starter, 0, 0, target_length))
+            {
+                continue;
+            }
+            current_sequence[0] = *starter;
+            state->bytes[1] = starter->length;
+            generateRules(state, current_sequence, 1, target_length, starter_probability);
         }
         return;
     }
 
-    CompleteOperation **next_ops = malloc(max_operation_count[2] * sizeof(CompleteOperation *));
-    double *next_probs = malloc(max_operation_count[2] * sizeof(double));
+    int max_transitions = state->chef->max_transition_count;
+    CompleteOperation **next_ops = malloc((max_transitions + 1) * sizeof(CompleteOperation *));
+    double *next_probs = malloc((max_transitions + 1) * sizeof(double));
+    if (next_ops == NULL || next_probs == NULL)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate transitions\n");
+        free(next_ops);
+        free(next_probs);
+        return;
+    }
 
     int next_count = 0;
-    getNextOperations(&current_sequence[current_length - 1],
+    getNextOperations(state->chef, &current_sequence[current_length - 1],
                                             next_ops, next_probs, &next_count,
-                                            min_probability, current_probability);
+                                            min_probability, current_probability, params->simplify);
 
     for (int i = 0; i < next_count; i++)
     {
@@ -399,60 +600,80 @@ void generateRules(CompleteOperation *current_sequence, int current_length,
         {
             continue;
         }
+        if (state->constraints.active &&
+            !constraintAllowsOp(&state->constraints, next_ops[i], current_length,
+                                state->bytes[current_length], target_length))
+        {
+            continue;
+        }
         current_sequence[current_length] = *next_ops[i];
-        generateRules(current_sequence, current_length + 1, target_length, max_depth,
-                               min_length, min_probability, new_probability, verbose,
-                               unigrams, unigram_count, output_buffer,
-                                limit_unigrams);
+        state->bytes[current_length + 1] = state->bytes[current_length] + next_ops[i]->length;
+        generateRules(state, current_sequence, current_length + 1, target_length, new_probability);
     }
 
     free(next_ops);
     free(next_probs);
 }
 
-void generateRulesFromHT(int max_length, int min_length, double min_probability, int verbose,
-                        WBuffer *output_buffer, long limit_unigrams) {
-
-  int starter_count_local = 0;
-
-    OperationNGram *sorted_starters = getSortedStarterOperationsFromHT(&starter_count_local, limit_unigrams);
+// Sorted starting operations, falling back to plain unigrams when no starters were recorded
+OperationNGram *getGenerationStarters(RuleChef *chef, const RuleChefParams *params, int *count) {
+    OperationNGram *sorted_starters = getSortedStarterOperationsFromHT(chef, count, params->limit_unigrams);
 
     // Fall back to regular unigrams if no starters found
-    if (sorted_starters == NULL || starter_count_local == 0) {
-        if (verbose) {
+    if (sorted_starters == NULL || *count == 0) {
+        if (params->verbose) {
             fprintf(stderr, "Warning: No starter operations found, falling back to regular unigrams\n");
         }
-        sorted_starters = getSortedUnigramsFromHashTable(&starter_count_local, limit_unigrams);
+        free(sorted_starters);
+        sorted_starters = getSortedUnigramsFromHashTable(chef, count, params->limit_unigrams);
     }
 
-    if (sorted_starters == NULL || starter_count_local == 0) {
+    if (sorted_starters == NULL || *count == 0) {
         fprintf(stderr, "Error: No starting operations found - cannot generate rules!\n");
-        return;
+        free(sorted_starters);
+        return NULL;
     }
+    return sorted_starters;
+}
 
-    if (verbose)
-    {
-        fprintf(stderr, "\n=== Rule Generation (length: %d-%d, min probability: %.3f) ===\n",
-                min_length, max_length, min_probability);
+// Rules written so far, over every tier when there are tiers
+static size_t generationWriteCount(const GenerationState *state) {
+    size_t written = state->output_buffer->writeCount;
+    if (state->tier_count > 0) {
+        written = 0;
+        for (int t = 0; t < state->tier_count; t++) {
+            written += state->tier_buffers[t].writeCount;
+        }
     }
+    return written;
+}
 
+static void generateRulesInto(RuleChef *chef, const RuleChefParams *params, WBuffer *output_buffer,
+                              const double *tier_thresholds, WBuffer *tier_buffers, int tier_count) {
 
-    if (sorted_starters == NULL || starter_count_local == 0)
-    {
-        fprintf(stderr, "Error: No unigrams found - cannot generate rules!\n");
+    int starter_count_local = 0;
+    int verbose = params->verbose;
+    int min_length = params->min_length;
+    int max_length = params->max_length;
+
+    OperationNGram *sorted_starters = getGenerationStarters(chef, params, &starter_count_local);
+    if (sorted_starters == NULL) {
         return;
     }
 
+    if (verbose)
+    {
+        fprintf(stderr, "\n=== Rule Generation (length: %d-%d, min probability: %.3f) ===\n",
+                min_length, max_length, params->min_probability);
+    }
+
     // Get bigram count instead of transition count
-    long bigram_transition_count = getBigramCountFromHashTable();
+    long bigram_transition_count = getBigramCountFromHashTable(chef);
 
     if (bigram_transition_count == 0) {
         fprintf(stderr, "Warning: No bigrams found - only single-operation rules possible\n");
     }
 
-    // Build lookup table from bigrams (no longer needs transitions array)
-    buildLookupTable(verbose);
-
     if (verbose) {
         fprintf(stderr, "Starting generation with probability pruning...\n");
         fprintf(stderr, "Processing %d unigrams with %ld bigrams\n", starter_count_local, bigram_transition_count);
@@ -465,58 +686,99 @@ void generateRulesFromHT(int max_length, int min_length, double min_probability,
         return;
     }
 
+    GenerationState state;
+    if (!compileConstraints(params, &state.constraints)) {
+        free(sequence);
+        free(sorted_starters);
+        return;
+    }
+    state.chef = chef;
+    state.params = params;
+    state.output_buffer = output_buffer;
+    state.emitted = (Pvoid_t)NULL;
+    state.starters = sorted_starters;
+    state.starter_count = starter_count_local;
+    state.tier_thresholds = tier_thresholds;
+    state.tier_buffers = tier_buffers;
+    state.tier_count = tier_count;
+    state.commuted = buildCommutedRules(chef, params, &state.constraints, sorted_starters,
+                                        getStarterLimit(params->limit_unigrams, starter_count_local));
+
+    // Without a probability threshold there is nothing to prune, the enumerator walks the chains directly
+    RuleEnumerator *enumerator = createRuleEnumerator(chef, params, &state.constraints, sorted_starters,
+                                                      getStarterLimit(params->limit_unigrams, starter_count_local),
+                                                      state.commuted);
+    if (verbose && enumerator != NULL) {
+        fprintf(stderr, "Using exhaustive enumeration\n");
+    }
+
     // Generate rules of each length
     long last_write = 0;
-    for (int target_length = min_length; target_length <= max_length; target_length++) {
+    for (int target_length = min_length; target_length <= max_length && !generationStopped(params); target_length++) {
         if (verbose) {
             fprintf(stderr, "Processing rules of length %d...\n", target_length);
         }
 
-        generateRules(sequence, 0, target_length, target_length,
-                     min_length, min_probability, 1.0, verbose,
-                     sorted_starters, starter_count_local, output_buffer,
-                     limit_unigrams);
+        if (enumerator != NULL) {
+            enumerateRules(enumerator, target_length, output_buffer);
+        } else {
+            generateRules(&state, sequence, 0, target_length, 1.0);
+        }
 
         flush_buffer(output_buffer);
+        for (int t = 0; t < tier_count; t++) {
+            flush_buffer(&tier_buffers[t]);
+        }
 
         if (verbose) {
+            size_t written = generationWriteCount(&state);
             fprintf(stderr, "Completed length %d %zu|%zu\n",
-                    target_length, output_buffer->writeCount-last_write, output_buffer->writeCount);
-            last_write = output_buffer->writeCount;
+                    target_length, written - last_write, written);
+            last_write = written;
         }
     }
 
     // Cleanup
+    Word_t freed;
+    JSLFA(freed, state.emitted);
+    (void)freed;
+    freeCommutedRules(state.commuted);
+    freeRuleEnumerator(enumerator);
     free(sequence);
     free(sorted_starters);
 
     if (verbose) {
         fprintf(stderr, "Generation complete. Total rules: %zu\n",
-                output_buffer->writeCount);
+                generationWriteCount(&state));
     }
 }
 
-OperationNGram *getSortedStarterOperationsFromHT(int *count, double limit_unigrams) {
+void generateRulesFromHT(RuleChef *chef, const RuleChefParams *params, WBuffer *output_buffer) {
+    generateRulesInto(chef, params, output_buffer, NULL, NULL, 0);
+}
+
+void generateTieredRules(RuleChef *chef, const RuleChefParams *params, const double *thresholds,
+                         WBuffer *tier_buffers, int tier_count) {
+    generateRulesInto(chef, params, &tier_buffers[tier_count - 1], thresholds, tier_buffers, tier_count);
+}
+
+OperationNGram *getSortedStarterOperationsFromHT(RuleChef *chef, int *count, double limit_unigrams) {
     long total_starter_freq = 0;
     long full_NGramWidth = 0;
+    NGramIterator it;
+    NGramHashNode *node;
 
-    for (int i = 0; i < STARTER_HASH_SIZE; i++) {
-        NGramHashNode *node = starter_hash_table[i];
-        while (node != NULL) {
-            if (node->ngram.op_count == 1) {
-                total_starter_freq += node->ngram.frequency;
-            }
-            node = node->next;
+    initNGramIterator(&it, &chef->starter_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count == 1) {
+            total_starter_freq += node->ngram.frequency;
         }
     }
 
-    for (int i = 0; i < UNIGRAM_HASH_SIZE; i++) {
-        NGramHashNode *node = unigram_hash_table[i];
-        while (node != NULL) {
-            if (node->ngram.op_count == 1) {
-                full_NGramWidth++;
-            }
-            node = node->next;
+    initNGramIterator(&it, &chef->unigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        if (node->ngram.op_count == 1) {
+            full_NGramWidth++;
         }
     }
 
@@ -527,38 +789,29 @@ OperationNGram *getSortedStarterOperationsFromHT(int *count, double limit_unigra
 
     int index = 0;
 
-        for (int i = 0; i < UNIGRAM_HASH_SIZE; i++) {
-        NGramHashNode *unigram_node = unigram_hash_table[i];
-        while (unigram_node != NULL && index < full_NGramWidth) {
-            if (unigram_node->ngram.op_count == 1) {
-
-                int starter_freq = 0;
-                unsigned int hash_index = hashNGram(&unigram_node->ngram.ops[0], 1, STARTER_HASH_SIZE);
-                NGramHashNode *starter_node = starter_hash_table[hash_index];
-
-                while (starter_node != NULL) {
-                    if (starter_node->ngram.op_count == 1 &&
-                        compareCompleteOps(&starter_node->ngram.ops[0],
-                                         &unigram_node->ngram.ops[0])) {
-                        starter_freq = starter_node->ngram.frequency;
-                        break;
-                    }
-                    starter_node = starter_node->next;
-                }
+    NGramHashNode *unigram_node;
+    initNGramIterator(&it, &chef->unigram_hash_table);
+    while ((unigram_node = nextNGram(&it)) != NULL && index < full_NGramWidth) {
+        if (unigram_node->ngram.op_count == 1) {
+
+            long starter_freq = 0;
+            NGramHashNode *starter_node = findNGramInTable(&chef->starter_hash_table, &unigram_node->ngram.ops[0], 1);
+            if (starter_node != NULL) {
+                starter_freq = starter_node->ngram.frequency;
+            }
 
-                double smoothed_prob = (double)(starter_freq + K_SMOOTHING_FACTOR) /
-                                     (total_starter_freq + K_SMOOTHING_FACTOR * full_NGramWidth);
+            double smoothed_prob = (double)(starter_freq + K_SMOOTHING_FACTOR) /
+                                 (total_starter_freq + K_SMOOTHING_FACTOR * full_NGramWidth);
 
-                starters[index] = unigram_node->ngram;
-                starters[index].frequency = (int)(smoothed_prob * 1000000);
+            starters[index] = unigram_node->ngram;
+            starters[index].frequency = (int)(smoothed_prob * 1000000);
+            starters[index].probability = smoothed_prob;
 
-                index++;
-            }
-            unigram_node = unigram_node->next;
+            index++;
         }
     }
 
-    qsort(starters, index, sizeof(OperationNGram), compareNGramsByFrequency);
+    qsort(starters, index, sizeof(OperationNGram), compareNGramsByProbability);
 
     *count = index;
     if (limit_unigrams > 1 && limit_unigrams < *count) {
@@ -568,37 +821,196 @@ OperationNGram *getSortedStarterOperationsFromHT(int *count, double limit_unigra
     return starters;
 }
 
-long getBigramCountFromHashTable()
+long getBigramCountFromHashTable(RuleChef *chef)
 {
-    long count = 0;
-    for (int i = 0; i < max_operation_count[2]; i++)
-    {
-        NGramHashNode *node = bigram_hash_table[i];
-        while (node != NULL)
-        {
-            if (node->ngram.op_count == 2)
-            {
-                count++;
-            }
-            node = node->next;
+    return chef->bigram_hash_table.count;
+}
+
+// The rows live in the lookup arena, rewinding it releases them all and keeps the blocks for the next build
+void freeLookupTable(RuleChef *chef)
+{
+    ArenaMark empty = {NULL, 0};
+    Word_t freed;
+
+    JSLFA(freed, chef->lookup_index);
+    (void)freed;
+    arenaReset(&chef->lookup_arena, empty);
+    chef->fast_lookup = NULL;
+    chef->fast_lookup_count = 0;
+    chef->max_transition_count = 0;
+}
+
+// Suspended depth first traversal, one frame per op in the current chain
+typedef struct {
+    FastTransitionLookup *lookup;   // Transitions out of the op at this depth
+    int next;                       // Next transition to try
+    double probability;             // Chain probability up to and including this op
+} IteratorFrame;
+
+// Rules are produced in the same order as generateRulesFromHT: for each target length the
+// tree is walked again and only chains of exactly that length are emitted, so nothing repeats
+struct RuleChefIterator {
+    RuleChef *chef;
+    RuleChefParams params;
+    OperationNGram *starters;
+    int starter_count;
+    int starter_index;
+    int target_length;
+    int depth;
+    int done;
+    CompleteOperation sequence[MAX_RULE_LEN];
+    IteratorFrame frames[MAX_RULE_LEN + 1];
+    char rule[MAX_RULE_LEN];
+    int rule_length;
+    int unread;                     // Return the last rule again on the next call
+    RuleConstraints constraints;
+    int bytes[MAX_RULE_LEN + 1];    // Rule bytes up to each depth
+    void *commuted;                 // Two op rules -s skips
+};
+
+RuleChefIterator *createRuleIterator(RuleChef *chef, const RuleChefParams *params) {
+    RuleChefIterator *it = calloc(1, sizeof(RuleChefIterator));
+    if (it == NULL) {
+        fprintf(stderr, "Failed to allocate rule iterator\n");
+        return NULL;
+    }
+    it->chef = chef;
+    it->params = *params;
+    if (!compileConstraints(params, &it->constraints)) {
+        free(it);
+        return NULL;
+    }
+
+    int starter_count = 0;
+    it->starters = getGenerationStarters(chef, params, &starter_count);
+    if (it->starters == NULL) {
+        free(it);
+        return NULL;
+    }
+    it->starter_count = getStarterLimit(params->limit_unigrams, starter_count);
+    it->commuted = buildCommutedRules(chef, params, &it->constraints, it->starters, it->starter_count);
+    it->target_length = params->min_length;
+    if (it->target_length > MAX_RULE_LEN) {
+        it->done = 1;
+    }
+    return it;
+}
+
+void freeRuleIterator(RuleChefIterator *it) {
+    if (it != NULL) {
+        freeCommutedRules(it->commuted);
+        free(it->starters);
+        free(it);
+    }
+}
+
+// Writes the current chain as a rule string, returns its length
+static int formatIteratorRule(RuleChefIterator *it, char *rule) {
+    int total_len = 0;
+    rule[0] = '\0';
+    for (int i = 0; i < it->depth; i++) {
+        int op_len = strlen(it->sequence[i].full_op);
+        if (total_len + op_len >= MAX_RULE_LEN - 1) {
+            break;
         }
+        memcpy(rule + total_len, it->sequence[i].full_op, op_len + 1);
+        total_len += op_len;
     }
-    return count;
+    return total_len;
 }
 
-void freeLookupTable(void)
-{
-    if (fast_lookup != NULL)
-    {
-        for (int i = 0; i < fast_lookup_count; i++)
-        {
-            if (fast_lookup[i].sorted_transitions != NULL)
-            {
-                free(fast_lookup[i].sorted_transitions);
+// Pushes op onto the chain, returns 1 when the chain has reached the target length
+static int pushIteratorOperation(RuleChefIterator *it, const CompleteOperation *op, double probability) {
+    it->sequence[it->depth++] = *op;
+    it->bytes[it->depth] = it->bytes[it->depth - 1] + op->length;
+    if (it->depth == it->target_length) {
+        return 1;
+    }
+    IteratorFrame *frame = &it->frames[it->depth];
+    frame->lookup = findTransitionLookup(it->chef, op);
+    frame->next = 0;
+    frame->probability = probability;
+    return 0;
+}
+
+// Resumes the traversal until the next rule, which stays valid until the following call
+// Returns the rule length, or -1 once every length has been walked
+int nextIteratorRule(RuleChefIterator *it, const char **rule) {
+    double min_probability = it->params.min_probability;
+
+    *rule = it->rule;
+    if (it->unread) {
+        it->unread = 0;
+        return it->rule_length;
+    }
+
+    while (!it->done) {
+        const CompleteOperation *op;
+        double probability;
+
+        if (it->depth == 0) {
+            // Next starter, or the next target length when the starters are exhausted
+            if (it->starter_index >= it->starter_count) {
+                it->starter_index = 0;
+                it->target_length++;
+                if (it->target_length > it->params.max_length || it->target_length > MAX_RULE_LEN) {
+                    it->done = 1;
+                }
+                continue;
+            }
+
+            OperationNGram *starter = &it->starters[it->starter_index++];
+            probability = it->params.joint ? starter->probability : 1.0;
+            if (min_probability > 0.0 && probability < min_probability) {
+                // Starters are sorted, so every later one fails as well
+                it->starter_index = it->starter_count;
+                continue;
             }
+            op = &starter->ops[0];
+        } else {
+            IteratorFrame *frame = &it->frames[it->depth];
+            FastTransitionLookup *lookup = frame->lookup;
+
+            if (lookup == NULL || lookup->sorted_transitions == NULL || frame->next >= lookup->transition_count) {
+                it->depth--;
+                continue;
+            }
+
+            SortedTransition *transition = &lookup->sorted_transitions[frame->next++];
+            probability = frame->probability * transition->probability;
+            if (min_probability > 0.0 && probability < min_probability) {
+                // Transitions are sorted, the rest of this row is below the threshold too
+                frame->next = lookup->transition_count;
+                continue;
+            }
+            if (transition->next_op == NULL) {
+                continue;
+            }
+            if (it->params.simplify && isRedundantTransition(&it->sequence[it->depth - 1], transition->next_op)) {
+                continue;
+            }
+            op = transition->next_op;
+        }
+
+        if (it->constraints.active &&
+            !constraintAllowsOp(&it->constraints, op, it->depth, it->bytes[it->depth], it->target_length)) {
+            continue;
+        }
+
+        if (pushIteratorOperation(it, op, probability)) {
+            if ((it->constraints.active && !constraintAllowsChain(&it->constraints, it->sequence, it->depth)) ||
+                isCommutedRule(it->commuted, it->sequence, it->depth)) {
+                it->depth--;
+                continue;
+            }
+            it->rule_length = formatIteratorRule(it, it->rule);
+            it->depth--;
+            return it->rule_length;
         }
-        free(fast_lookup);
-        fast_lookup = NULL;
-        fast_lookup_count = 0;
     }
+    return -1;
+}
+
+void unreadIteratorRule(RuleChefIterator *it) {
+    it->unread = 1;
 }
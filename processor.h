@@ -1,12 +1,47 @@
 #include "types.h"
+#include "constraints.h"
 
 #ifndef processor_H
 #define processor_H
 
 extern long curr_transition_size;
 
-//void generateRulesFromHT(int max_length, int min_length,double min_probability, int verbose,WBuffer *output_buffer,double limit_unigrams);
-void generateRulesFromHT(int max_length, int min_length, double min_probability, int verbose,
-                        WBuffer *output_buffer, long limit_unigrams);
-OperationNGram *getSortedStarterOperationsFromHT(int *count, double limit_unigrams);
+// Lookup table of sorted transitions per operation, built once the bigram probabilities are known
+void buildLookupTable(RuleChef *chef, int verbose);
+void freeLookupTable(RuleChef *chef);
+FastTransitionLookup *findTransitionLookup(RuleChef *chef, const CompleteOperation *op);
+
+// Set of two op rules -s skips because the model also writes their ops in the canonical order, NULL when
+// there are none to skip. starters are the sorted generation starters, count already limited by -l
+void *buildCommutedRules(RuleChef *chef, const RuleChefParams *params, const RuleConstraints *constraints,
+                         const OperationNGram *starters, int starter_count);
+int isCommutedRule(void *commuted, const CompleteOperation *ops, int length);
+void freeCommutedRules(void *commuted);
+
+// Records that first, second is written, so second, first is skipped when the two ops commute
+void addCommutedRule(void **commuted, const CompleteOperation *first, const CompleteOperation *second);
+
+// Set through params->stop, the generators poll it and return early
+static inline int generationStopped(const RuleChefParams *params) {
+    return params->stop != NULL && *params->stop;
+}
+
+// Starting operations as generation uses them, sorted by probability
+OperationNGram *getGenerationStarters(RuleChef *chef, const RuleChefParams *params, int *count);
+int getStarterLimit(double limit_unigrams, int starter_count);
+
+// Writes every chain allowed by params to output_buffer, safe to call from several threads at once
+void generateRulesFromHT(RuleChef *chef, const RuleChefParams *params, WBuffer *output_buffer);
+
+// One pass at params->min_probability, each rule goes to the buffer of the highest threshold it reaches
+// thresholds are descending and the last one should be params->min_probability
+void generateTieredRules(RuleChef *chef, const RuleChefParams *params, const double *thresholds,
+                         WBuffer *tier_buffers, int tier_count);
+OperationNGram *getSortedStarterOperationsFromHT(RuleChef *chef, int *count, double limit_unigrams);
+
+// Pull based generation with constant memory, yields the same rules in the same order
+RuleChefIterator *createRuleIterator(RuleChef *chef, const RuleChefParams *params);
+int nextIteratorRule(RuleChefIterator *it, const char **rule);
+void unreadIteratorRule(RuleChefIterator *it);
+void freeRuleIterator(RuleChefIterator *it);
 #endif
@@ -0,0 +1,47 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+// xoshiro256** seeded through splitmix64
+typedef struct {
+    uint64_t s[4];
+} SampleRandom;
+
+static inline uint64_t splitMix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline void seedRandom(SampleRandom *rng, uint64_t seed, uint64_t stream) {
+    uint64_t state = seed ^ (stream * 0xd1342543de82ef95ULL);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitMix64(&state);
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t nextRandom(SampleRandom *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Uniform in [0, 1) with 53 bits
+static inline double nextUniform(SampleRandom *rng) {
+    return (nextRandom(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
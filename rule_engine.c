@@ -0,0 +1,327 @@
+#include "rule_engine.h"
+
+// Ops whose parameters are positions (0-9, A-Z) rather than literal characters
+static const char PositionalR[] = "TpDzZ'LR+-.,yY<>xO*X";
+
+#define IS_UPPER(c) ((c) >= 'A' && (c) <= 'Z')
+#define IS_LOWER(c) ((c) >= 'a' && (c) <= 'z')
+#define TO_LOWER(c) (IS_UPPER(c) ? (char)((c) + 32) : (c))
+#define TO_UPPER(c) (IS_LOWER(c) ? (char)((c) - 32) : (c))
+#define TOGGLE(c) (IS_UPPER(c) ? (char)((c) + 32) : IS_LOWER(c) ? (char)((c) - 32) : (c))
+
+static int convPosition(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
+    return -1;
+}
+
+// Convert parsed operations into a form that can be applied to many words without re-parsing
+// Returns 0 if the rule uses an operation the engine does not implement
+int compileRule(const CompleteOperation *ops, int op_count, CompiledOperation *compiled) {
+    for (int i = 0; i < op_count; i++) {
+        const CompleteOperation *op = &ops[i];
+        CompiledOperation *c = &compiled[i];
+        unsigned char params[3] = {0, 0, 0};
+
+        switch (op->base_op) {
+            case ':': case 'l': case 'u': case 'c': case 'C': case 't': case 'r': case 'd':
+            case 'f': case '{': case '}': case '[': case ']': case 'k': case 'K': case 'q':
+            case 'E': case 'M': case '4': case '6': case 'Q':
+            case 'T': case 'p': case 'D': case 'z': case 'Z': case '\'': case 'L': case 'R':
+            case '+': case '-': case '.': case ',': case 'y': case 'Y': case '<': case '>':
+            case '$': case '^': case '@': case '!': case '/': case '(': case ')': case 'e':
+            case 's': case 'i': case 'o': case '=': case '%': case '3':
+            case 'x': case 'O': case '*': case 'X':
+                break;
+            default:
+                return 0;
+        }
+
+        for (int p = 1; p < op->length; p++) {
+            char param = op->full_op[p];
+            int positional = strchr(PositionalR, op->base_op) != NULL ||
+                             (p == 1 && strchr("io=%3", op->base_op) != NULL);
+            if (positional) {
+                int pos = convPosition(param);
+                if (pos < 0) return 0;
+                params[p - 1] = (unsigned char)pos;
+            } else {
+                params[p - 1] = (unsigned char)param;
+            }
+        }
+
+        c->op = op->base_op;
+        c->p1 = params[0];
+        c->p2 = params[1];
+        c->p3 = params[2];
+    }
+    return 1;
+}
+
+// Apply a compiled rule to word, follows hashcat semantics where an out of range op leaves the word unchanged
+// Returns the length of the result written to out, or RULE_REJECTED
+int applyCompiledRule(const CompiledOperation *ops, int op_count, const char *word, int word_len, char *out) {
+    char mem[RULE_WORD_MAX];
+    int mem_len = 0;
+    int len = word_len;
+    int i, j;
+
+    if (len >= RULE_WORD_MAX) return RULE_REJECTED;
+    memcpy(out, word, len);
+
+    for (int n = 0; n < op_count; n++) {
+        const CompiledOperation *c = &ops[n];
+        int p1 = c->p1;
+        int p2 = c->p2;
+        char tmp;
+
+        switch (c->op) {
+            case ':':
+                break;
+            case 'l':
+                for (i = 0; i < len; i++) out[i] = TO_LOWER(out[i]);
+                break;
+            case 'u':
+                for (i = 0; i < len; i++) out[i] = TO_UPPER(out[i]);
+                break;
+            case 'c':
+                for (i = 0; i < len; i++) out[i] = TO_LOWER(out[i]);
+                if (len > 0) out[0] = TO_UPPER(out[0]);
+                break;
+            case 'C':
+                for (i = 0; i < len; i++) out[i] = TO_UPPER(out[i]);
+                if (len > 0) out[0] = TO_LOWER(out[0]);
+                break;
+            case 't':
+                for (i = 0; i < len; i++) out[i] = TOGGLE(out[i]);
+                break;
+            case 'T':
+                if (p1 < len) out[p1] = TOGGLE(out[p1]);
+                break;
+            case 'E':
+                for (i = 0; i < len; i++) {
+                    out[i] = (i == 0 || out[i - 1] == ' ') ? TO_UPPER(out[i]) : TO_LOWER(out[i]);
+                }
+                break;
+            case 'e':
+                for (i = 0; i < len; i++) {
+                    out[i] = (i == 0 || out[i - 1] == (char)p1) ? TO_UPPER(out[i]) : TO_LOWER(out[i]);
+                }
+                break;
+            case '3': {
+                int seen = 0;
+                for (i = 0; i < len - 1; i++) {
+                    if (out[i] == (char)p2 && seen++ == p1) {
+                        out[i + 1] = TOGGLE(out[i + 1]);
+                        break;
+                    }
+                }
+                break;
+            }
+            case 'r':
+                for (i = 0, j = len - 1; i < j; i++, j--) {
+                    tmp = out[i]; out[i] = out[j]; out[j] = tmp;
+                }
+                break;
+            case 'd':
+                if (len * 2 >= RULE_WORD_MAX) break;
+                memcpy(out + len, out, len);
+                len *= 2;
+                break;
+            case 'p':
+                if (len * (p1 + 1) >= RULE_WORD_MAX) break;
+                for (i = 1; i <= p1; i++) memcpy(out + len * i, out, len);
+                len *= (p1 + 1);
+                break;
+            case 'f':
+                if (len * 2 >= RULE_WORD_MAX) break;
+                for (i = 0; i < len; i++) out[len + i] = out[len - 1 - i];
+                len *= 2;
+                break;
+            case '{':
+                if (len < 2) break;
+                tmp = out[0];
+                memmove(out, out + 1, len - 1);
+                out[len - 1] = tmp;
+                break;
+            case '}':
+                if (len < 2) break;
+                tmp = out[len - 1];
+                memmove(out + 1, out, len - 1);
+                out[0] = tmp;
+                break;
+            case '$':
+                if (len + 1 >= RULE_WORD_MAX) break;
+                out[len++] = (char)p1;
+                break;
+            case '^':
+                if (len + 1 >= RULE_WORD_MAX) break;
+                memmove(out + 1, out, len);
+                out[0] = (char)p1;
+                len++;
+                break;
+            case '[':
+                if (len == 0) break;
+                memmove(out, out + 1, len - 1);
+                len--;
+                break;
+            case ']':
+                if (len > 0) len--;
+                break;
+            case 'D':
+                if (p1 >= len) break;
+                memmove(out + p1, out + p1 + 1, len - p1 - 1);
+                len--;
+                break;
+            case 'x':
+                if (p1 >= len || p1 + p2 > len) break;
+                memmove(out, out + p1, p2);
+                len = p2;
+                break;
+            case 'O':
+                if (p1 >= len || p1 + p2 > len) break;
+                memmove(out + p1, out + p1 + p2, len - p1 - p2);
+                len -= p2;
+                break;
+            case 'i':
+                if (p1 > len || len + 1 >= RULE_WORD_MAX) break;
+                memmove(out + p1 + 1, out + p1, len - p1);
+                out[p1] = (char)p2;
+                len++;
+                break;
+            case 'o':
+                if (p1 < len) out[p1] = (char)p2;
+                break;
+            case '\'':
+                if (p1 < len) len = p1;
+                break;
+            case 's':
+                for (i = 0; i < len; i++) {
+                    if (out[i] == (char)p1) out[i] = (char)p2;
+                }
+                break;
+            case '@':
+                for (i = 0, j = 0; i < len; i++) {
+                    if (out[i] != (char)p1) out[j++] = out[i];
+                }
+                len = j;
+                break;
+            case 'z':
+                if (len == 0 || len + p1 >= RULE_WORD_MAX) break;
+                memmove(out + p1, out, len);
+                memset(out, out[p1], p1);
+                len += p1;
+                break;
+            case 'Z':
+                if (len == 0 || len + p1 >= RULE_WORD_MAX) break;
+                memset(out + len, out[len - 1], p1);
+                len += p1;
+                break;
+            case 'q':
+                if (len * 2 >= RULE_WORD_MAX) break;
+                for (i = len - 1; i >= 0; i--) {
+                    out[i * 2] = out[i];
+                    out[i * 2 + 1] = out[i];
+                }
+                len *= 2;
+                break;
+            case 'k':
+                if (len < 2) break;
+                tmp = out[0]; out[0] = out[1]; out[1] = tmp;
+                break;
+            case 'K':
+                if (len < 2) break;
+                tmp = out[len - 2]; out[len - 2] = out[len - 1]; out[len - 1] = tmp;
+                break;
+            case '*':
+                if (p1 >= len || p2 >= len) break;
+                tmp = out[p1]; out[p1] = out[p2]; out[p2] = tmp;
+                break;
+            case 'L':
+                if (p1 < len) out[p1] = (char)((unsigned char)out[p1] << 1);
+                break;
+            case 'R':
+                if (p1 < len) out[p1] = (char)((unsigned char)out[p1] >> 1);
+                break;
+            case '+':
+                if (p1 < len) out[p1]++;
+                break;
+            case '-':
+                if (p1 < len) out[p1]--;
+                break;
+            case '.':
+                if (p1 + 1 < len) out[p1] = out[p1 + 1];
+                break;
+            case ',':
+                if (p1 > 0 && p1 < len) out[p1] = out[p1 - 1];
+                break;
+            case 'y':
+                if (p1 > len || len + p1 >= RULE_WORD_MAX) break;
+                memmove(out + p1, out, len);
+                len += p1;
+                break;
+            case 'Y':
+                if (p1 > len || len + p1 >= RULE_WORD_MAX) break;
+                memcpy(out + len, out + len - p1, p1);
+                len += p1;
+                break;
+            case 'M':
+                memcpy(mem, out, len);
+                mem_len = len;
+                break;
+            case '4':
+                if (len + mem_len >= RULE_WORD_MAX) break;
+                memcpy(out + len, mem, mem_len);
+                len += mem_len;
+                break;
+            case '6':
+                if (len + mem_len >= RULE_WORD_MAX) break;
+                memmove(out + mem_len, out, len);
+                memcpy(out, mem, mem_len);
+                len += mem_len;
+                break;
+            case 'X':
+                if (p1 + p2 > mem_len || c->p3 > len || len + p2 >= RULE_WORD_MAX) break;
+                memmove(out + c->p3 + p2, out + c->p3, len - c->p3);
+                memcpy(out + c->p3, mem + p1, p2);
+                len += p2;
+                break;
+            case 'Q':
+                if (len == mem_len && memcmp(out, mem, len) == 0) return RULE_REJECTED;
+                break;
+            case '<':
+                if (len > p1) return RULE_REJECTED;
+                break;
+            case '>':
+                if (len < p1) return RULE_REJECTED;
+                break;
+            case '!':
+                if (memchr(out, p1, len) != NULL) return RULE_REJECTED;
+                break;
+            case '/':
+                if (memchr(out, p1, len) == NULL) return RULE_REJECTED;
+                break;
+            case '(':
+                if (len == 0 || out[0] != (char)p1) return RULE_REJECTED;
+                break;
+            case ')':
+                if (len == 0 || out[len - 1] != (char)p1) return RULE_REJECTED;
+                break;
+            case '=':
+                if (p1 >= len || out[p1] != (char)p2) return RULE_REJECTED;
+                break;
+            case '%': {
+                int found = 0;
+                for (i = 0; i < len; i++) {
+                    if (out[i] == (char)p2) found++;
+                }
+                if (found < p1) return RULE_REJECTED;
+                break;
+            }
+            default:
+                return RULE_REJECTED;
+        }
+    }
+
+    return len;
+}
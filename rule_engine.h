@@ -0,0 +1,24 @@
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include "types.h"
+
+// Longest word a rule is allowed to produce (matches hashcat's block size)
+#define RULE_WORD_MAX 256
+
+// Return codes for applyCompiledRule
+#define RULE_REJECTED -1
+
+// An operation with its positional parameters already converted
+typedef struct {
+    char op;
+    unsigned char p1;
+    unsigned char p2;
+    unsigned char p3;
+} CompiledOperation;
+
+// Rule engine functions
+int compileRule(const CompleteOperation *ops, int op_count, CompiledOperation *compiled);
+int applyCompiledRule(const CompiledOperation *ops, int op_count, const char *word, int word_len, char *out);
+
+#endif
@@ -6,12 +6,17 @@ char DoubleR[] = "Tp$^DzZ@<>!/()I+-,.RYyL'e";
 char TripleR[] = "ios=mvSW3*xO%";
 char QuadR[] = "XF\\";
 
+// Operation classes used to spot redundant chains
+char CaseR[] = "lucCEtT";       // Only change letter case, never length or position
+char AbsCaseR[] = "lucCE";      // Fully determine the case of every letter
+char SelfInverseR[] = "trkKT";  // Applying the identical op twice restores the word
+
 
 // Rule operation maps
 int RuleOPs[256] = {0};
 
-// Global buffer for output - declared extern in header
-extern WBuffer output_buffer;
+// Redundant transition map, indexed by [previous base_op][next base_op]
+unsigned char RulePairs[256][256] = {{0}};
 
 void initRuleMaps() {
     int i;
@@ -29,6 +34,66 @@ void initRuleMaps() {
     for (i = 0; i < (int)strlen(QuadR); i++) {
         RuleOPs[(int)QuadR[i]] = 4;
     }
+
+    initRulePairs();
+}
+
+static void setRulePair(char prev, char next, unsigned char rule) {
+    RulePairs[(unsigned char)prev][(unsigned char)next] = rule;
+}
+
+// Every pair flagged here produces a chain that is either equivalent to a shorter
+// chain or to the same ops in canonical order, so it never needs to be expanded
+void initRulePairs() {
+    int i, j;
+
+    // A case op is overridden by a later op that sets the case of every letter ("lu" == "u", "cc" == "c")
+    for (i = 0; i < (int)strlen(CaseR); i++) {
+        for (j = 0; j < (int)strlen(AbsCaseR); j++) {
+            setRulePair(CaseR[i], AbsCaseR[j], PAIR_REDUNDANT);
+        }
+    }
+
+    // Toggling after an absolute case op is another absolute case op ("lt" == "u", "ct" == "C")
+    setRulePair('l', 't', PAIR_REDUNDANT);
+    setRulePair('u', 't', PAIR_REDUNDANT);
+    setRulePair('c', 't', PAIR_REDUNDANT);
+    setRulePair('C', 't', PAIR_REDUNDANT);
+
+    // Self inverse ops cancel out when repeated with the same parameters ("tt", "rr", "T1T1")
+    for (i = 0; i < (int)strlen(SelfInverseR); i++) {
+        setRulePair(SelfInverseR[i], SelfInverseR[i], PAIR_SAME_OP);
+    }
+
+    // Inverse pairs
+    setRulePair('{', '}', PAIR_REDUNDANT);
+    setRulePair('}', '{', PAIR_REDUNDANT);
+    setRulePair('$', ']', PAIR_REDUNDANT);
+    setRulePair('^', '[', PAIR_REDUNDANT);
+
+    // Independent ops commute, a two op rule is only kept in the canonical order ("$1^2" not "^2$1") when
+    // the model produces that order too, see buildCommutedRules
+    setRulePair('^', '$', PAIR_COMMUTES);
+    setRulePair(']', '[', PAIR_COMMUTES);
+
+    // ':' is a no-op, it is only useful as a rule on its own
+    for (i = 0; i < 256; i++) {
+        RulePairs[(unsigned char)':'][i] = PAIR_REDUNDANT;
+        RulePairs[i][(unsigned char)':'] = PAIR_REDUNDANT;
+    }
+}
+
+// Returns 1 if following prev with next yields a reducible chain, commuting pairs are left to the model
+int isRedundantTransition(const CompleteOperation *prev, const CompleteOperation *next) {
+    unsigned char rule = RulePairs[(unsigned char)prev->base_op][(unsigned char)next->base_op];
+
+    if (rule == PAIR_REDUNDANT) {
+        return 1;
+    }
+    if (rule == PAIR_SAME_OP) {
+        return compareCompleteOps(prev, next);
+    }
+    return 0;
 }
 
 // Doesn't fully validate the rule, eg check whether positions are valid etc, or whether operations are valid
@@ -81,6 +146,48 @@ int validateRule(char *rule) {
     return 1;
 }
 
+// validateRule and parseRuleIntoOperations in a single pass over the line, for the analysis hot path
+// Spaces between ops are dropped and spaces inside an op's parameters kept, the packed rule is written
+// back to rule only when it differs. Returns 0, leaving rule untouched, when the rule is invalid
+int tokenizeRule(char *rule, ParsedRule *parsed) {
+    const unsigned char *src = (const unsigned char *)rule;
+    char *packed = parsed->original_rule;
+    int rule_len = strlen(rule);
+    int read_pos = 0;
+    int write_pos = 0;
+    int op_count = 0;
+
+    while (read_pos < rule_len) {
+        unsigned char op = src[read_pos];
+        if (op == ' ') {
+            read_pos++;
+            continue;
+        }
+
+        int op_length = RuleOPs[op];
+        if (op_length == 0 || read_pos + op_length > rule_len || write_pos + op_length > MAX_RULE_LEN - 1) {
+            return 0;
+        }
+
+        CompleteOperation *curr_op = &parsed->operations[op_count++];
+        curr_op->base_op = op;
+        curr_op->length = op_length;
+        memcpy(curr_op->full_op, rule + read_pos, op_length);
+        curr_op->full_op[op_length] = '\0';
+
+        memcpy(packed + write_pos, rule + read_pos, op_length);
+        write_pos += op_length;
+        read_pos += op_length;
+    }
+
+    packed[write_pos] = '\0';
+    parsed->op_count = op_count;
+    if (write_pos != rule_len) {
+        memcpy(rule, packed, write_pos + 1);
+    }
+    return 1;
+}
+
 int parseRuleIntoOperations(char *rule, ParsedRule *parsed) {
     int rule_len = strlen(rule);
     int i = 0;
@@ -92,20 +199,12 @@ int parseRuleIntoOperations(char *rule, ParsedRule *parsed) {
         int op_length = RuleOPs[(int)op];
 
         if (op_length == 0) {
-            if (output_buffer.buffer == NULL) {
-                printf("Invalid operation '%c' at position %d in rule: %s\n", op, i, rule);
-            } else {
-                fprintf(stderr, "Invalid operation '%c' at position %d in rule: %s\n", op, i, rule);
-            }
+            fprintf(stderr, "Invalid operation '%c' at position %d in rule: %s\n", op, i, rule);
             return 0;
         }
 
         if (i + op_length - 1 >= rule_len) {
-            if (output_buffer.buffer == NULL) {
-                printf("Not enough parameters for operation '%c' in rule: %s\n", op, rule);
-            } else {
-                fprintf(stderr, "Not enough parameters for operation '%c' in rule: %s\n", op, rule);
-            }
+            fprintf(stderr, "Not enough parameters for operation '%c' in rule: %s\n", op, rule);
             return 0;
         }
 
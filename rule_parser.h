@@ -13,10 +13,19 @@ extern char QuadR[];
 // Rule operation map
 extern int RuleOPs[256];
 
+// Redundant transition map
+#define PAIR_REDUNDANT 1
+#define PAIR_SAME_OP 2
+#define PAIR_COMMUTES 3
+extern unsigned char RulePairs[256][256];
+
 // Rule parsing and validation functions
 void initRuleMaps();
+void initRulePairs();
+int isRedundantTransition(const CompleteOperation *prev, const CompleteOperation *next);
 int validateRule(char *rule);
 int parseRuleIntoOperations(char *rule, ParsedRule *parsed);
+int tokenizeRule(char *rule, ParsedRule *parsed);
 int compareCompleteOps(const CompleteOperation *op1, const CompleteOperation *op2);
 int packrules(char *line);
 #endif
@@ -0,0 +1,472 @@
+#include "rulechef.h"
+#include "types.h"
+#include "buffer.h"
+#include "rule_parser.h"
+#include "hash_tables.h"
+#include "analysis.h"
+#include "processor.h"
+#include "input_stream.h"
+#include "sampler.h"
+#include "beam.h"
+#include "scorer.h"
+#include "evaluator.h"
+#include "trie.h"
+#include "model_file.h"
+#include "delta.h"
+#include "ngram_export.h"
+
+// Rule maps are read only after this, shared by every context
+static pthread_once_t rule_maps_once = PTHREAD_ONCE_INIT;
+
+RuleChef *rulechef_create(void) {
+    pthread_once(&rule_maps_once, initRuleMaps);
+
+    RuleChef *chef = calloc(1, sizeof(RuleChef));
+    if (chef == NULL) {
+        fprintf(stderr, "Failed to allocate rulechef context\n");
+        return NULL;
+    }
+    initHashTables(chef);
+    initArena(&chef->lookup_arena, 0);
+    pthread_mutex_init(&chef->lock, NULL);
+    return chef;
+}
+
+void rulechef_destroy(RuleChef *chef) {
+    if (chef == NULL) return;
+
+    freeLookupTable(chef);
+    freeArena(&chef->lookup_arena);
+    freeHashTables(chef);
+    pthread_mutex_destroy(&chef->lock);
+    free(chef);
+}
+
+// Only takes effect for bigrams counted afterwards, call it before analysing
+int rulechef_set_max_memory(RuleChef *chef, size_t bytes) {
+    return setBigramMemoryBudget(chef, bytes);
+}
+
+int rulechef_set_sort_counting(RuleChef *chef, int enabled) {
+    return setBigramSortCounting(chef, enabled);
+}
+
+// Affects blocks mapped from now on, blocks already in use keep their page size
+void rulechef_set_huge_pages(RuleChef *chef, int enabled) {
+    chef->model_arena.huge_pages = enabled;
+    chef->lookup_arena.huge_pages = enabled;
+}
+
+// The model changed, probabilities and the lookup table are rebuilt on the next generation
+static void invalidateModel(RuleChef *chef) {
+    pthread_mutex_lock(&chef->lock);
+    freeLookupTable(chef);
+    chef->finalized = 0;
+    pthread_mutex_unlock(&chef->lock);
+}
+
+void rulechef_set_pruning(RuleChef *chef, long min_count, int max_branch, int renormalize) {
+    invalidateModel(chef);
+    chef->min_count = min_count;
+    chef->max_branch = max_branch;
+    chef->renormalize = renormalize;
+}
+
+void rulechef_set_input_sampling(RuleChef *chef, double rate, long lines, unsigned long long seed) {
+    chef->input_sampling.rate = rate < 1.0 ? rate : 0.0;
+    chef->input_sampling.lines = lines;
+    chef->input_sampling.seed = seed;
+}
+
+void rulechef_reset(RuleChef *chef) {
+    invalidateModel(chef);
+    resetHashTables(chef);
+}
+
+int rulechef_analyse_file(RuleChef *chef, const char *path, int weighted, int verbose) {
+    RuleInput *input = openRuleInput(path);
+    if (input == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", path);
+        return 0;
+    }
+    if (verbose && isRuleInputCompressed(input)) {
+        fprintf(stderr, "Decompressing gzip input on a separate thread\n");
+    }
+
+    invalidateModel(chef);
+    int analysed = analyseRuleStream(chef, input, verbose, weighted);
+    int failed = ruleInputFailed(input);
+    closeRuleInput(input);
+    if (failed) {
+        fprintf(stderr, "Error: %s is truncated or unreadable, analysis is incomplete\n", path);
+        return -1;
+    }
+    if (!analysed) {
+        return -1;
+    }
+    return 1;
+}
+
+int rulechef_analyse_rule(RuleChef *chef, const char *rule, long weight) {
+    char line[MAX_RULE_LEN];
+    size_t length = strlen(rule);
+
+    if (weight <= 0 || length == 0 || length >= MAX_RULE_LEN) {
+        return 0;
+    }
+    memcpy(line, rule, length + 1);
+
+    invalidateModel(chef);
+    return analyseRule(chef, line, weight, 0);
+}
+
+void rulechef_finalize(RuleChef *chef, int verbose) {
+    pthread_mutex_lock(&chef->lock);
+    if (!chef->finalized) {
+        flushSortedBigrams(chef);
+        calculateBigramProbabilities(chef);
+        buildLookupTable(chef, verbose);
+        chef->finalized = 1;
+    }
+    pthread_mutex_unlock(&chef->lock);
+}
+
+void rulechef_default_params(RuleChefParams *params) {
+    params->min_length = 1;
+    params->max_length = 6;
+    params->min_probability = 0.0;
+    params->limit_unigrams = 0;
+    params->simplify = 0;
+    params->joint = 0;
+    params->verbose = 0;
+    params->deny_ops = NULL;
+    params->allow_ops = NULL;
+    params->prefix = NULL;
+    params->suffix = NULL;
+    params->max_bytes = 0;
+    params->stop = NULL;
+}
+
+long rulechef_generate(RuleChef *chef, const RuleChefParams *params, RuleChefSink sink, void *sink_arg) {
+    RuleChefParams defaults;
+    if (params == NULL) {
+        rulechef_default_params(&defaults);
+        params = &defaults;
+    }
+
+    rulechef_finalize(chef, params->verbose);
+
+    // Each call has its own buffer and dedup set, so generators never share mutable state
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return 0;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    generateRulesFromHT(chef, params, &output_buffer);
+    flush_buffer(&output_buffer);
+
+    long written = (long)output_buffer.writeCount;
+    free_buffer(&output_buffer);
+    return written;
+}
+
+long rulechef_generate_tiers(RuleChef *chef, const RuleChefParams *params, int count, const double *thresholds,
+                             RuleChefSink *sinks, void **sink_args, long *written) {
+    if (count <= 0) {
+        return -1;
+    }
+    for (int t = 0; t < count; t++) {
+        if (thresholds[t] <= 0.0 || thresholds[t] > 1.0 || (t > 0 && thresholds[t] >= thresholds[t - 1])) {
+            fprintf(stderr, "Error: tier thresholds must be strictly descending and between 0 and 1\n");
+            return -1;
+        }
+    }
+
+    RuleChefParams tiered;
+    if (params == NULL) {
+        rulechef_default_params(&tiered);
+    } else {
+        tiered = *params;
+    }
+    tiered.min_probability = thresholds[count - 1];
+
+    rulechef_finalize(chef, tiered.verbose);
+
+    WBuffer *tier_buffers = malloc(count * sizeof(WBuffer));
+    if (tier_buffers == NULL) {
+        fprintf(stderr, "Failed to allocate tier buffers\n");
+        return -1;
+    }
+    for (int t = 0; t < count; t++) {
+        if (!init_buffer(&tier_buffers[t])) {
+            while (t-- > 0) {
+                free_buffer(&tier_buffers[t]);
+            }
+            free(tier_buffers);
+            return -1;
+        }
+        tier_buffers[t].sink = sinks != NULL ? sinks[t] : NULL;
+        tier_buffers[t].sink_arg = sink_args != NULL ? sink_args[t] : NULL;
+    }
+
+    generateTieredRules(chef, &tiered, thresholds, tier_buffers, count);
+
+    long total = 0;
+    for (int t = 0; t < count; t++) {
+        flush_buffer(&tier_buffers[t]);
+        total += (long)tier_buffers[t].writeCount;
+        if (written != NULL) {
+            written[t] = (long)tier_buffers[t].writeCount;
+        }
+        free_buffer(&tier_buffers[t]);
+    }
+    free(tier_buffers);
+    return total;
+}
+
+int rulechef_save_model(RuleChef *chef, const char *path, int verbose) {
+    // Sort counted bigrams only reach the table when the model is finalized
+    rulechef_finalize(chef, 0);
+    return saveModelFile(chef, path, verbose);
+}
+
+int rulechef_load_model(RuleChef *chef, const char *path, int verbose) {
+    invalidateModel(chef);
+    return loadModelFile(chef, path, verbose);
+}
+
+long rulechef_generate_delta(RuleChef *chef, RuleChef *previous, const RuleChefParams *params,
+                             RuleChefSink sink, void *sink_arg) {
+    RuleChefParams defaults;
+    if (params == NULL) {
+        rulechef_default_params(&defaults);
+        params = &defaults;
+    }
+
+    rulechef_finalize(chef, params->verbose);
+    rulechef_finalize(previous, 0);
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return 0;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    long written = generateDeltaRules(chef, previous, params, &output_buffer);
+    flush_buffer(&output_buffer);
+    free_buffer(&output_buffer);
+    return written;
+}
+
+long rulechef_beam(RuleChef *chef, const RuleChefParams *params, long width, RuleChefSink sink, void *sink_arg) {
+    RuleChefParams defaults;
+    if (params == NULL) {
+        rulechef_default_params(&defaults);
+        params = &defaults;
+    }
+
+    rulechef_finalize(chef, params->verbose);
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return 0;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    long written = generateBeamRules(chef, params, width, &output_buffer);
+    free_buffer(&output_buffer);
+    return written;
+}
+
+long rulechef_sample(RuleChef *chef, const RuleChefParams *params, const RuleChefSampleParams *sample,
+                     RuleChefSink sink, void *sink_arg) {
+    RuleChefParams defaults;
+    if (params == NULL) {
+        rulechef_default_params(&defaults);
+        params = &defaults;
+    }
+
+    rulechef_finalize(chef, params->verbose);
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return 0;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    long written = sampleRules(chef, params, sample, &output_buffer);
+    free_buffer(&output_buffer);
+    return written;
+}
+
+RuleChefIterator *rulechef_iterator_create(RuleChef *chef, const RuleChefParams *params) {
+    RuleChefParams defaults;
+    if (params == NULL) {
+        rulechef_default_params(&defaults);
+        params = &defaults;
+    }
+
+    rulechef_finalize(chef, params->verbose);
+    return createRuleIterator(chef, params);
+}
+
+void rulechef_iterator_destroy(RuleChefIterator *it) {
+    freeRuleIterator(it);
+}
+
+const char *rulechef_iterator_next(RuleChefIterator *it) {
+    const char *rule;
+    return nextIteratorRule(it, &rule) < 0 ? NULL : rule;
+}
+
+long rulechef_iterator_next_batch(RuleChefIterator *it, char *buffer, size_t size, long max_rules, size_t *used) {
+    const char *rule;
+    size_t offset = 0;
+    long count = 0;
+    int length;
+
+    while (count < max_rules && (length = nextIteratorRule(it, &rule)) >= 0) {
+        if (offset + length + 1 > size) {
+            // Keep it for the next batch
+            unreadIteratorRule(it);
+            break;
+        }
+        memcpy(buffer + offset, rule, length);
+        buffer[offset + length] = '\n';
+        offset += length + 1;
+        count++;
+    }
+
+    if (used != NULL) {
+        *used = offset;
+    }
+    return count;
+}
+
+double rulechef_score_rule(RuleChef *chef, const char *rule) {
+    rulechef_finalize(chef, 0);
+    return scoreRule(chef, rule);
+}
+
+long rulechef_score_file(RuleChef *chef, const char *path, int sorted, int threads, size_t sort_memory,
+                         int verbose, RuleChefSink sink, void *sink_arg) {
+    rulechef_finalize(chef, verbose);
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return -1;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    long written = scoreRuleFile(chef, path, sorted, threads, sort_memory, verbose, &output_buffer);
+    free_buffer(&output_buffer);
+    return written;
+}
+
+RuleChefEval *rulechef_eval_create(void) {
+    return createEvalSet();
+}
+
+void rulechef_eval_destroy(RuleChefEval *eval) {
+    freeEvalSet(eval);
+}
+
+int rulechef_eval_add_file(RuleChefEval *eval, const char *path, int weighted, int verbose) {
+    return addEvalFile(eval, path, weighted, verbose);
+}
+
+void rulechef_set_holdout(RuleChef *chef, RuleChefEval *eval, double ratio, unsigned long long seed) {
+    chef->holdout = eval;
+    chef->holdout_ratio = ratio;
+    chef->holdout_state = seed;
+}
+
+void rulechef_eval_sink(void *eval, const char *data, size_t len) {
+    countEvalRules((RuleChefEval *)eval, data, len);
+}
+
+void rulechef_eval_report(RuleChef *chef, RuleChefEval *eval, RuleChefSink sink, void *sink_arg) {
+    rulechef_finalize(chef, 0);
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        return;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    writeEvalReport(chef, eval, &output_buffer);
+    flush_buffer(&output_buffer);
+    free_buffer(&output_buffer);
+}
+
+void rulechef_eval_rewind(RuleChefEval *eval) {
+    rewindEvalSet(eval);
+}
+
+RuleChefTrieWriter *rulechef_trie_create(RuleChefSink sink, void *sink_arg) {
+    pthread_once(&rule_maps_once, initRuleMaps);
+    return createTrieWriter(sink, sink_arg);
+}
+
+void rulechef_trie_sink(void *writer, const char *data, size_t len) {
+    writeTrieRules((RuleChefTrieWriter *)writer, data, len);
+}
+
+long rulechef_trie_close(RuleChefTrieWriter *writer, int verbose) {
+    return closeTrieWriter(writer, verbose);
+}
+
+long rulechef_expand(const char *path, RuleChefSink sink, void *sink_arg) {
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", path);
+        return -1;
+    }
+
+    WBuffer output_buffer;
+    if (!init_buffer(&output_buffer)) {
+        if (input != stdin) {
+            fclose(input);
+        }
+        return -1;
+    }
+    output_buffer.sink = sink;
+    output_buffer.sink_arg = sink_arg;
+
+    long expanded = expandTrieStream(input, &output_buffer);
+    free_buffer(&output_buffer);
+    if (input != stdin) {
+        fclose(input);
+    }
+    return expanded;
+}
+
+void rulechef_get_stats(RuleChef *chef, RuleChefStats *stats) {
+    stats->rules = chef->rule_count;
+    stats->starters = chef->starter_count;
+    stats->unigrams = chef->unigram_count;
+    stats->bigrams = chef->bigram_count;
+    stats->trigrams = chef->trigram_count;
+    stats->lines_read = chef->input_sampling.lines_read;
+    stats->lines_sampled = chef->input_sampling.lines_sampled;
+}
+
+int rulechef_export(RuleChef *chef, const char *path, int format, int threads, int verbose) {
+    // Bigram probabilities, after pruning, are only known once the model is finalized
+    rulechef_finalize(chef, 0);
+    return exportNGramTables(chef, path, format == RULECHEF_EXPORT_BIN ? EXPORT_FORMAT_BIN : EXPORT_FORMAT_TSV,
+                             threads, verbose);
+}
+
+void rulechef_print_stats(RuleChef *chef) {
+    printAllNGramHashTableStats(chef);
+    printBigramMemoryStats(chef);
+    printTopNGramsFromHashTable(chef);
+}
@@ -0,0 +1,196 @@
+#ifndef RULECHEF_H
+#define RULECHEF_H
+
+#include <stddef.h>
+
+// librulechef - analyse rule files and generate rule chains from the resulting markov model
+//
+// A RuleChef context owns every table and buffer, so several models can live in one process.
+// Analysis functions must not run concurrently on the same context, generation only reads
+// the model and may run on several threads at once.
+
+typedef struct RuleChef RuleChef;
+
+// Generation parameters, rulechef_default_params fills in the CLI defaults
+typedef struct {
+    int min_length;            // Minimum rule length in operations
+    int max_length;            // Maximum rule length in operations
+    double min_probability;    // Prune chains below this probability (0.0 generates everything)
+    double limit_unigrams;     // Limit starters to TopN, or TopN percent when between 0 and 1
+    int simplify;              // Skip redundant and non-canonical chains
+    int joint;                 // Include the starter probability in the chain probability
+    int verbose;               // Progress and statistics on stderr
+
+    // Constraints, applied while chains are built so excluded subtrees are never walked
+    const char *deny_ops;      // Base ops never used, eg. "M46X" (NULL for none)
+    const char *allow_ops;     // Only these base ops are used (NULL for all)
+    const char *prefix;        // Rules start with the ops of this rule (NULL for any)
+    const char *suffix;        // Rules end with the ops of this rule (NULL for any)
+    int max_bytes;             // Longest rule in bytes, 0 for no limit
+
+    // Generation returns early once *stop is non zero, eg. set by a sink whose consumer went away. It is
+    // polled between subtrees and blocks, so another thread may set it too (NULL never stops)
+    volatile int *stop;
+} RuleChefParams;
+
+typedef struct {
+    long rules;
+    long starters;
+    long unigrams;
+    long bigrams;
+    long trigrams;
+    long lines_read;           // Input lines seen, including those skipped by input sampling
+    long lines_sampled;        // Input lines analysed
+} RuleChefStats;
+
+// Receives blocks of newline terminated rules
+typedef void (*RuleChefSink)(void *arg, const char *data, size_t len);
+
+// Context management
+RuleChef *rulechef_create(void);
+void rulechef_destroy(RuleChef *chef);
+
+// Bounds the memory of bigram counting, the long tail is then counted approximately in a count-min sketch
+// Call it before analysing. Returns 0 when the sketch cannot be allocated, counting stays exact then
+int rulechef_set_max_memory(RuleChef *chef, size_t bytes);
+
+// Counts bigrams by radix sorting batches of packed keys instead of one hash probe per occurrence, which
+// keeps ingestion fast with very many distinct bigrams. Counts stay exact, and this replaces the
+// rulechef_set_max_memory budget. Call it before analysing, returns 0 when out of memory
+int rulechef_set_sort_counting(RuleChef *chef, int enabled);
+
+// Backs the model with huge pages (MAP_HUGETLB when pages are reserved, transparent huge pages otherwise)
+// to cut TLB misses on large models. Call it before analysing
+void rulechef_set_huge_pages(RuleChef *chef, int enabled);
+
+// Transition pruning, applied when the model is finalized. Bigrams seen fewer than min_count times are
+// dropped before normalisation, then only the max_branch most probable successors of each op are kept
+// (0 keeps all), rescaled to sum to 1 when renormalize is set. Pruned transitions score 0
+void rulechef_set_pruning(RuleChef *chef, long min_count, int max_branch, int renormalize);
+
+// Builds the model from a sample of each analysed file: every line is kept with probability rate, or a
+// uniform reservoir of exactly lines lines is kept (0 for both analyses everything). Lines that are not
+// sampled are only scanned for their newline, they are never copied or parsed
+void rulechef_set_input_sampling(RuleChef *chef, double rate, long lines, unsigned long long seed);
+
+// Forgets everything analysed but keeps the settings and the memory, so the next model reuses it
+// No generator or iterator may be running on the context
+void rulechef_reset(RuleChef *chef);
+
+// Analysis, path may be "-" for stdin and gzip input is decompressed transparently
+// rulechef_analyse_file returns 1, 0 when path cannot be opened, or -1 when the input ends in a read error,
+// in corrupt or truncated gzip data, or when memory runs out. The lines before the error have been analysed
+// by then, so the model is partial: reset or destroy the context rather than generating from it
+int rulechef_analyse_file(RuleChef *chef, const char *path, int weighted, int verbose);
+int rulechef_analyse_rule(RuleChef *chef, const char *rule, long weight);
+
+// Computes probabilities and the transition lookup, generation calls it when needed
+void rulechef_finalize(RuleChef *chef, int verbose);
+
+// Generation, rules go to sink (stdout when sink is NULL), returns the number of rules written
+void rulechef_default_params(RuleChefParams *params);
+long rulechef_generate(RuleChef *chef, const RuleChefParams *params, RuleChefSink sink, void *sink_arg);
+
+// Tiered generation in one pass at the lowest threshold, each rule goes to the sink of the highest threshold
+// it reaches: sink k receives the rules with thresholds[k] <= probability < thresholds[k - 1]. thresholds
+// must be strictly descending and above 0, params->min_probability is not used. A NULL sink writes to
+// stdout. written (may be NULL) receives the rules per tier, returns the total or -1 for bad thresholds
+long rulechef_generate_tiers(RuleChef *chef, const RuleChefParams *params, int count, const double *thresholds,
+                             RuleChefSink *sinks, void **sink_args, long *written);
+
+// Saved models keep the counts of an analysis, loading one adds them as if its rules were analysed again
+// Both return 0 with a message on failure
+int rulechef_save_model(RuleChef *chef, const char *path, int verbose);
+int rulechef_load_model(RuleChef *chef, const char *path, int verbose);
+
+// Delta generation after a model update: writes only the rules rulechef_generate would write for chef
+// but not for previous (eg. loaded from the model saved by the last run), in the same order. Subtrees
+// the update cannot have changed are skipped, so the work follows the size of the change
+long rulechef_generate_delta(RuleChef *chef, RuleChef *previous, const RuleChefParams *params,
+                             RuleChefSink sink, void *sink_arg);
+
+// Beam search, keeps the width most probable chains (by joint probability) at each depth
+long rulechef_beam(RuleChef *chef, const RuleChefParams *params, long width, RuleChefSink sink, void *sink_arg);
+
+// Monte Carlo sampling, rules are drawn from the chain distribution instead of enumerated
+// min_probability is not used, limit_unigrams and simplify restrict the starters and transitions
+typedef struct {
+    long count;                 // Rules to draw
+    unsigned long long seed;    // The same seed gives the same output whatever the thread count
+    int threads;                // 0 uses every online core
+    size_t dedup_bytes;         // Bloom filter size for dropping repeated rules, 0 keeps repeats
+} RuleChefSampleParams;
+long rulechef_sample(RuleChef *chef, const RuleChefParams *params, const RuleChefSampleParams *sample,
+                     RuleChefSink sink, void *sink_arg);
+
+// Pull based generation, the consumer decides how many rules it takes and may stop at any time
+// The context must outlive the iterator and must not be analysed further while it is in use
+typedef struct RuleChefIterator RuleChefIterator;
+RuleChefIterator *rulechef_iterator_create(RuleChef *chef, const RuleChefParams *params);
+void rulechef_iterator_destroy(RuleChefIterator *it);
+
+// Next rule as a NUL terminated string, valid until the next call, NULL when finished
+const char *rulechef_iterator_next(RuleChefIterator *it);
+
+// Fills buffer with up to max_rules newline terminated rules, stopping early when it is full
+// size must be at least 80 bytes, enough for the longest rule and its newline
+// Returns the number of rules written (0 when finished) and sets *used to the bytes written
+long rulechef_iterator_next_batch(RuleChefIterator *it, char *buffer, size_t size, long max_rules, size_t *used);
+
+// Scoring of existing rules by their chain probability under the model
+// Returns 0.0 when a transition was never seen and -1.0 when the rule does not parse
+double rulechef_score_rule(RuleChef *chef, const char *rule);
+
+// Writes "probability<TAB>rule" for each valid rule of path, in input order or sorted by descending
+// probability with an external merge sort using at most sort_memory bytes (0 for the default)
+// Returns the number of rules written, or -1 when the file cannot be opened or ends in a read error or
+// corrupt gzip data (the rules before the error are still written), or when memory or temporary space
+// runs out
+long rulechef_score_file(RuleChef *chef, const char *path, int sorted, int threads, size_t sort_memory,
+                         int verbose, RuleChefSink sink, void *sink_arg);
+
+// Evaluation against held-out rules. Rules go to the set from a file or through rulechef_set_holdout,
+// then any generator is run with rulechef_eval_sink and its sink_arg set to the eval set
+typedef struct RuleChefEval RuleChefEval;
+RuleChefEval *rulechef_eval_create(void);
+void rulechef_eval_destroy(RuleChefEval *eval);
+int rulechef_eval_add_file(RuleChefEval *eval, const char *path, int weighted, int verbose);
+
+// Lines analysed afterwards go to eval instead of the model with probability ratio, seed fixes the split
+// eval NULL turns the split off again
+void rulechef_set_holdout(RuleChef *chef, RuleChefEval *eval, double ratio, unsigned long long seed);
+
+// Matches each generated rule against the held-out set with one in-memory lookup, nothing is written
+void rulechef_eval_sink(void *eval, const char *data, size_t len);
+
+// Writes the held-out perplexity per operation, then "emitted<TAB>recovered<TAB>coverage<TAB>
+// occurrence_coverage" rows at 1, 2, 5, 10... rules emitted. rulechef_eval_rewind starts a new run
+void rulechef_eval_report(RuleChef *chef, RuleChefEval *eval, RuleChefSink sink, void *sink_arg);
+void rulechef_eval_rewind(RuleChefEval *eval);
+
+// Compact binary output, the rules are stored as a prefix trie walked in generation order with an op table,
+// so siblings sharing a prefix take one or two bytes each. Run any generator with rulechef_trie_sink and
+// its sink_arg set to the writer, the stream goes to sink (stdout when sink is NULL). NULL when out of memory
+typedef struct RuleChefTrieWriter RuleChefTrieWriter;
+RuleChefTrieWriter *rulechef_trie_create(RuleChefSink sink, void *sink_arg);
+void rulechef_trie_sink(void *writer, const char *data, size_t len);
+
+// Flushes and frees the writer, returns the number of rules written
+long rulechef_trie_close(RuleChefTrieWriter *writer, int verbose);
+
+// Streams the rules of a trie file (path may be "-" for stdin) back out as text, in the order they were
+// written. Returns the number of rules, or -1 when the file cannot be opened or is not a valid stream
+long rulechef_expand(const char *path, RuleChefSink sink, void *sink_arg);
+
+// Export of the starter, unigram and bigram tables with their counts and probabilities, each sorted by
+// descending count using threads workers (0 uses every online core). path may be "-" for stdout
+// Returns 0 with a message when the file cannot be written or memory runs out
+#define RULECHEF_EXPORT_TSV 0
+#define RULECHEF_EXPORT_BIN 1
+int rulechef_export(RuleChef *chef, const char *path, int format, int threads, int verbose);
+
+// Statistics
+void rulechef_get_stats(RuleChef *chef, RuleChefStats *stats);
+void rulechef_print_stats(RuleChef *chef);
+
+#endif
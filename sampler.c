@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+
+#include "sampler.h"
+#include "buffer.h"
+#include "processor.h"
+#include "rule_parser.h"
+#include "hit_scorer.h"
+#include "random.h"
+#include "constraints.h"
+
+// Vose alias table, one uniform draw picks an entry in O(1)
+typedef struct {
+    double *accept;
+    int *alias;
+    int count;
+} AliasTable;
+
+// Transitions out of one operation, next_rows maps each transition to the row of its next op
+typedef struct {
+    AliasTable table;
+    CompleteOperation **next_ops;
+    int *next_rows;     // -1 when the next op has no transitions
+} SampleRow;
+
+typedef struct {
+    SampleRow *rows;
+    int row_count;
+    AliasTable starters;
+    CompleteOperation *starter_ops;
+    int *starter_rows;
+    RuleConstraints constraints;
+    int prefix_bytes;
+    int prefix_row;     // Row of the last prefix op, chains continue from it
+    void *commuted;     // Two op rules -s skips, they are redrawn
+} SampleModel;
+
+typedef struct {
+    uint64_t *bits;
+    uint64_t mask;      // Bit count - 1, the bit count is a power of two
+} BloomFilter;
+
+typedef struct {
+    SampleModel *model;
+    const RuleChefParams *params;
+    const RuleChefSampleParams *sample;
+    WBuffer *output_buffer;
+    BloomFilter *bloom;
+
+    long chunk_count;
+    long next_chunk;        // Next chunk to claim
+    long write_chunk;       // Next chunk to write, keeps the output in seed order
+    long written;
+    long dropped;           // Draws that never reached the minimum length
+    long duplicates;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+} SampleJob;
+
+// Returns the number of entries, or -1 when the table cannot be allocated
+static int buildAliasTable(AliasTable *table, const double *weights, int count) {
+    double total = 0.0;
+    for (int i = 0; i < count; i++) {
+        total += weights[i];
+    }
+
+    table->count = 0;
+    table->accept = malloc((count + 1) * sizeof(double));
+    table->alias = malloc((count + 1) * sizeof(int));
+    int *small = malloc((count + 1) * sizeof(int));
+    int *large = malloc((count + 1) * sizeof(int));
+    double *scaled = malloc((count + 1) * sizeof(double));
+    if (table->accept == NULL || table->alias == NULL || small == NULL || large == NULL || scaled == NULL) {
+        fprintf(stderr, "Failed to allocate alias table\n");
+        free(table->accept);
+        free(table->alias);
+        table->accept = NULL;
+        table->alias = NULL;
+        free(small);
+        free(large);
+        free(scaled);
+        return -1;
+    }
+
+    if (count > 0 && total > 0.0) {
+        int small_count = 0;
+        int large_count = 0;
+        for (int i = 0; i < count; i++) {
+            scaled[i] = weights[i] * count / total;
+            if (scaled[i] < 1.0) {
+                small[small_count++] = i;
+            } else {
+                large[large_count++] = i;
+            }
+        }
+        while (small_count > 0 && large_count > 0) {
+            int less = small[--small_count];
+            int more = large[--large_count];
+            table->accept[less] = scaled[less];
+            table->alias[less] = more;
+            scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+            if (scaled[more] < 1.0) {
+                small[small_count++] = more;
+            } else {
+                large[large_count++] = more;
+            }
+        }
+        // Leftovers are 1.0 up to rounding
+        while (large_count > 0) {
+            int i = large[--large_count];
+            table->accept[i] = 1.0;
+            table->alias[i] = i;
+        }
+        while (small_count > 0) {
+            int i = small[--small_count];
+            table->accept[i] = 1.0;
+            table->alias[i] = i;
+        }
+        table->count = count;
+    }
+
+    free(small);
+    free(large);
+    free(scaled);
+    return table->count;
+}
+
+static inline int drawAlias(const AliasTable *table, SampleRandom *rng) {
+    double u = nextUniform(rng) * table->count;
+    int i = (int)u;
+    if (i >= table->count) i = table->count - 1;
+    return (u - i) < table->accept[i] ? i : table->alias[i];
+}
+
+static void freeAliasTable(AliasTable *table) {
+    free(table->accept);
+    free(table->alias);
+}
+
+static int rowIndex(RuleChef *chef, const CompleteOperation *op) {
+    FastTransitionLookup *lookup = findTransitionLookup(chef, op);
+    if (lookup == NULL || lookup->transition_count == 0) {
+        return -1;
+    }
+    return (int)(lookup - chef->fast_lookup);
+}
+
+// Whether from can be followed by to in a sampled chain
+static int hasSampleTransition(const SampleModel *model, int row, const CompleteOperation *to) {
+    if (row < 0) {
+        return 0;
+    }
+    const SampleRow *current = &model->rows[row];
+    for (int i = 0; i < current->table.count; i++) {
+        if (strcmp(current->next_ops[i]->full_op, to->full_op) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Chains with a prefix are drawn conditionally: the prefix is copied, sampling resumes from its last op
+static int resolveSamplePrefix(RuleChef *chef, SampleModel *model) {
+    const RuleConstraints *constraints = &model->constraints;
+    int found = 0;
+
+    for (int i = 0; i < model->starters.count; i++) {
+        if (strcmp(model->starter_ops[i].full_op, constraints->prefix[0].full_op) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+
+    int row = rowIndex(chef, &constraints->prefix[0]);
+    model->prefix_bytes = constraints->prefix[0].length;
+    for (int i = 1; i < constraints->prefix_count; i++) {
+        if (!hasSampleTransition(model, row, &constraints->prefix[i])) {
+            return 0;
+        }
+        row = rowIndex(chef, &constraints->prefix[i]);
+        model->prefix_bytes += constraints->prefix[i].length;
+    }
+    model->prefix_row = row;
+    return constraints->max_bytes == 0 || model->prefix_bytes <= constraints->max_bytes;
+}
+
+static int buildSampleModel(RuleChef *chef, const RuleChefParams *params, SampleModel *model) {
+    memset(model, 0, sizeof(SampleModel));
+
+    if (!compileConstraints(params, &model->constraints)) {
+        return 0;
+    }
+    const unsigned char *allowed = model->constraints.allowed;
+
+    int starter_count = 0;
+    OperationNGram *starters = getGenerationStarters(chef, params, &starter_count);
+    if (starters == NULL) {
+        return 0;
+    }
+    starter_count = getStarterLimit(params->limit_unigrams, starter_count);
+
+    double *weights = malloc((starter_count + chef->max_transition_count + 1) * sizeof(double));
+    model->starter_ops = malloc((starter_count + 1) * sizeof(CompleteOperation));
+    model->starter_rows = malloc((starter_count + 1) * sizeof(int));
+    model->rows = calloc(chef->fast_lookup_count + 1, sizeof(SampleRow));
+    if (weights == NULL || model->starter_ops == NULL || model->starter_rows == NULL || model->rows == NULL) {
+        fprintf(stderr, "Failed to allocate sampling tables\n");
+        free(weights);
+        free(starters);
+        return 0;
+    }
+
+    int kept_starters = 0;
+    for (int i = 0; i < starter_count; i++) {
+        if (!allowed[(unsigned char)starters[i].ops[0].base_op] ||
+            (model->constraints.max_bytes > 0 && starters[i].ops[0].length > model->constraints.max_bytes)) {
+            continue;
+        }
+        model->starter_ops[kept_starters] = starters[i].ops[0];
+        model->starter_rows[kept_starters] = rowIndex(chef, &starters[i].ops[0]);
+        weights[kept_starters] = starters[i].probability;
+        kept_starters++;
+    }
+    if (buildAliasTable(&model->starters, weights, kept_starters) < 0) {
+        free(weights);
+        free(starters);
+        return 0;
+    }
+
+    // Sampling ignores -p, so the canonical order only has to be drawable
+    RuleChefParams commuted_params = *params;
+    commuted_params.min_probability = 0.0;
+    model->commuted = buildCommutedRules(chef, &commuted_params, &model->constraints, starters, starter_count);
+    free(starters);
+
+    // One row per lookup entry, redundant transitions are left out when simplifying
+    model->row_count = chef->fast_lookup_count;
+    for (int r = 0; r < chef->fast_lookup_count; r++) {
+        FastTransitionLookup *lookup = &chef->fast_lookup[r];
+        SampleRow *row = &model->rows[r];
+        int kept = 0;
+
+        row->next_ops = malloc((lookup->transition_count + 1) * sizeof(CompleteOperation *));
+        row->next_rows = malloc((lookup->transition_count + 1) * sizeof(int));
+        if (row->next_ops == NULL || row->next_rows == NULL) {
+            fprintf(stderr, "Failed to allocate sampling tables\n");
+            free(weights);
+            return 0;
+        }
+
+        for (int i = 0; i < lookup->transition_count; i++) {
+            SortedTransition *transition = &lookup->sorted_transitions[i];
+            if (transition->next_op == NULL || transition->probability <= 0.0) {
+                continue;
+            }
+            if (params->simplify && isRedundantTransition(&lookup->from_op, transition->next_op)) {
+                continue;
+            }
+            if (!allowed[(unsigned char)transition->next_op->base_op]) {
+                continue;
+            }
+            row->next_ops[kept] = transition->next_op;
+            weights[kept] = transition->probability;
+            kept++;
+        }
+        if (buildAliasTable(&row->table, weights, kept) < 0) {
+            free(weights);
+            return 0;
+        }
+        for (int i = 0; i < kept; i++) {
+            row->next_rows[i] = rowIndex(chef, row->next_ops[i]);
+        }
+    }
+
+    free(weights);
+
+    if (model->starters.count > 0 && model->constraints.prefix_count > 0 && !resolveSamplePrefix(chef, model)) {
+        fprintf(stderr, "Error: The model cannot generate a rule starting with the prefix\n");
+        return 0;
+    }
+    return model->starters.count > 0;
+}
+
+static void freeSampleModel(SampleModel *model) {
+    for (int r = 0; r < model->row_count; r++) {
+        freeAliasTable(&model->rows[r].table);
+        free(model->rows[r].next_ops);
+        free(model->rows[r].next_rows);
+    }
+    free(model->rows);
+    freeAliasTable(&model->starters);
+    free(model->starter_ops);
+    free(model->starter_rows);
+    freeCommutedRules(model->commuted);
+}
+
+// Draws one chain into rule, returns its length or -1 when every attempt dead ended too early
+static int drawRule(const SampleModel *model, const RuleChefParams *params, SampleRandom *rng, char *rule) {
+    int span = params->max_length - params->min_length + 1;
+    int target = params->min_length + (int)(nextRandom(rng) % (uint64_t)span);
+
+    const RuleConstraints *constraints = &model->constraints;
+    CompleteOperation chain[MAX_RULE_LEN];
+
+    for (int attempt = 0; attempt < SAMPLE_MAX_ATTEMPTS; attempt++) {
+        const CompleteOperation *op;
+        int row;
+        int length = 0;
+        int ops = 0;
+
+        if (constraints->prefix_count > 0) {
+            for (int i = 0; i < constraints->prefix_count; i++) {
+                memcpy(rule + length, constraints->prefix[i].full_op, constraints->prefix[i].length);
+                length += constraints->prefix[i].length;
+                chain[ops++] = constraints->prefix[i];
+            }
+            op = NULL;
+            row = model->prefix_row;
+        } else {
+            int s = drawAlias(&model->starters, rng);
+            op = &model->starter_ops[s];
+            row = model->starter_rows[s];
+        }
+
+        while (1) {
+            if (op != NULL) {
+                int op_len = op->length;
+                if (length + op_len >= MAX_RULE_LEN - 1) {
+                    break;
+                }
+                memcpy(rule + length, op->full_op, op_len);
+                length += op_len;
+                chain[ops++] = *op;
+            }
+
+            if (ops >= target || row < 0 || model->rows[row].table.count == 0) {
+                break;
+            }
+            const SampleRow *current = &model->rows[row];
+            int t = drawAlias(&current->table, rng);
+            op = current->next_ops[t];
+            row = current->next_rows[t];
+
+            // An op past the byte limit ends the chain like a missing transition
+            if (constraints->max_bytes > 0 && length + op->length > constraints->max_bytes) {
+                break;
+            }
+        }
+
+        // A chain that dead ends still counts once it is long enough, the suffix is met by redrawing
+        if (ops >= params->min_length && (!constraints->positional || constraintAllowsChain(constraints, chain, ops)) &&
+            !isCommutedRule(model->commuted, chain, ops)) {
+            rule[length] = '\0';
+            return length;
+        }
+    }
+    return -1;
+}
+
+static int createBloomFilter(BloomFilter *bloom, size_t bytes) {
+    uint64_t bits = 64;
+    while (bits * 2 <= (uint64_t)bytes * 8) {
+        bits *= 2;
+    }
+    bloom->bits = calloc(bits / 64, sizeof(uint64_t));
+    if (bloom->bits == NULL) {
+        fprintf(stderr, "Failed to allocate dedup filter\n");
+        return 0;
+    }
+    bloom->mask = bits - 1;
+    return 1;
+}
+
+// Sets the rule's bits, returns 1 if they were all set already (probably seen before)
+static int testAndSetBloom(BloomFilter *bloom, const char *rule, int length) {
+    uint64_t h1 = 14695981039346656037ULL;
+    for (int i = 0; i < length; i++) {
+        h1 = (h1 ^ (unsigned char)rule[i]) * 1099511628211ULL;
+    }
+    uint64_t h2 = h1;
+    h2 ^= h2 >> 33;
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 33;
+    h2 |= 1;
+
+    int seen = 1;
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+        uint64_t bit = (h1 + k * h2) & bloom->mask;
+        uint64_t flag = 1ULL << (bit & 63);
+        if (!(bloom->bits[bit >> 6] & flag)) {
+            bloom->bits[bit >> 6] |= flag;
+            seen = 0;
+        }
+    }
+    return seen;
+}
+
+static void *sampleWorker(void *arg) {
+    SampleJob *job = (SampleJob *)arg;
+    size_t capacity = (size_t)SAMPLE_CHUNK_SIZE * MAX_RULE_LEN;
+    char *chunk = malloc(capacity);
+    if (chunk == NULL) {
+        // The other workers claim every chunk this one would have drawn
+        fprintf(stderr, "Failed to allocate sample buffer\n");
+        return NULL;
+    }
+
+    while (1) {
+        // A chunk is only claimed when it will be written, so no thread waits for one that never comes
+        if (generationStopped(job->params)) {
+            break;
+        }
+        long c = __sync_fetch_and_add(&job->next_chunk, 1);
+        if (c >= job->chunk_count) {
+            break;
+        }
+
+        long first = c * SAMPLE_CHUNK_SIZE;
+        long draws = job->sample->count - first < SAMPLE_CHUNK_SIZE ? job->sample->count - first : SAMPLE_CHUNK_SIZE;
+        SampleRandom rng;
+        seedRandom(&rng, job->sample->seed, (uint64_t)c);
+
+        size_t used = 0;
+        long rules = 0;
+        long dropped = 0;
+        for (long i = 0; i < draws; i++) {
+            int length = drawRule(job->model, job->params, &rng, chunk + used);
+            if (length < 0) {
+                dropped++;
+                continue;
+            }
+            chunk[used + length] = '\n';
+            used += length + 1;
+            rules++;
+        }
+
+        // Chunks are written strictly in order, the filter sees rules in the same order every run
+        pthread_mutex_lock(&job->lock);
+        while (job->write_chunk != c) {
+            pthread_cond_wait(&job->turn, &job->lock);
+        }
+        if (job->bloom != NULL) {
+            char *line = chunk;
+            char *end = chunk + used;
+            while (line < end) {
+                char *newline = memchr(line, '\n', end - line);
+                *newline = '\0';
+                if (testAndSetBloom(job->bloom, line, (int)(newline - line))) {
+                    job->duplicates++;
+                } else {
+                    buffer_string2(job->output_buffer, line, MAX_RULE_LEN);
+                    job->written++;
+                }
+                line = newline + 1;
+            }
+            flush_buffer(job->output_buffer);
+        } else {
+            buffer_block(job->output_buffer, chunk, used, rules);
+            job->written += rules;
+        }
+        job->dropped += dropped;
+        job->write_chunk++;
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+long sampleRules(RuleChef *chef, const RuleChefParams *params, const RuleChefSampleParams *sample,
+                 WBuffer *output_buffer) {
+    SampleModel model;
+    BloomFilter bloom;
+    SampleJob job;
+
+    if (!buildSampleModel(chef, params, &model)) {
+        freeSampleModel(&model);
+        return 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.model = &model;
+    job.params = params;
+    job.sample = sample;
+    job.output_buffer = output_buffer;
+    job.chunk_count = (sample->count + SAMPLE_CHUNK_SIZE - 1) / SAMPLE_CHUNK_SIZE;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+
+    if (sample->dedup_bytes > 0) {
+        if (!createBloomFilter(&bloom, sample->dedup_bytes)) {
+            freeSampleModel(&model);
+            return 0;
+        }
+        job.bloom = &bloom;
+    }
+
+    int threads = sample->threads > 0 ? sample->threads : getDefaultThreadCount();
+    if (threads > job.chunk_count) {
+        threads = job.chunk_count > 0 ? (int)job.chunk_count : 1;
+    }
+
+    if (params->verbose) {
+        fprintf(stderr, "\n=== Rule Sampling ===\n");
+        fprintf(stderr, "Drawing %ld rules of length %d-%d with seed %llu using %d threads\n",
+                sample->count, params->min_length, params->max_length, sample->seed, threads);
+        fprintf(stderr, "Alias tables: %d starters, %d transition rows\n", model.starters.count, model.row_count);
+        if (job.bloom != NULL) {
+            fprintf(stderr, "Dedup filter: %.2f MB, %d hashes\n",
+                    (double)(bloom.mask + 1) / 8 / (1024 * 1024), BLOOM_HASHES);
+        }
+    }
+
+    // With no thread started the rules are drawn here, the output is the same for any number of workers
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (workers != NULL && started < threads && pthread_create(&workers[started], NULL, sampleWorker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        sampleWorker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    flush_buffer(output_buffer);
+
+    if (params->verbose) {
+        fprintf(stderr, "Sampling complete. %ld rules written", job.written);
+        if (job.bloom != NULL) {
+            fprintf(stderr, ", %ld duplicates dropped", job.duplicates);
+        }
+        fprintf(stderr, ", %ld draws dead ended below the minimum length%s\n", job.dropped,
+                model.constraints.positional ? " or missed a constraint" : "");
+    }
+
+    if (job.bloom != NULL) {
+        free(bloom.bits);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.turn);
+    freeSampleModel(&model);
+    return job.written;
+}
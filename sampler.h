@@ -0,0 +1,15 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "types.h"
+
+#define SAMPLE_CHUNK_SIZE 16384     // Draws per chunk, each chunk has its own seed
+#define SAMPLE_MAX_ATTEMPTS 64      // Redraws of a chain that dead ends before the minimum length
+#define BLOOM_HASHES 7
+
+// Draws count rules from the chain distribution: a starter, a length uniform in [min, max], then
+// transitions in proportion to their probability. Output only depends on the seed, not on threads
+long sampleRules(RuleChef *chef, const RuleChefParams *params, const RuleChefSampleParams *sample,
+                 WBuffer *output_buffer);
+
+#endif
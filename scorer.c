@@ -0,0 +1,674 @@
+#include "scorer.h"
+#include "buffer.h"
+#include "hash_tables.h"
+#include "rule_parser.h"
+#include "input_stream.h"
+#include "hit_scorer.h"
+
+// One worker's share of a round
+typedef struct {
+    RuleChef *chef;
+    const ScoreModel *model;
+    int sorted;
+    int threaded;           // Scored by its own thread this round
+
+    char *data;             // Input lines, NUL terminated
+    size_t data_used;
+    size_t *offsets;
+    int *lengths;
+    double *scores;         // -1.0 for lines that do not parse
+    long count;
+    long first_sequence;
+
+    char *output;           // Formatted lines when not sorting
+    size_t output_used;
+    long output_count;
+} ScoreBatch;
+
+typedef struct {
+    double probability;
+    long sequence;
+    size_t offset;          // Into the run arena
+    int length;
+} ScoredRule;
+
+// Records held in memory until the budget is used up, then sorted and spilled to a temporary file.
+// A quarter of the budget is kept for the merge buffers, runs are merged SCORE_MERGE_FAN_IN at a time
+// as soon as that many of the same level exist, so the open files stay bounded too
+typedef struct {
+    ScoredRule *records;
+    long count;
+    long capacity;
+    char *arena;
+    size_t arena_used;
+    size_t arena_capacity;
+    size_t merge_buffer;    // Buffer of each run being written or merged
+    FILE **runs;
+    int *run_levels;        // Times the records of each run have been merged, non-increasing
+    int run_count;
+    int run_capacity;
+    int merge_passes;
+    int failed;             // Set once rules were lost, nothing more is written
+} ScoreSorter;
+
+// Runs are unbuffered streams read and written through these buffers of merge_buffer bytes
+typedef struct {
+    FILE *file;
+    char *buffer;
+    size_t used;            // Writer: bytes buffered, reader: bytes consumed
+    size_t filled;          // Reader: bytes in buffer
+    size_t size;
+    int eof;
+    int failed;             // Writer: a write to the file failed
+    double probability;
+    long sequence;
+    int length;
+    char rule[MAX_RULE_LEN];
+} RunStream;
+
+#define RUN_RECORD_MAX (sizeof(double) + sizeof(long) + 1 + 255)
+
+void initScoreModel(RuleChef *chef, ScoreModel *model) {
+    NGramIterator it;
+    NGramHashNode *node;
+
+    model->total_starters = 0;
+    initNGramIterator(&it, &chef->starter_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        model->total_starters += node->ngram.frequency;
+    }
+
+    model->unigram_width = 0;
+    initNGramIterator(&it, &chef->unigram_hash_table);
+    while ((node = nextNGram(&it)) != NULL) {
+        model->unigram_width++;
+    }
+}
+
+double scoreOperations(RuleChef *chef, const ScoreModel *model, char *rule, int *op_count) {
+    ParsedRule parsed;
+
+    if (!tokenizeRule(rule, &parsed) || parsed.op_count == 0) {
+        return -1.0;
+    }
+    if (op_count != NULL) {
+        *op_count = parsed.op_count;
+    }
+
+    // An op the model has never seen cannot be generated
+    if (findNGram(chef, &parsed.operations[0], 1) == NULL || model->unigram_width == 0) {
+        return 0.0;
+    }
+    long starter_frequency = 0;
+    NGramHashNode *starter = findNGramInTable(&chef->starter_hash_table, &parsed.operations[0], 1);
+    if (starter != NULL) {
+        starter_frequency = starter->ngram.frequency;
+    }
+    double probability = (double)(starter_frequency + K_SMOOTHING_FACTOR) /
+                         (model->total_starters + K_SMOOTHING_FACTOR * model->unigram_width);
+
+    for (int j = 0; j < parsed.op_count - 1; j++) {
+        NGramHashNode *bigram = findNGram(chef, &parsed.operations[j], 2);
+        if (bigram == NULL) {
+            return 0.0;
+        }
+        probability *= bigram->ngram.probability;
+    }
+    return probability;
+}
+
+double scoreRule(RuleChef *chef, const char *rule) {
+    char line[MAX_RULE_LEN];
+    ScoreModel model;
+    size_t length = strlen(rule);
+
+    if (length == 0 || length >= MAX_RULE_LEN) {
+        return -1.0;
+    }
+    memcpy(line, rule, length + 1);
+    initScoreModel(chef, &model);
+    return scoreOperations(chef, &model, line, NULL);
+}
+
+static void *scoreWorker(void *arg) {
+    ScoreBatch *batch = (ScoreBatch *)arg;
+    char rule[MAX_RULE_LEN];
+
+    batch->output_used = 0;
+    batch->output_count = 0;
+    for (long i = 0; i < batch->count; i++) {
+        const char *line = batch->data + batch->offsets[i];
+        memcpy(rule, line, batch->lengths[i] + 1);
+        batch->scores[i] = scoreOperations(batch->chef, batch->model, rule, NULL);
+
+        if (!batch->sorted && batch->scores[i] >= 0.0) {
+            // The original line is written, not its normalised form
+            batch->output_used += sprintf(batch->output + batch->output_used, "%.6e\t%s\n", batch->scores[i], line);
+            batch->output_count++;
+        }
+    }
+    return NULL;
+}
+
+static int allocateScoreBatch(ScoreBatch *batch, int sorted) {
+    memset(batch, 0, sizeof(ScoreBatch));
+    batch->data = malloc((size_t)SCORE_BATCH_LINES * MAX_RULE_LEN);
+    batch->offsets = malloc(SCORE_BATCH_LINES * sizeof(size_t));
+    batch->lengths = malloc(SCORE_BATCH_LINES * sizeof(int));
+    batch->scores = malloc(SCORE_BATCH_LINES * sizeof(double));
+    if (!sorted) {
+        // Room for the probability, a tab and the newline on every line
+        batch->output = malloc((size_t)SCORE_BATCH_LINES * (MAX_RULE_LEN + 32));
+    }
+    if (batch->data == NULL || batch->offsets == NULL || batch->lengths == NULL || batch->scores == NULL ||
+        (!sorted && batch->output == NULL)) {
+        fprintf(stderr, "Failed to allocate scoring batch\n");
+        return 0;
+    }
+    batch->sorted = sorted;
+    return 1;
+}
+
+static void freeScoreBatch(ScoreBatch *batch) {
+    free(batch->data);
+    free(batch->offsets);
+    free(batch->lengths);
+    free(batch->scores);
+    free(batch->output);
+}
+
+// Fills a batch from the input, returns the number of lines taken
+static long fillScoreBatch(ScoreBatch *batch, RuleInput *input, long *sequence, long *too_long) {
+    size_t length;
+    char *line;
+
+    batch->count = 0;
+    batch->data_used = 0;
+    batch->first_sequence = *sequence;
+    while (batch->count < SCORE_BATCH_LINES && (line = readRuleLine(input, &length)) != NULL) {
+        if (length == 0) continue;
+        if (length >= MAX_RULE_LEN) {
+            (*too_long)++;
+            continue;
+        }
+        memcpy(batch->data + batch->data_used, line, length + 1);
+        batch->offsets[batch->count] = batch->data_used;
+        batch->lengths[batch->count] = (int)length;
+        batch->data_used += length + 1;
+        batch->count++;
+        (*sequence)++;
+    }
+    return batch->count;
+}
+
+static int compareScoredRules(const ScoredRule *a, const ScoredRule *b) {
+    if (a->probability != b->probability) {
+        return a->probability < b->probability ? 1 : -1;
+    }
+    return (a->sequence > b->sequence) - (a->sequence < b->sequence);
+}
+
+static int compareScoredRulesQsort(const void *a, const void *b) {
+    return compareScoredRules((const ScoredRule *)a, (const ScoredRule *)b);
+}
+
+static void failScoreSorter(ScoreSorter *sorter, const char *message) {
+    if (!sorter->failed) {
+        fprintf(stderr, "%s, the sorted output is not complete\n", message);
+        sorter->failed = 1;
+    }
+}
+
+static int initScoreSorter(ScoreSorter *sorter, size_t memory) {
+    memset(sorter, 0, sizeof(ScoreSorter));
+    size_t merge_memory = memory / 4;
+    memory -= merge_memory;
+    sorter->merge_buffer = merge_memory / (SCORE_MERGE_FAN_IN + 1);
+    if (sorter->merge_buffer > SCORE_MERGE_BUFFER) sorter->merge_buffer = SCORE_MERGE_BUFFER;
+    if (sorter->merge_buffer < SCORE_MERGE_MIN_BUFFER) sorter->merge_buffer = SCORE_MERGE_MIN_BUFFER;
+    sorter->arena_capacity = memory / 2;
+    sorter->capacity = (long)(memory / 2 / sizeof(ScoredRule));
+    if (sorter->arena_capacity < MAX_RULE_LEN) sorter->arena_capacity = MAX_RULE_LEN;
+    if (sorter->capacity < 1) sorter->capacity = 1;
+
+    sorter->arena = malloc(sorter->arena_capacity);
+    sorter->records = malloc(sorter->capacity * sizeof(ScoredRule));
+    if (sorter->arena == NULL || sorter->records == NULL) {
+        fprintf(stderr, "Failed to allocate %.2f MB for sorting\n", (double)memory / (1024 * 1024));
+        free(sorter->arena);
+        free(sorter->records);
+        return 0;
+    }
+    return 1;
+}
+
+// Closes the runs left behind when sorting stopped early
+static void freeScoreSorter(ScoreSorter *sorter) {
+    for (int i = 0; i < sorter->run_count; i++) {
+        fclose(sorter->runs[i]);
+    }
+    free(sorter->records);
+    free(sorter->arena);
+    free(sorter->runs);
+    free(sorter->run_levels);
+}
+
+static int openRunStream(RunStream *stream, FILE *file, size_t size) {
+    memset(stream, 0, sizeof(RunStream));
+    stream->file = file;
+    stream->size = size;
+    stream->buffer = malloc(size);
+    return stream->buffer != NULL;
+}
+
+// Opens a writer on a new temporary run, returns 0 and fails the sorter when that is not possible
+static int createScoreRun(ScoreSorter *sorter, RunStream *writer) {
+    FILE *run = tmpfile();
+    if (run == NULL) {
+        failScoreSorter(sorter, "Unable to create temporary file for sorting");
+        return 0;
+    }
+    // Before any other use of the stream, the RunStream buffer is the only one
+    setvbuf(run, NULL, _IONBF, 0);
+    if (!openRunStream(writer, run, sorter->merge_buffer)) {
+        fclose(run);
+        failScoreSorter(sorter, "Failed to allocate sort run buffer");
+        return 0;
+    }
+    return 1;
+}
+
+static void flushRunWriter(RunStream *writer) {
+    if (writer->used > 0 && !writer->failed && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+        writer->failed = 1;
+    }
+    writer->used = 0;
+}
+
+static void writeRunRecord(RunStream *writer, double probability, long sequence, const char *rule, int length) {
+    if (writer->used + RUN_RECORD_MAX > writer->size) {
+        flushRunWriter(writer);
+    }
+    char *out = writer->buffer + writer->used;
+    unsigned char byte_length = (unsigned char)length;
+    memcpy(out, &probability, sizeof(double));
+    memcpy(out + sizeof(double), &sequence, sizeof(long));
+    out[sizeof(double) + sizeof(long)] = (char)byte_length;
+    memcpy(out + sizeof(double) + sizeof(long) + 1, rule, byte_length);
+    writer->used += sizeof(double) + sizeof(long) + 1 + byte_length;
+}
+
+static int readRunRecord(RunStream *reader) {
+    if (!reader->eof && reader->filled - reader->used < RUN_RECORD_MAX) {
+        memmove(reader->buffer, reader->buffer + reader->used, reader->filled - reader->used);
+        reader->filled -= reader->used;
+        reader->used = 0;
+        while (!reader->eof && reader->filled < reader->size) {
+            size_t got = fread(reader->buffer + reader->filled, 1, reader->size - reader->filled, reader->file);
+            if (got == 0) {
+                reader->eof = 1;
+            }
+            reader->filled += got;
+        }
+    }
+
+    size_t header = sizeof(double) + sizeof(long) + 1;
+    if (reader->filled - reader->used < header) {
+        return 0;
+    }
+    const char *in = reader->buffer + reader->used;
+    int length = (unsigned char)in[header - 1];
+    if (reader->filled - reader->used < header + length) {
+        return 0;
+    }
+    memcpy(&reader->probability, in, sizeof(double));
+    memcpy(&reader->sequence, in + sizeof(double), sizeof(long));
+    memcpy(reader->rule, in + header, length);
+    reader->length = length;
+    reader->used += header + length;
+    return 1;
+}
+
+static int addScoreRun(ScoreSorter *sorter, FILE *run, int level) {
+    if (sorter->run_count == sorter->run_capacity) {
+        int capacity = sorter->run_capacity ? sorter->run_capacity * 2 : 16;
+        FILE **runs = realloc(sorter->runs, capacity * sizeof(FILE *));
+        if (runs != NULL) sorter->runs = runs;
+        int *levels = realloc(sorter->run_levels, capacity * sizeof(int));
+        if (levels != NULL) sorter->run_levels = levels;
+        if (runs == NULL || levels == NULL) {
+            fclose(run);
+            failScoreSorter(sorter, "Failed to allocate sort runs");
+            return 0;
+        }
+        sorter->run_capacity = capacity;
+    }
+    sorter->runs[sorter->run_count] = run;
+    sorter->run_levels[sorter->run_count] = level;
+    sorter->run_count++;
+    return 1;
+}
+
+// Adds the written run to the sorter, or closes it and fails the sorter when it could not be written
+static int closeRunWriter(ScoreSorter *sorter, RunStream *writer, int level) {
+    flushRunWriter(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    if (writer->failed) {
+        fclose(writer->file);
+        failScoreSorter(sorter, "Error writing temporary sort run");
+        return 0;
+    }
+    return addScoreRun(sorter, writer->file, level);
+}
+
+static void outputScoredRule(WBuffer *output_buffer, double probability, const char *rule, int length) {
+    char line[MAX_RULE_LEN + 32];
+    snprintf(line, sizeof(line), "%.6e\t%.*s", probability, length, rule);
+    buffer_string2(output_buffer, line, sizeof(line));
+    if (output_buffer->writeCount % 1000 == 0) {
+        flush_buffer(output_buffer);
+    }
+}
+
+static int runReaderBefore(const RunStream *a, const RunStream *b) {
+    ScoredRule ra = {a->probability, a->sequence, 0, 0};
+    ScoredRule rb = {b->probability, b->sequence, 0, 0};
+    return compareScoredRules(&ra, &rb) < 0;
+}
+
+static void siftRunHeap(RunStream **heap, int count, int i) {
+    while (1) {
+        int best = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < count && runReaderBefore(heap[left], heap[best])) best = left;
+        if (right < count && runReaderBefore(heap[right], heap[best])) best = right;
+        if (best == i) break;
+        RunStream *tmp = heap[i];
+        heap[i] = heap[best];
+        heap[best] = tmp;
+        i = best;
+    }
+}
+
+// k-way merge of the last count runs through a heap of run readers, into a new run when merged is not
+// NULL and to output_buffer otherwise. The merged runs are closed and removed from the sorter, returns 0
+// and fails the sorter when the merge could not be set up or a run could not be read back
+static int mergeScoreRuns(ScoreSorter *sorter, int count, RunStream *merged, WBuffer *output_buffer) {
+    FILE **runs = sorter->runs + sorter->run_count - count;
+    RunStream *readers = calloc(count, sizeof(RunStream));
+    RunStream **heap = malloc(count * sizeof(RunStream *));
+    int heap_count = 0;
+    int opened = readers != NULL && heap != NULL;
+    for (int i = 0; opened && i < count; i++) {
+        opened = openRunStream(&readers[i], runs[i], sorter->merge_buffer);
+    }
+    if (!opened) {
+        for (int i = 0; readers != NULL && i < count; i++) {
+            free(readers[i].buffer);
+        }
+        free(readers);
+        free(heap);
+        failScoreSorter(sorter, "Failed to allocate run merge");
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        rewind(readers[i].file);
+        if (readRunRecord(&readers[i])) {
+            heap[heap_count++] = &readers[i];
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        siftRunHeap(heap, heap_count, i);
+    }
+
+    while (heap_count > 0) {
+        RunStream *top = heap[0];
+        if (merged != NULL) {
+            writeRunRecord(merged, top->probability, top->sequence, top->rule, top->length);
+        } else {
+            outputScoredRule(output_buffer, top->probability, top->rule, top->length);
+        }
+        if (!readRunRecord(top)) {
+            heap[0] = heap[--heap_count];
+        }
+        siftRunHeap(heap, heap_count, 0);
+    }
+
+    int unreadable = 0;
+    for (int i = 0; i < count; i++) {
+        unreadable |= ferror(readers[i].file);
+        fclose(readers[i].file);
+        free(readers[i].buffer);
+    }
+    free(readers);
+    free(heap);
+    sorter->run_count -= count;
+    if (unreadable) {
+        failScoreSorter(sorter, "Error reading temporary sort run");
+        return 0;
+    }
+    return 1;
+}
+
+// Replaces the last count runs with a single run one level above them
+static int collapseScoreRuns(ScoreSorter *sorter, int count) {
+    int level = sorter->run_levels[sorter->run_count - count] + 1;
+    RunStream merged;
+
+    if (!createScoreRun(sorter, &merged)) {
+        return 0;
+    }
+    if (!mergeScoreRuns(sorter, count, &merged, NULL)) {
+        free(merged.buffer);
+        fclose(merged.file);
+        return 0;
+    }
+    sorter->merge_passes++;
+    return closeRunWriter(sorter, &merged, level);
+}
+
+static int spillScoreRun(ScoreSorter *sorter) {
+    qsort(sorter->records, sorter->count, sizeof(ScoredRule), compareScoredRulesQsort);
+
+    RunStream run;
+    if (!createScoreRun(sorter, &run)) {
+        return 0;
+    }
+    for (long i = 0; i < sorter->count; i++) {
+        ScoredRule *record = &sorter->records[i];
+        writeRunRecord(&run, record->probability, record->sequence, sorter->arena + record->offset, record->length);
+    }
+    if (!closeRunWriter(sorter, &run, 0)) {
+        return 0;
+    }
+    sorter->count = 0;
+    sorter->arena_used = 0;
+
+    // Levels never increase along the runs, so a full group of one level is always at the end
+    int *levels = sorter->run_levels;
+    while (sorter->run_count >= SCORE_MERGE_FAN_IN &&
+           levels[sorter->run_count - SCORE_MERGE_FAN_IN] == levels[sorter->run_count - 1]) {
+        if (!collapseScoreRuns(sorter, SCORE_MERGE_FAN_IN)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void addScoredRule(ScoreSorter *sorter, double probability, long sequence, const char *rule, int length) {
+    if (sorter->failed) {
+        return;
+    }
+    if (sorter->count == sorter->capacity || sorter->arena_used + length > sorter->arena_capacity) {
+        if (!spillScoreRun(sorter)) {
+            return;
+        }
+    }
+    ScoredRule *record = &sorter->records[sorter->count++];
+    record->probability = probability;
+    record->sequence = sequence;
+    record->offset = sorter->arena_used;
+    record->length = length;
+    memcpy(sorter->arena + sorter->arena_used, rule, length);
+    sorter->arena_used += length;
+}
+
+// Writes the sorted rules and frees the sorter, returns 0 when rules were lost along the way
+static int finishScoreSorter(ScoreSorter *sorter, WBuffer *output_buffer, int verbose) {
+    if (sorter->failed) {
+        // A partial order is not written at all
+        freeScoreSorter(sorter);
+        return 0;
+    }
+    if (sorter->run_count == 0) {
+        // Everything fitted in memory
+        qsort(sorter->records, sorter->count, sizeof(ScoredRule), compareScoredRulesQsort);
+        for (long i = 0; i < sorter->count; i++) {
+            ScoredRule *record = &sorter->records[i];
+            outputScoredRule(output_buffer, record->probability, sorter->arena + record->offset, record->length);
+        }
+    } else {
+        int spilled = sorter->count == 0 || spillScoreRun(sorter);
+        // The run buffers are no longer needed during the merge
+        free(sorter->records);
+        free(sorter->arena);
+        sorter->records = NULL;
+        sorter->arena = NULL;
+
+        // Smallest runs first, until the rest fit in a single merge
+        while (spilled && sorter->run_count > SCORE_MERGE_FAN_IN) {
+            int count = sorter->run_count - SCORE_MERGE_FAN_IN + 1;
+            spilled = collapseScoreRuns(sorter, count < SCORE_MERGE_FAN_IN ? count : SCORE_MERGE_FAN_IN);
+        }
+        if (spilled) {
+            if (verbose) {
+                fprintf(stderr, "Merging %d sorted runs (%d intermediate merges)\n",
+                        sorter->run_count, sorter->merge_passes);
+            }
+            mergeScoreRuns(sorter, sorter->run_count, NULL, output_buffer);
+        }
+    }
+    flush_buffer(output_buffer);
+
+    int failed = sorter->failed;
+    freeScoreSorter(sorter);
+    return !failed;
+}
+
+long scoreRuleFile(RuleChef *chef, const char *path, int sorted, int threads, size_t sort_memory,
+                   int verbose, WBuffer *output_buffer) {
+    RuleInput *input = openRuleInput(path);
+    if (input == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", path);
+        return -1;
+    }
+
+    ScoreModel model;
+    initScoreModel(chef, &model);
+
+    if (threads < 1) threads = getDefaultThreadCount();
+    ScoreBatch *batches = calloc(threads, sizeof(ScoreBatch));
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int ready = batches != NULL && workers != NULL;
+    if (!ready) {
+        fprintf(stderr, "Failed to allocate scoring workers\n");
+    }
+    for (int i = 0; ready && i < threads; i++) {
+        ready = allocateScoreBatch(&batches[i], sorted);
+        batches[i].chef = chef;
+        batches[i].model = &model;
+    }
+
+    ScoreSorter sorter;
+    if (ready && sorted) {
+        ready = initScoreSorter(&sorter, sort_memory > 0 ? sort_memory : SCORE_DEFAULT_SORT_MEMORY);
+    }
+    if (!ready) {
+        for (int i = 0; batches != NULL && i < threads; i++) {
+            freeScoreBatch(&batches[i]);
+        }
+        free(batches);
+        free(workers);
+        closeRuleInput(input);
+        return -1;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "\n=== Scoring %s using %d threads%s ===\n", path, threads, sorted ? ", sorted" : "");
+    }
+
+    long sequence = 0;
+    long too_long = 0;
+    long invalid = 0;
+    long written = 0;
+    while (1) {
+        // One batch per worker per round, results are consumed in batch order
+        int filled = 0;
+        while (filled < threads && fillScoreBatch(&batches[filled], input, &sequence, &too_long) > 0) {
+            filled++;
+        }
+        if (filled == 0) {
+            break;
+        }
+
+        // A batch whose thread cannot be started is scored here instead
+        for (int i = 1; i < filled; i++) {
+            batches[i].threaded = pthread_create(&workers[i], NULL, scoreWorker, &batches[i]) == 0;
+        }
+        scoreWorker(&batches[0]);
+        for (int i = 1; i < filled; i++) {
+            if (batches[i].threaded) {
+                pthread_join(workers[i], NULL);
+            } else {
+                scoreWorker(&batches[i]);
+            }
+        }
+
+        for (int i = 0; i < filled; i++) {
+            ScoreBatch *batch = &batches[i];
+            if (!sorted) {
+                buffer_block(output_buffer, batch->output, batch->output_used, batch->output_count);
+                written += batch->output_count;
+                invalid += batch->count - batch->output_count;
+                continue;
+            }
+            for (long j = 0; j < batch->count; j++) {
+                if (batch->scores[j] < 0.0) {
+                    invalid++;
+                    continue;
+                }
+                addScoredRule(&sorter, batch->scores[j], batch->first_sequence + j,
+                              batch->data + batch->offsets[j], batch->lengths[j]);
+                written++;
+            }
+        }
+
+        if (verbose && sequence % (SCORE_BATCH_LINES * 16) < (long)filled * SCORE_BATCH_LINES) {
+            fprintf(stderr, "Scored %ld rules...\n", sequence);
+        }
+    }
+    int failed = ruleInputFailed(input);
+    closeRuleInput(input);
+    if (failed) {
+        fprintf(stderr, "Error: %s is truncated or unreadable, only the rules before the error were scored\n", path);
+    }
+
+    if (sorted && !finishScoreSorter(&sorter, output_buffer, verbose)) {
+        failed = 1;
+    }
+    flush_buffer(output_buffer);
+
+    if (verbose) {
+        fprintf(stderr, "Scoring complete. %ld rules scored, %ld invalid, %ld too long\n", written, invalid, too_long);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        freeScoreBatch(&batches[i]);
+    }
+    free(batches);
+    free(workers);
+    return failed ? -1 : written;
+}
@@ -0,0 +1,34 @@
+#ifndef SCORER_H
+#define SCORER_H
+
+#include "types.h"
+
+#define SCORE_BATCH_LINES 65536         // Lines per worker per round
+#define SCORE_DEFAULT_SORT_MEMORY (512UL * 1024 * 1024)
+#define SCORE_MERGE_BUFFER (1024 * 1024)   // Largest buffer per run while spilling or merging
+#define SCORE_MERGE_MIN_BUFFER 4096
+#define SCORE_MERGE_FAN_IN 16               // Runs merged at once, also bounds the open temporary files
+
+// Starter smoothing terms, the same ones generation uses for its starters
+typedef struct {
+    long total_starters;
+    long unigram_width;
+} ScoreModel;
+
+void initScoreModel(RuleChef *chef, ScoreModel *model);
+
+// scoreRule for many rules, model comes from initScoreModel. rule is modified (normalised), it must be
+// writable and shorter than MAX_RULE_LEN. op_count (may be NULL) receives the number of operations
+double scoreOperations(RuleChef *chef, const ScoreModel *model, char *rule, int *op_count);
+
+// Chain probability of a rule under the model: smoothed starter probability times each bigram probability
+// Returns 0.0 for transitions the model has never seen, and -1.0 when the rule does not parse
+double scoreRule(RuleChef *chef, const char *rule);
+
+// Writes "probability<TAB>rule" for every valid line of path, in input order or sorted by
+// probability (descending, ties in input order) using an external merge sort within sort_memory
+// Returns the rules written, or -1 when the input cannot be read or memory or temporary space runs out
+long scoreRuleFile(RuleChef *chef, const char *path, int sorted, int threads, size_t sort_memory,
+                   int verbose, WBuffer *output_buffer);
+
+#endif
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+
+// Identity of an input file, any change means the model has to be analysed again
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+} FileSignature;
+
+typedef struct CachedModel {
+    char *key;                  // Weighted flag and canonical paths, one per line
+    char **paths;
+    int path_count;
+    int weighted;
+    FileSignature *signatures;
+    RuleChef *chef;
+    int ready;                  // Analysis finished, chef may be used
+    int failed;
+    int detached;               // Removed from the cache, freed once the last client releases it
+    int refs;
+    struct CachedModel *next;
+} CachedModel;
+
+typedef struct {
+    int fd;
+    volatile int failed;        // Client went away, generation stops through params.stop
+} ClientStream;
+
+typedef struct {
+    int fd;
+} ClientArgs;
+
+static CachedModel *model_cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+static size_t server_max_memory = 0;
+static int server_verbose = 0;
+
+static int readSignature(const char *path, FileSignature *signature) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    signature->device = st.st_dev;
+    signature->inode = st.st_ino;
+    signature->size = st.st_size;
+    signature->mtime = st.st_mtim.tv_sec;
+    signature->mtime_nsec = st.st_mtim.tv_nsec;
+    return 1;
+}
+
+static int modelIsCurrent(CachedModel *model) {
+    for (int i = 0; i < model->path_count; i++) {
+        FileSignature current;
+        if (!readSignature(model->paths[i], &current) ||
+            memcmp(&current, &model->signatures[i], sizeof(FileSignature)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void freeModel(CachedModel *model) {
+    rulechef_destroy(model->chef);
+    for (int i = 0; i < model->path_count; i++) {
+        free(model->paths[i]);
+    }
+    free(model->paths);
+    free(model->signatures);
+    free(model->key);
+    free(model);
+}
+
+// Unlink from the cache, caller holds cache_lock
+static void detachModel(CachedModel *model) {
+    CachedModel **link = &model_cache;
+    while (*link != NULL && *link != model) {
+        link = &(*link)->next;
+    }
+    if (*link == model) {
+        *link = model->next;
+    }
+    model->detached = 1;
+    if (model->refs == 0) {
+        freeModel(model);
+    }
+}
+
+// NULL when out of memory
+static CachedModel *createModel(char **paths, int path_count, int weighted, const char *key) {
+    CachedModel *model = calloc(1, sizeof(CachedModel));
+    if (model == NULL) {
+        fprintf(stderr, "Failed to allocate cached model\n");
+        return NULL;
+    }
+    model->key = strdup(key);
+    model->paths = calloc(path_count, sizeof(char *));
+    model->signatures = calloc(path_count, sizeof(FileSignature));
+    if (model->key == NULL || model->paths == NULL || model->signatures == NULL) {
+        fprintf(stderr, "Failed to allocate cached model\n");
+        freeModel(model);
+        return NULL;
+    }
+    model->path_count = path_count;
+    for (int i = 0; i < path_count; i++) {
+        model->paths[i] = strdup(paths[i]);
+        if (model->paths[i] == NULL) {
+            fprintf(stderr, "Failed to allocate cached model\n");
+            freeModel(model);
+            return NULL;
+        }
+    }
+    model->weighted = weighted;
+    model->refs = 1;
+    return model;
+}
+
+// Analyse outside the cache lock, clients asking for other models are not held up
+static int loadModel(CachedModel *model) {
+    // Signatures are taken first, so a file changing mid analysis is picked up by the next request
+    for (int i = 0; i < model->path_count; i++) {
+        if (!readSignature(model->paths[i], &model->signatures[i])) {
+            return 0;
+        }
+    }
+
+    model->chef = rulechef_create();
+    if (model->chef == NULL) {
+        return 0;
+    }
+    if (server_max_memory > 0 && !rulechef_set_max_memory(model->chef, server_max_memory)) {
+        return 0;
+    }
+    for (int i = 0; i < model->path_count; i++) {
+        if (server_verbose) {
+            fprintf(stderr, "Analysing %s\n", model->paths[i]);
+        }
+        if (rulechef_analyse_file(model->chef, model->paths[i], model->weighted, 0) <= 0) {
+            return 0;
+        }
+    }
+
+    RuleChefStats stats;
+    rulechef_get_stats(model->chef, &stats);
+    if (stats.unigrams == 0) {
+        return 0;
+    }
+    rulechef_finalize(model->chef, 0);
+    return 1;
+}
+
+// Returns a referenced, analysed model for this input set, loading or reloading it when needed
+static CachedModel *acquireModel(char **paths, int path_count, int weighted, const char *key) {
+    pthread_mutex_lock(&cache_lock);
+    while (1) {
+        CachedModel *model = model_cache;
+        while (model != NULL && strcmp(model->key, key) != 0) {
+            model = model->next;
+        }
+        if (model == NULL) {
+            break;
+        }
+        if (!model->ready) {
+            // Another client is analysing the same inputs
+            pthread_cond_wait(&cache_loaded, &cache_lock);
+            continue;
+        }
+        if (modelIsCurrent(model)) {
+            model->refs++;
+            pthread_mutex_unlock(&cache_lock);
+            return model;
+        }
+        if (server_verbose) {
+            fprintf(stderr, "Inputs changed, reloading model\n");
+        }
+        detachModel(model);
+    }
+
+    CachedModel *model = createModel(paths, path_count, weighted, key);
+    if (model == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    model->next = model_cache;
+    model_cache = model;
+    pthread_mutex_unlock(&cache_lock);
+
+    int loaded = loadModel(model);
+
+    pthread_mutex_lock(&cache_lock);
+    model->ready = 1;
+    model->failed = !loaded;
+    if (!loaded) {
+        model->refs--;
+        detachModel(model);
+        model = NULL;
+    }
+    pthread_cond_broadcast(&cache_loaded);
+    pthread_mutex_unlock(&cache_lock);
+    return model;
+}
+
+static void releaseModel(CachedModel *model) {
+    pthread_mutex_lock(&cache_lock);
+    model->refs--;
+    if (model->detached && model->refs == 0) {
+        freeModel(model);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 1;
+}
+
+static void sendLine(int fd, const char *line) {
+    writeAll(fd, line, strlen(line));
+}
+
+static void socketSink(void *arg, const char *data, size_t len) {
+    ClientStream *stream = (ClientStream *)arg;
+    if (!stream->failed && !writeAll(stream->fd, data, len)) {
+        stream->failed = 1;
+    }
+}
+
+// Reads the single request line, returns its length or -1
+static long readRequest(int fd, char *request, size_t size) {
+    size_t used = 0;
+    while (used < size - 1) {
+        ssize_t got = recv(fd, request + used, size - 1 - used, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        char *newline = memchr(request + used, '\n', got);
+        used += got;
+        if (newline != NULL) {
+            used = newline - request;
+            break;
+        }
+    }
+    request[used] = '\0';
+    if (used > 0 && request[used - 1] == '\r') request[--used] = '\0';
+    return used > 0 ? (long)used : -1;
+}
+
+// Appends text to a growing reply, returns 0 when it cannot grow
+static int appendReply(char **reply, size_t *used, size_t *capacity, const char *text) {
+    size_t length = strlen(text);
+    if (*used + length + 1 > *capacity) {
+        size_t grown = (*capacity ? *capacity * 2 : 4096) + length;
+        char *larger = realloc(*reply, grown);
+        if (larger == NULL) {
+            return 0;
+        }
+        *reply = larger;
+        *capacity = grown;
+    }
+    memcpy(*reply + *used, text, length + 1);
+    *used += length;
+    return 1;
+}
+
+// The listing is formatted under cache_lock and sent after it is released, a client that stops reading
+// must never hold up the other workers
+static void listModels(int fd) {
+    char line[PATH_MAX + 128];
+    char *reply = NULL;
+    size_t used = 0;
+    size_t capacity = 0;
+    int complete = appendReply(&reply, &used, &capacity, "OK\n");
+
+    pthread_mutex_lock(&cache_lock);
+    for (CachedModel *model = model_cache; model != NULL && complete; model = model->next) {
+        if (!model->ready) continue;
+        RuleChefStats stats;
+        rulechef_get_stats(model->chef, &stats);
+        snprintf(line, sizeof(line), "%ld rules, %ld unigrams, %ld bigrams, %d clients, %s%s",
+                 stats.rules, stats.unigrams, stats.bigrams, model->refs,
+                 model->weighted ? "weighted " : "", model->paths[0]);
+        complete = appendReply(&reply, &used, &capacity, line);
+        for (int i = 1; i < model->path_count && complete; i++) {
+            complete = appendReply(&reply, &used, &capacity, " ") &&
+                       appendReply(&reply, &used, &capacity, model->paths[i]);
+        }
+        complete = complete && appendReply(&reply, &used, &capacity, "\n");
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (complete) {
+        writeAll(fd, reply, used);
+    } else {
+        sendLine(fd, "ERROR out of memory\n");
+    }
+    free(reply);
+}
+
+// Parses the GENERATE arguments with the same limits as the command line
+static const char *parseGenerateRequest(char *args, RuleChefParams *params, int *weighted,
+                                        char **paths, int *path_count, int max_paths) {
+    char *save = NULL;
+    char *token;
+
+    rulechef_default_params(params);
+    *weighted = 0;
+    *path_count = 0;
+
+    while ((token = strtok_r(args, " \t", &save)) != NULL) {
+        args = NULL;
+        if (token[0] == '-' && token[1] != '\0' && token[2] == '\0') {
+            char option = token[1];
+            if (option == 's') { params->simplify = 1; continue; }
+            if (option == 'j') { params->joint = 1; continue; }
+            if (option == 'w') { *weighted = 1; continue; }
+
+            char *value = strtok_r(NULL, " \t", &save);
+            if (value == NULL) {
+                return "missing option value";
+            }
+            switch (option) {
+                case 'm':
+                    params->min_length = atoi(value);
+                    if (params->min_length <= 0 || params->min_length > 10) return "min length must be between 1 and 10";
+                    break;
+                case 'M':
+                    params->max_length = atoi(value);
+                    if (params->max_length <= 0 || params->max_length > 16) return "max length must be between 1 and 16";
+                    break;
+                case 'p':
+                    params->min_probability = atof(value);
+                    if (params->min_probability < 0.0 || params->min_probability > 1.0) return "probability must be between 0.0 and 1.0";
+                    break;
+                case 'l':
+                    params->limit_unigrams = atof(value);
+                    if (params->limit_unigrams < 0 || params->limit_unigrams > 65535) return "limit must be between 0 and 65535";
+                    break;
+                default:
+                    return "unknown option";
+            }
+            continue;
+        }
+
+        if (*path_count == max_paths) {
+            return "too many rule files";
+        }
+        paths[*path_count] = realpath(token, NULL);
+        if (paths[*path_count] == NULL) {
+            return "rule file not found";
+        }
+        (*path_count)++;
+    }
+
+    if (*path_count == 0) {
+        return "no rule files";
+    }
+    if (params->min_length > params->max_length) {
+        return "min length cannot be greater than max length";
+    }
+    return NULL;
+}
+
+static void serveGenerate(int fd, char *args) {
+    char *paths[256];
+    int path_count = 0;
+    int weighted;
+    RuleChefParams params;
+    char error[256];
+
+    const char *problem = parseGenerateRequest(args, &params, &weighted, paths, &path_count, 256);
+    if (problem != NULL) {
+        snprintf(error, sizeof(error), "ERROR %s\n", problem);
+        sendLine(fd, error);
+        goto done;
+    }
+
+    // Cache key, the same files in the same order share a model
+    size_t key_length = 3;
+    for (int i = 0; i < path_count; i++) {
+        key_length += strlen(paths[i]) + 1;
+    }
+    char *key = malloc(key_length);
+    if (key == NULL) {
+        fprintf(stderr, "Failed to allocate model key\n");
+        sendLine(fd, "ERROR out of memory\n");
+        goto done;
+    }
+    strcpy(key, weighted ? "w\n" : "-\n");
+    for (int i = 0; i < path_count; i++) {
+        strcat(key, paths[i]);
+        strcat(key, "\n");
+    }
+
+    CachedModel *model = acquireModel(paths, path_count, weighted, key);
+    free(key);
+    if (model == NULL) {
+        sendLine(fd, "ERROR unable to analyse rule files\n");
+        goto done;
+    }
+
+    ClientStream stream = {fd, 0};
+    params.stop = &stream.failed;
+    sendLine(fd, "OK\n");
+    long written = rulechef_generate(model->chef, &params, socketSink, &stream);
+    releaseModel(model);
+
+    if (server_verbose) {
+        fprintf(stderr, "Generated %ld rules%s\n", written, stream.failed ? " (client disconnected)" : "");
+    }
+
+done:
+    for (int i = 0; i < path_count; i++) {
+        free(paths[i]);
+    }
+}
+
+static void *clientWorker(void *arg) {
+    ClientArgs *client = (ClientArgs *)arg;
+    int fd = client->fd;
+    free(client);
+
+    char *request = malloc(SERVER_REQUEST_MAX);
+    if (request == NULL) {
+        fprintf(stderr, "Failed to allocate request buffer\n");
+        close(fd);
+        return NULL;
+    }
+
+    if (readRequest(fd, request, SERVER_REQUEST_MAX) > 0) {
+        if (server_verbose) {
+            fprintf(stderr, "Request: %s\n", request);
+        }
+        if (strncmp(request, "GENERATE", 8) == 0 && (request[8] == ' ' || request[8] == '\t')) {
+            serveGenerate(fd, request + 9);
+        } else if (strcmp(request, "MODELS") == 0) {
+            listModels(fd);
+        } else {
+            sendLine(fd, "ERROR unknown command\n");
+        }
+    }
+
+    free(request);
+    close(fd);
+    return NULL;
+}
+
+int runRuleServer(const char *socket_path, size_t max_memory, int verbose) {
+    struct sockaddr_un address;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+
+    server_max_memory = max_memory;
+    server_verbose = verbose;
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    // Replace a stale socket left by a previous run, but never a regular file
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    // Only the owner may connect
+    mode_t old_mask = umask(0077);
+    int bound = bind(listener, (struct sockaddr *)&address, sizeof(address));
+    umask(old_mask);
+    if (bound != 0 || listen(listener, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        close(listener);
+        return 1;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Serving on %s\n", socket_path);
+    }
+
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        ClientArgs *client = malloc(sizeof(ClientArgs));
+        if (client == NULL) {
+            fprintf(stderr, "Failed to allocate client\n");
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, clientWorker, client) != 0) {
+            fprintf(stderr, "Failed to start client thread\n");
+            free(client);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "types.h"
+
+#define SERVER_REQUEST_MAX 65536
+#define SERVER_BACKLOG 64
+
+// Serve generation requests on a Unix domain socket, analysed models stay resident
+// Request:  "GENERATE [-m N] [-M N] [-p X] [-l N] [-s] [-j] [-w] file1 [file2...]\n"
+//           "MODELS\n"
+// Response: "OK\n" followed by the rules, or "ERROR <reason>\n", then the connection is closed
+int runRuleServer(const char *socket_path, size_t max_memory, int verbose);
+
+#endif
@@ -0,0 +1,106 @@
+#include <math.h>
+#include <stdint.h>
+#include "sketch.h"
+
+CountMinSketch *createCountMinSketch(size_t bytes, int depth) {
+    CountMinSketch *sketch = malloc(sizeof(CountMinSketch));
+    if (sketch == NULL) {
+        fprintf(stderr, "Failed to allocate count-min sketch\n");
+        return NULL;
+    }
+
+    sketch->depth = depth;
+    sketch->width = (long)(bytes / (depth * sizeof(long)));
+    if (sketch->width < 1024) sketch->width = 1024;
+    sketch->total = 0;
+    sketch->counters = calloc(sketch->width * depth, sizeof(long));
+    if (sketch->counters == NULL) {
+        fprintf(stderr, "Failed to allocate count-min sketch counters\n");
+        free(sketch);
+        return NULL;
+    }
+    return sketch;
+}
+
+void freeCountMinSketch(CountMinSketch *sketch) {
+    if (sketch != NULL) {
+        free(sketch->counters);
+        free(sketch);
+    }
+}
+
+// Two independent 64 bit hashes of the n-gram, the rows use h1 + i * h2
+static void hashSketchKey(CompleteOperation *ops, long op_count, uint64_t *h1, uint64_t *h2) {
+    uint64_t a = 14695981039346656037ULL;
+    uint64_t b = 5381;
+
+    for (long i = 0; i < op_count; i++) {
+        const char *str = ops[i].full_op;
+        while (*str) {
+            a = (a ^ (unsigned char)*str) * 1099511628211ULL;
+            b = ((b << 5) + b) + (unsigned char)*str;
+            str++;
+        }
+        a = (a ^ '|') * 1099511628211ULL;
+        b = ((b << 5) + b) + '|';
+    }
+    // Finalise b so low bits are well mixed
+    b ^= b >> 33;
+    b *= 0xff51afd7ed558ccdULL;
+    b ^= b >> 33;
+
+    *h1 = a;
+    *h2 = b | 1;
+}
+
+// Conservative update: only raise counters that are below the new minimum estimate
+long addCountMinSketch(CountMinSketch *sketch, CompleteOperation *ops, long op_count, long weight) {
+    uint64_t h1, h2;
+    long *cells[32];
+    long estimate = -1;
+
+    hashSketchKey(ops, op_count, &h1, &h2);
+    for (int i = 0; i < sketch->depth && i < 32; i++) {
+        long column = (long)((h1 + i * h2) % (uint64_t)sketch->width);
+        cells[i] = &sketch->counters[i * sketch->width + column];
+        if (estimate < 0 || *cells[i] < estimate) {
+            estimate = *cells[i];
+        }
+    }
+
+    estimate += weight;
+    for (int i = 0; i < sketch->depth && i < 32; i++) {
+        if (*cells[i] < estimate) {
+            *cells[i] = estimate;
+        }
+    }
+    sketch->total += weight;
+    return estimate;
+}
+
+long estimateCountMinSketch(CountMinSketch *sketch, CompleteOperation *ops, long op_count) {
+    uint64_t h1, h2;
+    long estimate = -1;
+
+    hashSketchKey(ops, op_count, &h1, &h2);
+    for (int i = 0; i < sketch->depth && i < 32; i++) {
+        long column = (long)((h1 + i * h2) % (uint64_t)sketch->width);
+        long value = sketch->counters[i * sketch->width + column];
+        if (estimate < 0 || value < estimate) {
+            estimate = value;
+        }
+    }
+    return estimate;
+}
+
+double getSketchEpsilon(CountMinSketch *sketch) {
+    return exp(1.0) / sketch->width;
+}
+
+double getSketchDelta(CountMinSketch *sketch) {
+    return exp(-(double)sketch->depth);
+}
+
+size_t getSketchBytes(CountMinSketch *sketch) {
+    return sketch->width * sketch->depth * sizeof(long);
+}
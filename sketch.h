@@ -0,0 +1,25 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include "types.h"
+
+// Count-min sketch over n-grams, estimates never undercount
+typedef struct CountMinSketch {
+    long *counters;
+    long width;
+    int depth;
+    long total;
+} CountMinSketch;
+
+// NULL when the counters cannot be allocated
+CountMinSketch *createCountMinSketch(size_t bytes, int depth);
+void freeCountMinSketch(CountMinSketch *sketch);
+long addCountMinSketch(CountMinSketch *sketch, CompleteOperation *ops, long op_count, long weight);
+long estimateCountMinSketch(CountMinSketch *sketch, CompleteOperation *ops, long op_count);
+
+// Error bound: estimates exceed the true count by at most epsilon * total with probability 1 - delta
+double getSketchEpsilon(CountMinSketch *sketch);
+double getSketchDelta(CountMinSketch *sketch);
+size_t getSketchBytes(CountMinSketch *sketch);
+
+#endif
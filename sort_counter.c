@@ -0,0 +1,274 @@
+#include "sort_counter.h"
+
+typedef struct {
+    SortedCount *counts;
+    long length;
+} SortedRun;
+
+struct SortCounter {
+    SortedCount *batch;
+    SortedCount *scratch;   // Radix sort ping-pong buffer
+    long batch_used;
+    uint64_t sequence;      // Bigrams added so far
+    SortedRun *runs;        // Run lengths shrink towards the top of the stack
+    int run_count;
+    int run_capacity;
+    int failed;             // Counts were lost for want of memory
+};
+
+SortCounter *createSortCounter(void) {
+    SortCounter *counter = calloc(1, sizeof(SortCounter));
+    if (counter == NULL) {
+        fprintf(stderr, "Failed to allocate sort counter\n");
+    }
+    return counter;
+}
+
+static void sortCounterLost(SortCounter *counter, long lost) {
+    if (!counter->failed) {
+        fprintf(stderr, "Failed to allocate sorted bigram counts, %ld bigrams are lost\n", lost);
+    }
+    counter->failed = 1;
+}
+
+int sortCounterFailed(const SortCounter *counter) {
+    return counter != NULL && counter->failed;
+}
+
+void freeSortCounter(SortCounter *counter) {
+    if (counter == NULL) return;
+
+    for (int i = 0; i < counter->run_count; i++) {
+        free(counter->runs[i].counts);
+    }
+    free(counter->runs);
+    free(counter->batch);
+    free(counter->scratch);
+    free(counter);
+}
+
+static uint32_t packOperation(const CompleteOperation *op) {
+    uint32_t packed = 0;
+    for (int i = 0; i < op->length; i++) {
+        packed |= (uint32_t)(unsigned char)op->full_op[i] << (8 * i);
+    }
+    return packed;
+}
+
+void unpackSortKey(uint64_t key, CompleteOperation ops[2]) {
+    uint32_t packed[2] = {(uint32_t)(key >> 32), (uint32_t)key};
+
+    for (int o = 0; o < 2; o++) {
+        CompleteOperation *op = &ops[o];
+        int length = 0;
+        memset(op->full_op, 0, sizeof(op->full_op));
+        while (length < 4 && ((packed[o] >> (8 * length)) & 0xff) != 0) {
+            op->full_op[length] = (char)((packed[o] >> (8 * length)) & 0xff);
+            length++;
+        }
+        op->length = length;
+        op->base_op = op->full_op[0];
+    }
+}
+
+static inline uint64_t sortField(const SortedCount *record, int by_first) {
+    return by_first ? record->first : record->key;
+}
+
+// Stable LSD radix sort on the 8 bytes of the key (or of first), passes where every record has the same
+// byte are skipped. Returns whichever of the two buffers holds the sorted records
+static SortedCount *radixSortCounts(SortedCount *data, SortedCount *scratch, long n, int by_first) {
+    enum { passes = 8 };
+    long histogram[passes][256];
+
+    memset(histogram, 0, sizeof(histogram));
+
+    for (long i = 0; i < n; i++) {
+        uint64_t key = sortField(&data[i], by_first);
+        for (int b = 0; b < passes; b++) {
+            histogram[b][(key >> (8 * b)) & 0xff]++;
+        }
+    }
+
+    SortedCount *src = data;
+    SortedCount *dst = scratch;
+    for (int b = 0; b < passes; b++) {
+        if (histogram[b][(sortField(&src[0], by_first) >> (8 * b)) & 0xff] == n) {
+            continue;
+        }
+
+        long offset = 0;
+        for (int v = 0; v < 256; v++) {
+            long bucket = histogram[b][v];
+            histogram[b][v] = offset;
+            offset += bucket;
+        }
+        for (long i = 0; i < n; i++) {
+            dst[histogram[b][(sortField(&src[i], by_first) >> (8 * b)) & 0xff]++] = src[i];
+        }
+
+        SortedCount *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+// Two way merge into a, equal keys are summed and keep the earliest first
+// Returns 0 and leaves both runs as they were when the merged run cannot be allocated
+static int mergeRuns(SortedRun *a, SortedRun *b) {
+    SortedRun merged;
+    merged.counts = malloc((a->length + b->length) * sizeof(SortedCount));
+    if (merged.counts == NULL) {
+        return 0;
+    }
+
+    long i = 0, j = 0, n = 0;
+    while (i < a->length && j < b->length) {
+        if (a->counts[i].key < b->counts[j].key) {
+            merged.counts[n++] = a->counts[i++];
+        } else if (a->counts[i].key > b->counts[j].key) {
+            merged.counts[n++] = b->counts[j++];
+        } else {
+            merged.counts[n] = a->counts[i++];
+            merged.counts[n].count += b->counts[j].count;
+            if (b->counts[j].first < merged.counts[n].first) {
+                merged.counts[n].first = b->counts[j].first;
+            }
+            n++;
+            j++;
+        }
+    }
+    while (i < a->length) merged.counts[n++] = a->counts[i++];
+    while (j < b->length) merged.counts[n++] = b->counts[j++];
+    merged.length = n;
+
+    free(a->counts);
+    free(b->counts);
+
+    SortedCount *shrunk = realloc(merged.counts, (n > 0 ? n : 1) * sizeof(SortedCount));
+    if (shrunk != NULL) {
+        merged.counts = shrunk;
+    }
+    *a = merged;
+    return 1;
+}
+
+static void pushRun(SortCounter *counter, SortedRun run) {
+    if (counter->run_count == counter->run_capacity) {
+        int capacity = counter->run_capacity ? counter->run_capacity * 2 : 16;
+        SortedRun *runs = realloc(counter->runs, capacity * sizeof(SortedRun));
+        if (runs == NULL) {
+            sortCounterLost(counter, run.length);
+            free(run.counts);
+            return;
+        }
+        counter->runs = runs;
+        counter->run_capacity = capacity;
+    }
+    counter->runs[counter->run_count++] = run;
+
+    // Keep run lengths roughly geometric so each count is merged O(log n) times, a merge that cannot be
+    // allocated leaves the runs for a later one
+    while (counter->run_count >= 2 &&
+           counter->runs[counter->run_count - 2].length <= 2 * counter->runs[counter->run_count - 1].length) {
+        SortedRun *top = &counter->runs[counter->run_count - 1];
+        SortedRun *below = &counter->runs[counter->run_count - 2];
+        if (!mergeRuns(below, top)) {
+            break;
+        }
+        counter->run_count--;
+    }
+}
+
+// Sorts the batch and aggregates equal keys into a new run, the sort is stable so the earliest first is kept
+static void flushSortBatch(SortCounter *counter) {
+    long n = counter->batch_used;
+    if (n == 0) return;
+
+    SortedCount *sorted = radixSortCounts(counter->batch, counter->scratch, n, 0);
+    long unique = 0;
+    for (long i = 0; i < n; i++) {
+        if (unique > 0 && sorted[unique - 1].key == sorted[i].key) {
+            sorted[unique - 1].count += sorted[i].count;
+        } else {
+            sorted[unique++] = sorted[i];
+        }
+    }
+
+    SortedRun run;
+    run.length = unique;
+    run.counts = malloc(unique * sizeof(SortedCount));
+    counter->batch_used = 0;
+    if (run.counts == NULL) {
+        sortCounterLost(counter, unique);
+        return;
+    }
+    memcpy(run.counts, sorted, unique * sizeof(SortedCount));
+
+    pushRun(counter, run);
+}
+
+void addSortCounter(SortCounter *counter, const CompleteOperation *ops, long weight) {
+    if (counter->batch == NULL) {
+        counter->batch = malloc(SORT_COUNT_BATCH * sizeof(SortedCount));
+        counter->scratch = malloc(SORT_COUNT_BATCH * sizeof(SortedCount));
+        if (counter->batch == NULL || counter->scratch == NULL) {
+            free(counter->batch);
+            free(counter->scratch);
+            counter->batch = NULL;
+            counter->scratch = NULL;
+            sortCounterLost(counter, 1);
+            return;
+        }
+    }
+
+    SortedCount *record = &counter->batch[counter->batch_used++];
+    record->key = ((uint64_t)packOperation(&ops[0]) << 32) | packOperation(&ops[1]);
+    record->count = weight;
+    record->first = counter->sequence++;
+
+    if (counter->batch_used == SORT_COUNT_BATCH) {
+        flushSortBatch(counter);
+    }
+}
+
+SortedCount *drainSortCounter(SortCounter *counter, long *count) {
+    flushSortBatch(counter);
+    free(counter->batch);
+    free(counter->scratch);
+    counter->batch = NULL;
+    counter->scratch = NULL;
+
+    while (counter->run_count >= 2) {
+        SortedRun *top = &counter->runs[counter->run_count - 1];
+        SortedRun *below = &counter->runs[counter->run_count - 2];
+        if (!mergeRuns(below, top)) {
+            sortCounterLost(counter, top->length);
+            free(top->counts);
+        }
+        counter->run_count--;
+    }
+
+    if (counter->run_count == 0) {
+        *count = 0;
+        return NULL;
+    }
+    counter->run_count = 0;
+    *count = counter->runs[0].length;
+
+    // Back into order of first occurrence
+    SortedCount *counts = counter->runs[0].counts;
+    SortedCount *scratch = malloc(*count * sizeof(SortedCount));
+    if (scratch == NULL) {
+        // The counts are still exact, only ties between bigrams break differently than with hashing
+        return counts;
+    }
+    SortedCount *sorted = radixSortCounts(counts, scratch, *count, 1);
+    if (sorted == scratch) {
+        free(counts);
+    } else {
+        free(scratch);
+    }
+    return sorted;
+}
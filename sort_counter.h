@@ -0,0 +1,34 @@
+#ifndef SORT_COUNTER_H
+#define SORT_COUNTER_H
+
+#include <stdint.h>
+#include "types.h"
+
+#define SORT_COUNT_BATCH (1 << 21)     // Bigrams collected before a batch is sorted (48 MB of records)
+
+// Bigram with its count, the key packs the two ops' full_op bytes (at most 4 each) into 64 bits
+// first is the position of its first occurrence, so the table can be filled in the same order as hashing
+typedef struct {
+    uint64_t key;
+    long count;
+    uint64_t first;
+} SortedCount;
+
+// Sort based bigram counting: keys are appended to a batch, a full batch is radix sorted and run length
+// aggregated into a sorted run, and runs are merged as they accumulate. Memory is touched sequentially
+// instead of one random hash probe per bigram, which matters once the bigrams outgrow the caches
+typedef struct SortCounter SortCounter;
+
+// NULL when out of memory. Counts that cannot be stored later are dropped and sortCounterFailed is set
+SortCounter *createSortCounter(void);
+void freeSortCounter(SortCounter *counter);
+void addSortCounter(SortCounter *counter, const CompleteOperation *ops, long weight);
+int sortCounterFailed(const SortCounter *counter);
+
+// Merges everything counted so far and hands it over in order of first occurrence, the counter is left
+// empty. The caller frees the returned array, NULL when nothing was counted
+SortedCount *drainSortCounter(SortCounter *counter, long *count);
+
+void unpackSortKey(uint64_t key, CompleteOperation ops[2]);
+
+#endif
@@ -0,0 +1,339 @@
+#include "trie.h"
+#include "buffer.h"
+#include "rule_parser.h"
+
+#define TRIE_OP_SLOTS 32768             // Power of two, at least twice TRIE_MAX_OPS
+#define TRIE_RECORD_MAX (4 + 2 * MAX_RULE_LEN)
+#define TRIE_READ_SIZE (1 << 20)
+
+struct RuleChefTrieWriter {
+    WBuffer output;
+    uint32_t keys[TRIE_OP_SLOTS];       // Op bytes packed little endian, 0 for an empty slot
+    uint16_t ids[TRIE_OP_SLOTS];
+    int op_count;
+    int previous[MAX_RULE_LEN];         // Op ids of the last rule written
+    int previous_length;
+    long rules;
+    long skipped;
+    size_t bytes;
+};
+
+static uint32_t packTrieOp(const char *op) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 4 && op[i] != '\0'; i++) {
+        packed |= (uint32_t)(unsigned char)op[i] << (8 * i);
+    }
+    return packed;
+}
+
+static void flushTrieOutput(RuleChefTrieWriter *writer) {
+    writer->bytes += writer->output.bufferUsed;
+    flush_buffer(&writer->output);
+}
+
+static void putTrieId(RuleChefTrieWriter *writer, int id) {
+    unsigned char *out = (unsigned char *)writer->output.buffer + writer->output.bufferUsed;
+
+    if (id < TRIE_SHORT_IDS) {
+        out[0] = (unsigned char)id;
+        writer->output.bufferUsed += 1;
+    } else {
+        out[0] = (unsigned char)(TRIE_SHORT_IDS + ((id - TRIE_SHORT_IDS) >> 8));
+        out[1] = (unsigned char)(id - TRIE_SHORT_IDS);
+        writer->output.bufferUsed += 2;
+    }
+}
+
+// Id of op, defining it in the stream the first time it is seen, -1 when the id space is exhausted
+static int trieOpId(RuleChefTrieWriter *writer, const char *op) {
+    uint32_t key = packTrieOp(op);
+    uint32_t slot = (key * 0x9E3779B1u) >> 17;
+
+    while (writer->keys[slot] != 0) {
+        if (writer->keys[slot] == key) {
+            return writer->ids[slot];
+        }
+        slot = (slot + 1) & (TRIE_OP_SLOTS - 1);
+    }
+    if (writer->op_count == TRIE_MAX_OPS) {
+        return -1;
+    }
+
+    int length = strlen(op);
+    char *out = writer->output.buffer + writer->output.bufferUsed;
+    out[0] = (char)TRIE_DEFINE;
+    out[1] = (char)length;
+    memcpy(out + 2, op, length);
+    writer->output.bufferUsed += 2 + length;
+
+    writer->keys[slot] = key;
+    writer->ids[slot] = (uint16_t)writer->op_count;
+    return writer->op_count++;
+}
+
+RuleChefTrieWriter *createTrieWriter(RuleChefSink sink, void *sink_arg) {
+    RuleChefTrieWriter *writer = calloc(1, sizeof(RuleChefTrieWriter));
+    if (writer == NULL) {
+        fprintf(stderr, "Failed to allocate trie writer\n");
+        return NULL;
+    }
+    if (!init_buffer(&writer->output)) {
+        free(writer);
+        return NULL;
+    }
+    writer->output.sink = sink;
+    writer->output.sink_arg = sink_arg;
+
+    memcpy(writer->output.buffer, TRIE_MAGIC, TRIE_MAGIC_LENGTH);
+    writer->output.bufferUsed = TRIE_MAGIC_LENGTH;
+    return writer;
+}
+
+static void writeTrieRule(RuleChefTrieWriter *writer, char *rule) {
+    ParsedRule parsed;
+    int ids[MAX_RULE_LEN];
+
+    if (!tokenizeRule(rule, &parsed) || parsed.op_count == 0) {
+        writer->skipped++;
+        return;
+    }
+
+    // Room for the definitions of every op of the rule and the record itself
+    if (writer->output.bufferUsed + TRIE_RECORD_MAX + 6 * MAX_RULE_LEN > writer->output.bufferSize) {
+        flushTrieOutput(writer);
+    }
+    for (int i = 0; i < parsed.op_count; i++) {
+        ids[i] = trieOpId(writer, parsed.operations[i].full_op);
+        if (ids[i] < 0) {
+            writer->skipped++;
+            return;
+        }
+    }
+
+    int keep = 0;
+    while (keep < parsed.op_count && keep < writer->previous_length && ids[keep] == writer->previous[keep]) {
+        keep++;
+    }
+
+    if (keep == writer->previous_length - 1 && parsed.op_count == writer->previous_length) {
+        putTrieId(writer, ids[keep]);
+    } else {
+        unsigned char *out = (unsigned char *)writer->output.buffer + writer->output.bufferUsed;
+        int count = parsed.op_count - keep;
+        out[0] = TRIE_BRANCH;
+        if (keep < TRIE_WIDE_BRANCH && count <= 0x0F) {
+            out[1] = (unsigned char)(keep << 4 | count);
+            writer->output.bufferUsed += 2;
+        } else {
+            out[1] = TRIE_WIDE_BRANCH << 4;
+            out[2] = (unsigned char)keep;
+            out[3] = (unsigned char)count;
+            writer->output.bufferUsed += 4;
+        }
+        for (int i = keep; i < parsed.op_count; i++) {
+            putTrieId(writer, ids[i]);
+        }
+    }
+
+    memcpy(writer->previous + keep, ids + keep, (parsed.op_count - keep) * sizeof(int));
+    writer->previous_length = parsed.op_count;
+    writer->rules++;
+}
+
+void writeTrieRules(RuleChefTrieWriter *writer, const char *data, size_t len) {
+    char rule[MAX_RULE_LEN];
+    const char *end = data + len;
+
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t length = (newline != NULL ? newline : end) - data;
+
+        if (length > 0 && length < MAX_RULE_LEN) {
+            memcpy(rule, data, length);
+            rule[length] = '\0';
+            writeTrieRule(writer, rule);
+        } else if (length > 0) {
+            writer->skipped++;
+        }
+        data += length + 1;
+    }
+}
+
+long closeTrieWriter(RuleChefTrieWriter *writer, int verbose) {
+    if (writer == NULL) return 0;
+
+    flushTrieOutput(writer);
+    long rules = writer->rules;
+    if (verbose) {
+        fprintf(stderr, "Trie output: %ld rules, %d ops, %zu bytes (%.2f bytes per rule)\n",
+                rules, writer->op_count, writer->bytes, rules > 0 ? (double)writer->bytes / rules : 0.0);
+    }
+    if (writer->skipped > 0) {
+        fprintf(stderr, "Warning: %ld rules could not be written to the trie output\n", writer->skipped);
+    }
+    free_buffer(&writer->output);
+    free(writer);
+    return rules;
+}
+
+typedef struct {
+    FILE *input;
+    unsigned char *data;
+    size_t used;
+    size_t length;
+    int eof;
+} TrieReader;
+
+// Keeps at least a whole record buffered unless the stream ends first
+static void refillTrieReader(TrieReader *reader) {
+    if (reader->eof || reader->length - reader->used >= TRIE_RECORD_MAX) {
+        return;
+    }
+    memmove(reader->data, reader->data + reader->used, reader->length - reader->used);
+    reader->length -= reader->used;
+    reader->used = 0;
+    while (!reader->eof && reader->length < TRIE_READ_SIZE) {
+        size_t got = fread(reader->data + reader->length, 1, TRIE_READ_SIZE - reader->length, reader->input);
+        if (got == 0) {
+            reader->eof = 1;
+        }
+        reader->length += got;
+    }
+}
+
+static int readTrieId(TrieReader *reader, const unsigned char *end) {
+    const unsigned char *in = reader->data + reader->used;
+    if (in >= end) {
+        return -1;
+    }
+    if (in[0] < TRIE_SHORT_IDS) {
+        reader->used += 1;
+        return in[0];
+    }
+    if (in[0] >= TRIE_DEFINE || in + 1 >= end) {
+        return -1;
+    }
+    reader->used += 2;
+    return TRIE_SHORT_IDS + ((in[0] - TRIE_SHORT_IDS) << 8 | in[1]);
+}
+
+long expandTrieStream(FILE *input, WBuffer *output_buffer) {
+    char magic[TRIE_MAGIC_LENGTH];
+    if (fread(magic, 1, TRIE_MAGIC_LENGTH, input) != TRIE_MAGIC_LENGTH ||
+        memcmp(magic, TRIE_MAGIC, TRIE_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "Error: not a rulechef trie stream\n");
+        return -1;
+    }
+
+    TrieReader reader = {input, malloc(TRIE_READ_SIZE), 0, 0, 0};
+    char (*ops)[8] = malloc(TRIE_MAX_OPS * sizeof(*ops));   // Op text padded so it is copied as 8 bytes
+    unsigned char *op_lengths = malloc(TRIE_MAX_OPS);
+    if (reader.data == NULL || ops == NULL || op_lengths == NULL) {
+        fprintf(stderr, "Failed to allocate trie reader\n");
+        free(reader.data);
+        free(ops);
+        free(op_lengths);
+        return -1;
+    }
+
+    char rule[MAX_RULE_LEN + 8];
+    int ends[MAX_RULE_LEN + 1];         // Rule length in bytes up to each depth
+    int depth = 0;
+    int op_count = 0;
+    long rules = 0;
+    int corrupt = 0;
+    size_t limit = output_buffer->bufferSize - (MAX_RULE_LEN + 8);
+
+    ends[0] = 0;
+    while (1) {
+        refillTrieReader(&reader);
+        if (reader.used == reader.length) {
+            break;
+        }
+
+        const unsigned char *end = reader.data + reader.length;
+        int record = reader.data[reader.used];
+
+        if (record == TRIE_DEFINE) {
+            const unsigned char *in = reader.data + reader.used;
+            if (in + 2 > end || in[1] == 0 || in[1] > 4 || in + 2 + in[1] > end || op_count == TRIE_MAX_OPS) {
+                corrupt = 1;
+                break;
+            }
+            memset(ops[op_count], 0, sizeof(ops[0]));
+            memcpy(ops[op_count], in + 2, in[1]);
+            op_lengths[op_count++] = in[1];
+            reader.used += 2 + in[1];
+            continue;
+        }
+
+        if (record == TRIE_BRANCH) {
+            const unsigned char *in = reader.data + reader.used;
+            int keep, count;
+            if (in + 2 > end) {
+                corrupt = 1;
+                break;
+            }
+            if (in[1] >> 4 != TRIE_WIDE_BRANCH) {
+                keep = in[1] >> 4;
+                count = in[1] & 0x0F;
+                reader.used += 2;
+            } else if (in + 4 <= end) {
+                keep = in[2];
+                count = in[3];
+                reader.used += 4;
+            } else {
+                corrupt = 1;
+                break;
+            }
+            if (keep > depth || keep + count == 0 || keep + count >= MAX_RULE_LEN) {
+                corrupt = 1;
+                break;
+            }
+            depth = keep;
+            for (int i = 0; i < count; i++) {
+                int id = readTrieId(&reader, end);
+                if (id < 0 || id >= op_count || ends[depth] + op_lengths[id] >= MAX_RULE_LEN) {
+                    corrupt = 1;
+                    break;
+                }
+                memcpy(rule + ends[depth], ops[id], sizeof(ops[0]));
+                ends[depth + 1] = ends[depth] + op_lengths[id];
+                depth++;
+            }
+            if (corrupt) {
+                break;
+            }
+        } else {
+            // Sibling of the previous rule
+            int id = readTrieId(&reader, end);
+            if (depth == 0 || id < 0 || id >= op_count || ends[depth - 1] + op_lengths[id] >= MAX_RULE_LEN) {
+                corrupt = 1;
+                break;
+            }
+            memcpy(rule + ends[depth - 1], ops[id], sizeof(ops[0]));
+            ends[depth] = ends[depth - 1] + op_lengths[id];
+        }
+
+        if (output_buffer->bufferUsed > limit) {
+            flush_buffer(output_buffer);
+        }
+        char *out = output_buffer->buffer + output_buffer->bufferUsed;
+        memcpy(out, rule, ends[depth]);
+        out[ends[depth]] = '\n';
+        output_buffer->bufferUsed += ends[depth] + 1;
+        rules++;
+    }
+    output_buffer->writeCount += rules;
+    flush_buffer(output_buffer);
+
+    free(reader.data);
+    free(ops);
+    free(op_lengths);
+
+    if (corrupt || ferror(input)) {
+        fprintf(stderr, "Error: trie stream is truncated or corrupt after %ld rules\n", rules);
+        return -1;
+    }
+    return rules;
+}
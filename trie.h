@@ -0,0 +1,37 @@
+#ifndef TRIE_H
+#define TRIE_H
+
+#include "types.h"
+
+// Binary rule output: each rule is stored as the ops it shares with the previous rule plus the ops that
+// differ, which is the preorder walk of the prefix trie of the rules. Generation emits siblings next to
+// each other, so most rules take a single byte: the op id that replaces the previous rule's last op.
+//
+// Stream layout, after the "RCTRIE1\n" magic:
+//   id < 0xC0                 rule: previous rule with its last op replaced by op id
+//   0xC0-0xFD, low byte       the same with a two byte id, 0xC0 + ((first - 0xC0) << 8 | low)
+//   0xFE, length, bytes       op definition, takes the next id (ids are defined before their first use)
+//   0xFF, keep << 4 | count, ids
+//                             rule: first keep ops of the previous rule followed by count ops
+//   0xFF, 0xF?, keep, count, ids
+//                             the same when keep or count does not fit in four bits
+#define TRIE_MAGIC "RCTRIE1\n"
+#define TRIE_MAGIC_LENGTH 8
+#define TRIE_SHORT_IDS 0xC0
+#define TRIE_DEFINE 0xFE
+#define TRIE_BRANCH 0xFF
+#define TRIE_WIDE_BRANCH 0x0F      // Keep nibble that announces full keep and count bytes
+#define TRIE_MAX_OPS (TRIE_SHORT_IDS + (TRIE_DEFINE - TRIE_SHORT_IDS) * 256)
+
+// Writer for newline terminated rules, the stream goes to sink (stdout when sink is NULL), NULL on failure
+RuleChefTrieWriter *createTrieWriter(RuleChefSink sink, void *sink_arg);
+void writeTrieRules(RuleChefTrieWriter *writer, const char *data, size_t len);
+
+// Flushes and frees the writer, returns the number of rules written
+long closeTrieWriter(RuleChefTrieWriter *writer, int verbose);
+
+// Streams the rules of a trie file back out as text, returns the number of rules, or -1 on a bad stream
+// or when the reader cannot be allocated
+long expandTrieStream(FILE *input, WBuffer *output_buffer);
+
+#endif
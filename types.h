@@ -4,18 +4,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "rulechef.h"
+#include "arena.h"
 
 // Constants
-#define STARTER_HASH_SIZE 1048573
 #define K_SMOOTHING_FACTOR 1
 #define MAX_RULE_LEN 80
 
 #define MAX_OPERATIONS 512 * 512
 #define WriteBufferSize 10240000
-#define UNIGRAM_HASH_SIZE 1048573
 
 #define HASH_SIZE 65536
 #define POOL_BLOCK_SIZE 65536
+#define POOL_FIRST_BLOCK_SIZE 256
 
 // Core data structures
 typedef struct {
@@ -50,6 +53,9 @@ typedef struct writeBuffer {
     size_t bufferUsed;
     char *buffer;
     size_t writeCount;
+    FILE *stream;                                          // Where flushed rules are written (stdout by default)
+    void (*sink)(void *arg, const char *data, size_t len); // Optional consumer that replaces stream
+    void *sink_arg;
 } WBuffer;
 
 // Rule parsing structure
@@ -73,12 +79,6 @@ typedef struct NGramHashNode {
     struct NGramHashNode *next;
 } NGramHashNode;
 
-typedef struct HashNode {
-    char rule_string[MAX_RULE_LEN];
-    struct HashNode *next;
-} HashNode;
-
-
 typedef struct NodePool {
     NGramHashNode *nodes;
     long used_in_block;
@@ -86,11 +86,29 @@ typedef struct NodePool {
     struct NodePool *next_block;
 } NodePool;
 
+// Chained hash table that starts small and grows with the data
+// Nodes live in the table's own pool, so live entries can be walked without sweeping the buckets
+typedef struct {
+    NGramHashNode **buckets; // NULL until the first insert
+    long size;
+    int prime_idx;
+    long count;
+    NodePool *pool;
+    NGramHashNode *free_nodes; // Evicted nodes (op_count 0) waiting for reuse
+    Arena *arena;              // Where the pool blocks come from, shared by the model's tables
+} NGramHashTable;
+
+typedef struct {
+    NodePool *block;
+    long index;
+} NGramIterator;
+
 // Optimization structures
 typedef struct {
     CompleteOperation *next_op;
     double probability;
-    int frequency;
+    long frequency;
+    NGramHashNode *node;        // The bigram, pruning and renormalisation are written back to it
 } SortedTransition;
 
 typedef struct {
@@ -101,13 +119,63 @@ typedef struct {
     double min_probability;
 } FastTransitionLookup;
 
-// Global hash table declarations
-
-extern NGramHashNode **unigram_hash_table;
-extern NGramHashNode **bigram_hash_table;
-extern NGramHashNode **trigram_hash_table;
-extern HashNode *hash_table[HASH_SIZE];
-extern NGramHashNode **starter_hash_table;
-extern long starter_count;
+// Bounded bigram counting (--max-memory), exact counts for heavy hitters and a sketch for the rest
+struct CountMinSketch;
+typedef struct {
+    struct CountMinSketch *sketch;  // NULL when unbounded
+    long capacity;                  // Max exact bigram entries
+    long evicted_max;               // Highest count ever evicted, bounds the count lost by a re-admitted bigram
+    long prune_count;
+    long evicted_total;
+    size_t bytes;
+} BigramBudget;
+
+// Input sampling, the model is built from a subset of the lines read
+typedef struct {
+    double rate;                    // Fraction of lines analysed, 0 analyses every line
+    long lines;                     // Reservoir size, 0 analyses every line
+    unsigned long long seed;
+    long lines_read;                // Lines seen, sampled or skipped
+    long lines_sampled;             // Lines handed to the parser
+} InputSampling;
+
+// Analysis and generation context, everything a model needs lives here (see rulechef.h)
+struct RuleChef {
+    NGramHashTable unigram_hash_table;
+    NGramHashTable bigram_hash_table;
+    NGramHashTable trigram_hash_table;
+    NGramHashTable starter_hash_table;
+
+    long rule_count;
+    long unigram_count;
+    long bigram_count;
+    long trigram_count;
+    long transition_count;
+    long starter_count;
+
+    BigramBudget bigram_budget;
+    Arena model_arena;                  // N-gram nodes, released all at once with the model
+    struct SortCounter *sort_counter;   // Sort based bigram counting, NULL when each bigram is hashed
+    InputSampling input_sampling;
+
+    // Held-out split for evaluation, a seeded fraction of the analysed lines goes to holdout instead
+    RuleChefEval *holdout;
+    double holdout_ratio;
+    uint64_t holdout_state;
+
+    // Transition pruning, applied when the model is finalized
+    long min_count;                     // Bigrams seen fewer times are dropped before normalisation
+    int max_branch;                     // Successors kept per op, 0 keeps all
+    int renormalize;                    // Kept successors sum to 1 again after max_branch
+
+    // Built from the bigrams once analysis is finished, read only during generation
+    Arena lookup_arena;                 // Rewound whenever the model changes
+    FastTransitionLookup *fast_lookup;
+    void *lookup_index;                 // JudySL from_op -> row + 1
+    int fast_lookup_count;
+    int max_transition_count;
+    int finalized;
+    pthread_mutex_t lock;
+};
 
 #endif